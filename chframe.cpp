@@ -0,0 +1,102 @@
+#include "chframe.h"
+#include "crc.h"
+
+static size_t putEscaped(uint8_t *pOut, uint8_t c) {
+  size_t n = 0;
+
+  if ((c == CHFRAME_STX) || (c == CHFRAME_ESC)) {
+    pOut[n++] = CHFRAME_ESC;
+  }
+  pOut[n++] = c;
+  return n;
+}
+
+size_t chFrameEncode(const uint8_t *pPayload, uint16_t len, uint8_t *pOut) {
+  uint16_t crc = crc_finalize(crc_update(crc_init(), pPayload, len));
+  size_t n = 0;
+  uint16_t i;
+
+  pOut[n++] = CHFRAME_STX;
+  if (len > 0xff) {
+    pOut[n++] = CHFRAME_EXT_LENGTH;
+    n += putEscaped(&pOut[n], len >> 8);
+  }
+  n += putEscaped(&pOut[n], len & 0xff);
+  for (i=0; i<len; i++) {
+    n += putEscaped(&pOut[n], pPayload[i]);
+  }
+  n += putEscaped(&pOut[n], crc >> 8);
+  n += putEscaped(&pOut[n], crc & 0xff);
+
+  return n;
+}
+
+chFrameParser::chFrameParser(uint8_t *pBuf, uint16_t bufSize) {
+  this->pBuf = pBuf;
+  this->bufSize = bufSize;
+  len = 0;
+  index = 0;
+  reset();
+}
+
+void chFrameParser::reset(void) {
+  state = waitingForStx;
+  escaped = 0;
+}
+
+uint8_t chFrameParser::feed(uint8_t c) {
+  uint16_t crc;
+
+  if ((c == CHFRAME_STX) && !escaped) {
+    uint8_t result = (state == waitingForStx) ? CHFRAME_NONE : CHFRAME_ABORTED;
+    state = waitingForLength;
+    len = 0;
+    return result;
+  }
+  if (state == waitingForStx) {
+    return CHFRAME_NONE;
+  }
+  if ((c == CHFRAME_ESC) && !escaped) {
+    escaped = 1;
+    return CHFRAME_NONE;
+  }
+  escaped = 0;
+
+  switch (state) {
+    case waitingForLength:
+      if (c == CHFRAME_EXT_LENGTH) {
+        state = waitingForExtLength;
+        lengthBytes = 2;
+        return CHFRAME_NONE;
+      }
+      len = c;
+      break;
+    case waitingForExtLength:
+      len = (len << 8) | c;
+      if (--lengthBytes > 0) {
+        return CHFRAME_NONE;
+      }
+      break;
+    default:
+      pBuf[index++] = c;
+      if (index < len + 2) {
+        return CHFRAME_NONE;
+      }
+      state = waitingForStx;
+      crc = crc_finalize(crc_update(crc_init(), pBuf, len));
+      if (crc != (uint16_t)((pBuf[len] << 8) | pBuf[len+1])) {
+        return CHFRAME_CRC_ERROR;
+      }
+      pBuf[len] = 0;
+      return CHFRAME_OK;
+  }
+
+  // got the length
+  if ((len == 0) || (len > bufSize - 2)) {
+    state = waitingForStx;
+    return CHFRAME_BAD_LENGTH;
+  }
+  index = 0;
+  state = waitingForPayload;
+  return CHFRAME_NONE;
+}
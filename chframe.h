@@ -0,0 +1,63 @@
+/*
+ * The ChillHub serial framing, for code on either end of the link that
+ * does not run chInterface, such as the hub side gateway and host tools.
+ *
+ * A frame is STX, the payload length, the payload and the CRC-16 of the
+ * payload, big endian.  STX and ESC anywhere after the STX are sent as ESC
+ * followed by the byte.  Lengths above 255 are sent as a zero byte followed
+ * by the 16 bit length.  An unescaped STX always starts a new frame.
+ */
+#ifndef CHFRAME_H
+#define CHFRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CHFRAME_STX 0xff
+#define CHFRAME_ESC 0xfe
+#define CHFRAME_EXT_LENGTH 0x00
+
+// Room chFrameEncode() needs for a payload of len bytes.
+#define CHFRAME_ENCODED_SIZE(len) (2 * (len) + 10)
+
+// Frames len payload bytes into pOut, returns the frame length.
+size_t chFrameEncode(const uint8_t *pPayload, uint16_t len, uint8_t *pOut);
+
+// chFrameParser::feed() results
+#define CHFRAME_NONE       0  // nothing complete yet
+#define CHFRAME_OK         1  // a frame with a good CRC, see payload()
+#define CHFRAME_CRC_ERROR  2
+#define CHFRAME_BAD_LENGTH 3  // zero, or too long for the buffer
+#define CHFRAME_ABORTED    4  // an STX cut the frame short, and starts the next
+
+// Incremental frame parser.  Received bytes are fed one at a time; the
+// payload of a good frame is kept in the caller's buffer until the next
+// byte is fed, followed by a NUL so string payloads can be used in place.
+class chFrameParser {
+  public:
+    // pBuf holds the payload and its CRC; the largest payload accepted is
+    // bufSize - 2.
+    chFrameParser(uint8_t *pBuf, uint16_t bufSize);
+    uint8_t feed(uint8_t c);
+    const uint8_t *payload(void) { return pBuf; }
+    uint16_t length(void) { return len; }
+    // Drops a partly received frame and waits for the next STX.
+    void reset(void);
+
+  private:
+    enum {
+      waitingForStx,
+      waitingForLength,
+      waitingForExtLength,
+      waitingForPayload
+    };
+    uint8_t *pBuf;
+    uint16_t bufSize;
+    uint16_t len;
+    uint16_t index;
+    uint8_t state;
+    uint8_t escaped;
+    uint8_t lengthBytes;
+};
+
+#endif
@@ -1,12 +1,11 @@
 #include "Arduino.h"
 #include "chillhub.h"
 #include "crc.h"
+#include "chlog.h"
+#include "chframe.h"
 #include <string.h>
 #include <stdint.h>
 
-// define this macro if there is no debug UART port.
-#define DebugUart_UartPutString(...)
-#define DebugUart_SpiUartWriteTxData(...)
 #ifndef MSB_OF_U16
   #define MSB_OF_U16(v) ((v>>8)&0x00ff)
 #endif
@@ -14,8 +13,35 @@
   #define LSB_OF_U16(v) (v&0x00ff)
 #endif
 
-#define STX 0xff
-#define ESC 0xfe
+#define STX CHFRAME_STX
+#define ESC CHFRAME_ESC
+// A zero length byte announces a 16 bit length for frames over 255 bytes.
+#define EXT_LENGTH CHFRAME_EXT_LENGTH
+// ReadUnescaped() result for an unescaped STX, the start of a new frame
+#define FRAME_START 2
+
+// Bytes ReadFromSerialPort() moves from the port to packetRB per readBytes()
+#define RX_CHUNK_SIZE 16
+
+#if CHILLHUB_TRACE_SIZE > 0
+  #define TRACE(event, arg) trace(event, arg)
+#else
+  #define TRACE(event, arg)
+#endif
+
+#if CHILLHUB_TX_RING_SIZE > 0
+// Room flushUpdates() waits for in the TX ring before it sends an update,
+// so queued updates keep coalescing instead of blocking loop().  21 bytes
+// is the payload of a JSON U32 update, the largest single update.
+  #define UPDATE_TX_ROOM CHFRAME_ENCODED_SIZE(21)
+  #if UPDATE_TX_ROOM < CHILLHUB_TX_RING_SIZE
+    #define TX_HAS_UPDATE_ROOM() (txRing.BytesAvailable() >= UPDATE_TX_ROOM)
+  #else
+    #define TX_HAS_UPDATE_ROOM() (txRing.BytesUsed() == 0)
+  #endif
+#else
+  #define TX_HAS_UPDATE_ROOM() 1
+#endif
 
 static const char resIdKey[] = "resID";
 static const char valKey[] = "val";
@@ -26,123 +52,82 @@ static const uint8_t sizeOfU8JsonField = 2;
 
 //chInterface ChillHub;
 
-const StateHandler_fp chInterface::StateHandlers[] = {
-   StateHandler_WaitingForStx,
-   StateHandler_WaitingForLength,
-   StateHandler_WaitingForPacket,
+const chInterface::StateHandler_fp chInterface::StateHandlers[] = {
+   &chInterface::StateHandler_WaitingForStx,
+   &chInterface::StateHandler_WaitingForLength,
+   &chInterface::StateHandler_WaitingForPacket,
    NULL
 };
 
-unsigned char chInterface::packetBuf[64] = {0};
-RingBuffer chInterface::packetRB(&packetBuf[0], sizeof(packetBuf));
-uint8_t chInterface::currentState = State_WaitingForStx;
-unsigned char chInterface::recvBuf[64] = {0};
-uint8_t chInterface::bufIndex;
-uint8_t chInterface::payloadLen;
-uint8_t chInterface::msgType;
-uint8_t chInterface::dataType;
-uint8_t chInterface::packetLen;
-uint8_t chInterface::packetIndex;
-chCbTableType* chInterface::callbackTable = NULL;
-
-chInterface::chInterface(void) {
-  Serial.begin(115200);
-}
+CHILLHUB_THREAD_LOCAL chInterface *chInterface::pDispatching = NULL;
 
-void chInterface::printU8(uint8_t val) {
-  uint8_t digits[3];
-  uint8_t i;
-
-  for (i=0; i<sizeof(digits); i++) {
-    digits[sizeof(digits)-i-1] = val % 10;
-    val = val / 10;
-  }
-
-  for(i=0; (i<(sizeof(digits)-1))&&(digits[i] == 0); i++);
-
-  for (; i<sizeof(digits); i++) {
-    DebugUart_SpiUartWriteTxData(digits[i]+'0');
-  }
+// The layout guard, only for the size this file was built with.
+template<unsigned int N> void chInterfaceLayout(void) {
 }
+template void chInterfaceLayout<sizeof(chInterface)>(void);
 
-void chInterface::printU16(uint16_t val) {
-  uint8_t digits[5];
-  uint8_t i;
-
-  for (i=0; i<sizeof(digits); i++) {
-    digits[sizeof(digits)-i-1] = val % 10;
-    val = val / 10;
-  }
-
-  for(i=0; (i<(sizeof(digits)-1))&&(digits[i] == 0); i++);
-
-  for (; i<sizeof(digits); i++) {
-    DebugUart_SpiUartWriteTxData(digits[i]+'0');
-  }
-}
-
-void chInterface::printI16(int16_t val) {
-  uint8_t digits[5];
-  uint8_t i;
-
-  if (val < 0) {
-    DebugUart_SpiUartWriteTxData('-');
-    val = -val;
-  }
-
-  for (i=0; i<sizeof(digits); i++) {
-    digits[sizeof(digits)-i-1] = val % 10;
-    val = val / 10;
-  }
-
-  for(i=0; (i<(sizeof(digits)-1))&&(digits[i] == 0); i++);
-
-  for (; i<sizeof(digits); i++) {
-    DebugUart_SpiUartWriteTxData(digits[i]+'0');
-  }
+Stream &chInterface::openSerial(void) {
+  Serial.begin(115200);
+  return Serial;
 }
 
-void chInterface::printU32(uint32_t val) {
-  uint8_t digits[10];
-  uint8_t i;
-
-  for (i=0; i<sizeof(digits); i++) {
-    digits[sizeof(digits)-i-1] = val % 10;
-    val = val / 10;
-  }
-
-  for(i=0; (i<(sizeof(digits)-1))&&(digits[i] == 0); i++);
-
-  for (; i<sizeof(digits); i++) {
-    DebugUart_SpiUartWriteTxData(digits[i]+'0');
-  }
+// Everything not set here is written before it is read.
+void chInterface::initState(void) {
+  currentState = State_WaitingForStx;
+  bufIndex = 0;
+  packetLen = 0;
+#if CHILLHUB_INTERBYTE_TIMEOUT_MS > 0
+  lastRxTime = 0;
+#ifdef CHILLHUB_RX_FROM_ISR
+  rxLeftover = 0;
+#endif
+#endif
+#if CHILLHUB_UPDATE_QUEUE_SIZE > 0
+  updateQueueCount = 0;
+  updateRateLimit = 0;
+  updateCredit = 0;
+  updateCreditTime = 0;
+#endif
+  batchIndex = 0;
+  batchCount = 0;
+  batchFormat = 0;
+  batchUpdatesWanted = 0;
+  batchUpdatesActive = 0;
+  compactUpdatesWanted = 0;
+  compactUpdatesActive = 0;
+  memset(&stats, 0, sizeof(stats));
+#if CHILLHUB_TRACE_SIZE > 0
+  traceNext = 0;
+  traceCount = 0;
+  traceDumpMsgType = 0;
+  traceSuspended = 0;
+#endif
+  memset(fridgeCallbacks, 0, sizeof(fridgeCallbacks));
+  memset(fridgeCallbackKinds, 0, sizeof(fridgeCallbackKinds));
+  timeCallback = NULL;
+  callbackCount = 0;
+#if CHILLHUB_TX_RING_SIZE > 0
+  txFullPolicy = chTxFullWait;
+#if CHILLHUB_TX_CONTROL_RING_SIZE > 0
+  txControl = 0;
+  txQueuing = 0;
+  txBulkEscaped = 0;
+  txControlEscaped = 0;
+#endif
+#endif
 }
 
-void chInterface::printI32(int32_t val) {
-  uint8_t digits[10];
-  uint8_t i;
-
-  if (val < 0) {
-    DebugUart_SpiUartWriteTxData('-');
-    val = -val;
-  }
-
-  for (i=0; i<sizeof(digits); i++) {
-    digits[sizeof(digits)-i-1] = val % 10;
-    val = val / 10;
-  }
-
-  for(i=0; (i<(sizeof(digits)-1))&&(digits[i] == 0); i++);
-
-  for (; i<sizeof(digits); i++) {
-    DebugUart_SpiUartWriteTxData(digits[i]+'0');
-  }
+chInterface *chInterface::dispatching(void) {
+  return pDispatching;
 }
 
 void chInterface::sendU8Msg(unsigned char msgType, unsigned char payload) {
   uint8_t buf[16];
   uint8_t index=0;
 
+  if (reservedMsgType(msgType)) {
+    return;
+  }
   buf[index++] = 3;
   buf[index++] = msgType;
   buf[index++] = unsigned8DataType;
@@ -154,6 +139,9 @@ void chInterface::sendI8Msg(unsigned char msgType, signed char payload) {
   uint8_t buf[16];
   uint8_t index=0;
 
+  if (reservedMsgType(msgType)) {
+    return;
+  }
   buf[index++] = 3;
   buf[index++] = msgType;
   buf[index++] = signed8DataType;
@@ -165,6 +153,9 @@ void chInterface::sendU16Msg(unsigned char msgType, unsigned int payload) {
   uint8_t buf[16];
   uint8_t index=0;
 
+  if (reservedMsgType(msgType)) {
+    return;
+  }
   buf[index++] = 4;
   buf[index++] = msgType;
   buf[index++] = unsigned16DataType;
@@ -177,6 +168,9 @@ void chInterface::sendI16Msg(unsigned char msgType, signed int payload) {
   uint8_t buf[16];
   uint8_t index=0;
 
+  if (reservedMsgType(msgType)) {
+    return;
+  }
   buf[index++] = 4;
   buf[index++] = msgType;
   buf[index++] = signed16DataType;
@@ -189,6 +183,9 @@ void chInterface::sendBooleanMsg(unsigned char msgType, unsigned char payload) {
   uint8_t buf[16];
   uint8_t index=0;
 
+  if (reservedMsgType(msgType)) {
+    return;
+  }
   buf[index++] = 3;
   buf[index++] = msgType;
   buf[index++] = booleanDataType;
@@ -226,10 +223,47 @@ void chInterface::setup(const char* name, const char *UUID) {
   strcat((char *)&buf[index], UUID);
   index += uuidLen;
   sendPacket(buf, index);
+
+  // (re)negotiate the update formats, single JSON updates until the hub
+  // says otherwise
+  compactUpdatesActive = 0;
+  batchUpdatesActive = 0;
+  if (compactUpdatesWanted) {
+    sendFormatOffer(compactNegotiateMsgType, CHILLHUB_COMPACT_VERSION);
+  }
+  if (batchUpdatesWanted) {
+    sendFormatOffer(batchNegotiateMsgType, CHILLHUB_BATCH_VERSION);
+  }
+}
+
+void chInterface::sendFormatOffer(uint8_t msgType, uint8_t version) {
+  uint8_t buf[4];
+
+  buf[0] = 3;
+  buf[1] = msgType;
+  buf[2] = unsigned8DataType;
+  buf[3] = version;
+  sendPacket(buf, sizeof(buf));
+}
+
+// While an update format is offered, the message types from
+// CHILLHUB_LIB_MSG_MIN up belong to the library and are refused to the
+// sketch.
+uint8_t chInterface::reservedMsgType(uint8_t msgType) {
+  if ((msgType >= CHILLHUB_LIB_MSG_MIN) && (compactUpdatesWanted || batchUpdatesWanted)) {
+    CHLOG_VALUE(CHLOG_LEVEL_WARN, CHLOG_DISPATCH, "Message type reserved by an update format: ", msgType);
+    stats.reservedRejected++;
+    return 1;
+  }
+  return 0;
 }
 
 void chInterface::subscribe(unsigned char type, chillhubCallbackFunction callback) {
-  storeCallbackEntry(type, CHILLHUB_CB_TYPE_FRIDGE, callback);
+  subscribeKind(type, callback, chCbKindUntyped);
+}
+
+void chInterface::subscribeKind(unsigned char type, chillhubCallbackFunction callback, uint8_t kind) {
+  storeCallbackEntry(type, CHILLHUB_CB_TYPE_FRIDGE, callback, kind);
   sendU8Msg(subscribeMsgType, type);
 }
 
@@ -242,7 +276,7 @@ void chInterface::setAlarm(unsigned char ID, char* cronString, unsigned char str
   uint8_t buf[256];
   uint8_t index=0;
 
-  storeCallbackEntry(ID, CHILLHUB_CB_TYPE_CRON, callback);
+  storeCallbackEntry(ID, CHILLHUB_CB_TYPE_CRON, callback, chCbKindUntyped);
 
   buf[index++] = strLength + 4; // message length
   buf[index++] = setAlarmMsgType;
@@ -254,6 +288,11 @@ void chInterface::setAlarm(unsigned char ID, char* cronString, unsigned char str
   sendPacket(buf, index);
 }
 
+void chInterface::setAlarm(unsigned char ID, char* cronString, unsigned char strLength, chCbFcnTime callback) {
+  // alarm and time callbacks are always called as chCbFcnTime
+  setAlarm(ID, cronString, strLength, (chillhubCallbackFunction)callback);
+}
+
 void chInterface::unsetAlarm(unsigned char ID) {
   sendU8Msg(unsetAlarmMsgType, ID);
   callbackRemove(ID, CHILLHUB_CB_TYPE_CRON);
@@ -263,22 +302,34 @@ void chInterface::getTime(chillhubCallbackFunction cb) {
   uint8_t buf[16];
   uint8_t index=0;
 
-  storeCallbackEntry(0, CHILLHUB_CB_TYPE_TIME, cb);
+  storeCallbackEntry(0, CHILLHUB_CB_TYPE_TIME, cb, chCbKindUntyped);
 
   buf[index++] = 1;
   buf[index++] = getTimeMsgType;
   sendPacket(buf, index);
 }
 
+void chInterface::getTime(chCbFcnTime cb) {
+  getTime((chillhubCallbackFunction)cb);
+}
+
 void chInterface::addCloudListener(unsigned char ID, chillhubCallbackFunction cb) {
-  storeCallbackEntry(ID, CHILLHUB_CB_TYPE_CLOUD, cb);
+  addCloudListenerKind(ID, cb, chCbKindUntyped);
+}
+
+void chInterface::addCloudListenerKind(unsigned char ID, chillhubCallbackFunction cb, uint8_t kind) {
+  if (reservedMsgType(ID)) {
+    return;
+  }
+  storeCallbackEntry(ID, CHILLHUB_CB_TYPE_CLOUD, cb, kind);
 }
 
 uint8_t chInterface::appendJsonKey(uint8_t *pBuf, const char *key) {
   uint8_t keyLen = strlen(key);
   *pBuf = keyLen;
   pBuf++;
-  strncpy((char *)pBuf, key, keyLen);
+  // length prefixed, no terminator
+  memcpy(pBuf, key, keyLen);
   return keyLen + 1;
 }
 
@@ -305,7 +356,7 @@ uint8_t chInterface::appendJsonU16(uint8_t *pBuf, uint16_t v) {
 
 uint8_t chInterface::appendJsonU32(uint8_t *pBuf, uint32_t v) {
   *pBuf++ = unsigned32DataType;
-  *pBuf++ = (((v) & 0xFF000000)>>32);
+  *pBuf++ = (((v) & 0xFF000000)>>24);
   *pBuf++ = (((v) & 0xFF0000)>>16);
   *pBuf++ = (((v) & 0xFF00)>>8);
   *pBuf++ = ((v) &  0xFF);
@@ -328,7 +379,7 @@ uint8_t chInterface::appendJsonI16(uint8_t *pBuf, int16_t v) {
 
 uint8_t chInterface::appendJsonI32(uint8_t *pBuf, int32_t v) {
   *pBuf++ = signed32DataType;
-  *pBuf++ = (((v) & 0xFF000000)>>32);
+  *pBuf++ = (((v) & 0xFF000000)>>24);
   *pBuf++ = (((v) & 0xFF0000)>>16);
   *pBuf++ = (((v) & 0xFF00)>>8);
   *pBuf++ = ((v) &  0xFF);
@@ -446,212 +497,741 @@ uint8_t chInterface::sizeOfJsonKey(const char *key) {
 }
 
 void chInterface::updateCloudResourceU16(uint8_t resID, uint16_t val) {
+  queueUpdate(resID, unsigned16DataType, val);
+}
+
+void chInterface::updateCloudResourceI16(uint8_t resID, int16_t val) {
+  queueUpdate(resID, signed16DataType, (uint16_t)val);
+}
+
+void chInterface::updateCloudResourceU32(uint8_t resID, uint32_t val) {
+  queueUpdate(resID, unsigned32DataType, val);
+}
+
+void chInterface::updateCloudResourceI32(uint8_t resID, int32_t val) {
+  queueUpdate(resID, signed32DataType, (uint32_t)val);
+}
+
+uint16_t chInterface::sendResourceUpdate(uint8_t resID, uint8_t dataType, uint32_t val) {
   uint8_t buf[64];
   uint8_t index = 0;
+  uint16_t bytesSent;
+  uint8_t valSize = sizeOfU16JsonField;
+
+  if ((dataType == unsigned32DataType) || (dataType == signed32DataType)) {
+    valSize = sizeOfU32JsonField;
+  }
 
-  buf[index++] = 3 +
-    sizeOfJsonKey(resIdKey) + sizeOfU8JsonField +
-    sizeOfJsonKey(valKey) + sizeOfU16JsonField;
+  if (compactUpdatesActive) {
+    // an array of one (resID, data type, value) tuple
+    buf[index++] = 4 + valSize;
+    buf[index++] = compactUpdateMsgType;
+    buf[index++] = arrayDataType;
+    buf[index++] = 1; // number of tuples
+    buf[index++] = resID;
+  } else {
+    buf[index++] = 3 +
+      sizeOfJsonKey(resIdKey) + sizeOfU8JsonField +
+      sizeOfJsonKey(valKey) + valSize;
 
-  buf[index++] = updateResourceType;
-  buf[index++] = jsonDataType;
-  buf[index++] = 2; // number of json fields
+    buf[index++] = updateResourceType;
+    buf[index++] = jsonDataType;
+    buf[index++] = 2; // number of json fields
 
-  index += appendJsonKey(&buf[index], resIdKey);
-  index += appendJsonU8(&buf[index], resID);
-  index += appendJsonKey(&buf[index], valKey);
-  index += appendJsonU16(&buf[index], val);
+    index += appendJsonKey(&buf[index], resIdKey);
+    index += appendJsonU8(&buf[index], resID);
+    index += appendJsonKey(&buf[index], valKey);
+  }
 
-  sendPacket(buf, index);
+  // the value is encoded the same way in both formats
+  switch(dataType) {
+    case signed16DataType:
+      index += appendJsonI16(&buf[index], (int16_t)val);
+      break;
+    case unsigned32DataType:
+      index += appendJsonU32(&buf[index], val);
+      break;
+    case signed32DataType:
+      index += appendJsonI32(&buf[index], (int32_t)val);
+      break;
+    default:
+      index += appendJsonU16(&buf[index], (uint16_t)val);
+      break;
+  }
+
+  bytesSent = sendPacket(buf, index);
+  if (bytesSent > 0) {
+    stats.updatesSent++;
+  }
+  return bytesSent;
 }
 
-void chInterface::updateCloudResourceI16(uint8_t resID, int16_t val) {
-  uint8_t buf[64];
-  uint8_t index = 0;
+#if CHILLHUB_UPDATE_QUEUE_SIZE > 0
+void chInterface::queueUpdate(uint8_t resID, uint8_t dataType, uint32_t val) {
+  uint8_t i;
 
-  buf[index++] = 3 +
-    sizeOfJsonKey(resIdKey) + sizeOfU8JsonField +
-    sizeOfJsonKey(valKey) + sizeOfU16JsonField;
+  // last value wins, the update keeps its place in the queue
+  for (i=0; i<updateQueueCount; i++) {
+    if (updateQueue[i].resID == resID) {
+      updateQueue[i].dataType = dataType;
+      updateQueue[i].value = val;
+      stats.updatesCoalesced++;
+      return;
+    }
+  }
 
-  buf[index++] = updateResourceType;
-  buf[index++] = jsonDataType;
-  buf[index++] = 2; // number of json fields
+  if (updateQueueCount >= CHILLHUB_UPDATE_QUEUE_SIZE) {
+    // make room only as far as the rate limit allows; what is queued
+    // stays pending and the new resource waits for its next update
+    if ((updateRateLimit != 0) && (updateCredit <= 0)) {
+      CHLOG_INFO(CHLOG_UPDATES, "Update queue full, dropping update.");
+      stats.updatesDropped++;
+      return;
+    }
+    CHLOG_INFO(CHLOG_UPDATES, "Update queue full, sending oldest.");
+    sendOldestUpdate();
+  }
 
-  index += appendJsonKey(&buf[index], resIdKey);
-  index += appendJsonU8(&buf[index], resID);
-  index += appendJsonKey(&buf[index], valKey);
-  index += appendJsonI16(&buf[index], val);
+  updateQueue[updateQueueCount].resID = resID;
+  updateQueue[updateQueueCount].dataType = dataType;
+  updateQueue[updateQueueCount].value = val;
+  updateQueueCount++;
+}
 
-  sendPacket(buf, index);
+void chInterface::sendOldestUpdate(void) {
+  uint16_t bytesSent;
+
+  bytesSent = sendResourceUpdate(updateQueue[0].resID, updateQueue[0].dataType, updateQueue[0].value);
+  updateCredit -= bytesSent;
+  updateQueueCount--;
+  memmove(&updateQueue[0], &updateQueue[1], updateQueueCount * sizeof(updateQueue[0]));
 }
 
-void chInterface::updateCloudResourceU32(uint8_t resID, uint32_t val) {
-  uint8_t buf[64];
-  uint8_t index = 0;
+void chInterface::flushUpdates(void) {
+  unsigned long now;
+  uint32_t earned;
 
-  buf[index++] = 3 +
-    sizeOfJsonKey(resIdKey) + sizeOfU8JsonField +
-    sizeOfJsonKey(valKey) + sizeOfU32JsonField;
+  if (updateRateLimit == 0) {
+    while ((updateQueueCount > 0) && TX_HAS_UPDATE_ROOM()) {
+      sendOldestUpdate();
+    }
+    updateCredit = 0;
+    return;
+  }
 
-  buf[index++] = updateResourceType;
-  buf[index++] = jsonDataType;
-  buf[index++] = 2; // number of json fields
+  // Token bucket: earn credit for the time passed, at most an eighth of a
+  // second's worth plus one update so bursts stay short.
+  now = millis();
+  earned = ((uint32_t)(now - updateCreditTime) * updateRateLimit) / 1000;
+  if (earned > 0) {
+    updateCreditTime = now;
+    updateCredit += earned;
+    if (updateCredit > (int32_t)(updateRateLimit / 8) + 32) {
+      updateCredit = (int32_t)(updateRateLimit / 8) + 32;
+    }
+  }
 
-  index += appendJsonKey(&buf[index], resIdKey);
-  index += appendJsonU8(&buf[index], resID);
-  index += appendJsonKey(&buf[index], valKey);
-  index += appendJsonU32(&buf[index], val);
+  while ((updateQueueCount > 0) && (updateCredit > 0) && TX_HAS_UPDATE_ROOM()) {
+    sendOldestUpdate();
+  }
+}
 
-  sendPacket(buf, index);
+void chInterface::dropQueuedUpdate(uint8_t resID) {
+  uint8_t i;
+
+  for (i=0; i<updateQueueCount; i++) {
+    if (updateQueue[i].resID == resID) {
+      updateQueueCount--;
+      memmove(&updateQueue[i], &updateQueue[i+1], (updateQueueCount - i) * sizeof(updateQueue[0]));
+      stats.updatesCoalesced++;
+      return;
+    }
+  }
 }
 
-void chInterface::updateCloudResourceI32(uint8_t resID, int32_t val) {
-  uint8_t buf[64];
-  uint8_t index = 0;
+void chInterface::setUpdateRateLimit(uint16_t bytesPerSecond) {
+  updateRateLimit = bytesPerSecond;
+  updateCreditTime = millis();
+  updateCredit = 0;
+}
+#else
+void chInterface::queueUpdate(uint8_t resID, uint8_t dataType, uint32_t val) {
+  sendResourceUpdate(resID, dataType, val);
+}
 
-  buf[index++] = 3 +
-    sizeOfJsonKey(resIdKey) + sizeOfU8JsonField +
-    sizeOfJsonKey(valKey) + sizeOfU32JsonField;
+void chInterface::dropQueuedUpdate(uint8_t resID) {
+  (void)resID;
+}
 
-  buf[index++] = updateResourceType;
-  buf[index++] = jsonDataType;
-  buf[index++] = 2; // number of json fields
+void chInterface::setUpdateRateLimit(uint16_t bytesPerSecond) {
+  (void)bytesPerSecond;
+}
+#endif
 
-  index += appendJsonKey(&buf[index], resIdKey);
-  index += appendJsonU8(&buf[index], resID);
-  index += appendJsonKey(&buf[index], valKey);
-  index += appendJsonI32(&buf[index], val);
+// Layouts of a batch, chosen by beginCloudUpdate() from what the hub
+// accepted.
+enum {
+  batchAsUpdates, // resource ID and typed value, sent one update at a time
+  batchAsJson,
+  batchAsCompact
+};
 
-  sendPacket(buf, index);
+// A batch is a JSON message of type batchUpdateMsgType with one field per
+// resource.  The key is the resource ID as two hex digits and the value is
+// encoded the same way as in a single update.  With compact updates the
+// batch is a compactUpdateMsgType array and each entry is just the resource
+// ID followed by the typed value.  Hubs that accepted neither get the
+// entries queued as single updates, subject to the rate limit.
+void chInterface::beginCloudUpdate(void) {
+  batchIndex = 4; // length, message type, data type, number of fields
+  batchCount = 0;
+  if (compactUpdatesActive) {
+    batchFormat = batchAsCompact;
+  } else if (batchUpdatesActive) {
+    batchFormat = batchAsJson;
+  } else {
+    batchFormat = batchAsUpdates;
+  }
+}
+
+uint8_t chInterface::appendBatchKey(uint8_t resID, uint8_t valSize) {
+  static const char hexDigits[] = "0123456789abcdef";
+  uint8_t keySize = (batchFormat == batchAsJson) ? 3 : 1;
+  char key[3];
+
+  if ((batchIndex == 0) || (batchCount == 0xff) ||
+      ((uint16_t)(batchIndex + keySize + valSize) > sizeof(batchBuf))) {
+    return 0;
+  }
+
+  if (batchFormat != batchAsJson) {
+    batchBuf[batchIndex++] = resID;
+  } else {
+    key[0] = hexDigits[resID >> 4];
+    key[1] = hexDigits[resID & 0x0f];
+    key[2] = 0;
+    batchIndex += appendJsonKey(&batchBuf[batchIndex], key);
+  }
+  batchCount++;
+
+  // the batch carries the newest value, a queued one would be stale; the
+  // single updates fallback replaces it in the queue instead
+  if (batchFormat != batchAsUpdates) {
+    dropQueuedUpdate(resID);
+  }
+  return 1;
+}
+
+uint8_t chInterface::addCloudUpdateU16(uint8_t resID, uint16_t val) {
+  if (!appendBatchKey(resID, sizeOfU16JsonField)) {
+    return 0;
+  }
+  batchIndex += appendJsonU16(&batchBuf[batchIndex], val);
+  return 1;
+}
+
+uint8_t chInterface::addCloudUpdateI16(uint8_t resID, int16_t val) {
+  if (!appendBatchKey(resID, sizeOfU16JsonField)) {
+    return 0;
+  }
+  batchIndex += appendJsonI16(&batchBuf[batchIndex], val);
+  return 1;
+}
+
+uint8_t chInterface::addCloudUpdateU32(uint8_t resID, uint32_t val) {
+  if (!appendBatchKey(resID, sizeOfU32JsonField)) {
+    return 0;
+  }
+  batchIndex += appendJsonU32(&batchBuf[batchIndex], val);
+  return 1;
+}
+
+uint8_t chInterface::addCloudUpdateI32(uint8_t resID, int32_t val) {
+  if (!appendBatchKey(resID, sizeOfU32JsonField)) {
+    return 0;
+  }
+  batchIndex += appendJsonI32(&batchBuf[batchIndex], val);
+  return 1;
+}
+
+void chInterface::commitCloudUpdate(void) {
+  if ((batchCount > 0) && (batchFormat == batchAsUpdates)) {
+    sendBatchAsUpdates();
+  } else if (batchCount > 0) {
+    batchBuf[0] = batchIndex - 1; // length of the following message
+    if (batchFormat == batchAsCompact) {
+      batchBuf[1] = compactUpdateMsgType;
+      batchBuf[2] = arrayDataType;
+    } else {
+      batchBuf[1] = batchUpdateMsgType;
+      batchBuf[2] = jsonDataType;
+    }
+    batchBuf[3] = batchCount;
+    if (sendPacket(batchBuf, batchIndex) > 0) {
+      stats.updatesSent += batchCount;
+    }
+  }
+
+  batchIndex = 0;
+  batchCount = 0;
+}
+
+void chInterface::sendBatchAsUpdates(void) {
+  uint8_t index = 4;
+  uint8_t resID;
+  uint8_t dataType;
+  uint8_t valSize;
+  uint32_t val;
+  uint8_t i;
+
+  while (index < batchIndex) {
+    resID = batchBuf[index++];
+    dataType = batchBuf[index++];
+    valSize = dataTypeSize(dataType);
+    val = 0;
+    for (i=0; i<valSize; i++) {
+      val = (val << 8) | batchBuf[index++];
+    }
+    queueUpdate(resID, dataType, val);
+  }
+}
+
+void chInterface::useBatchUpdates(uint8_t enable) {
+  batchUpdatesWanted = enable;
+  if (!enable) {
+    batchUpdatesActive = 0;
+  }
+}
+
+uint8_t chInterface::batchUpdatesEnabled(void) {
+  return batchUpdatesActive;
+}
+
+void chInterface::useCompactUpdates(uint8_t enable) {
+  compactUpdatesWanted = enable;
+  if (!enable) {
+    compactUpdatesActive = 0;
+  }
+}
+
+uint8_t chInterface::compactUpdatesEnabled(void) {
+  return compactUpdatesActive;
+}
+
+unsigned long chInterface::getUpdatesSent(void) {
+  return stats.updatesSent;
+}
+
+unsigned long chInterface::getUpdatesCoalesced(void) {
+  return stats.updatesCoalesced;
+}
+
+void chInterface::getLinkStats(chLinkStats *pStats) {
+  *pStats = stats;
+}
+
+void chInterface::resetLinkStats(void) {
+  memset(&stats, 0, sizeof(stats));
+}
+
+void chInterface::createLinkStatsResources(uint8_t firstResID) {
+  // local so the names are dropped from sketches that do not report stats
+  static const char * const names[CHILLHUB_LINK_STATS_RESOURCES] = {
+    "linkFramesRx", "linkFramesTx", "linkCrcErrors", "linkBadLengths",
+    "linkAborted", "linkRxOverflows", "linkUnknownTypes",
+    "linkNoCallback", "linkMaxLoopUs", "linkTypeMismatch",
+    "linkTxWaits", "linkTxDropped", "linkTxControl", "linkTxPreempt"
+  };
+  uint8_t i;
+
+  for (i=0; i<CHILLHUB_LINK_STATS_RESOURCES; i++) {
+    createCloudResourceU32(names[i], firstResID + i, 0, 0);
+  }
+}
+
+void chInterface::reportLinkStats(uint8_t firstResID) {
+  unsigned long values[CHILLHUB_LINK_STATS_RESOURCES] = {
+    stats.framesReceived, stats.framesSent, stats.crcErrors,
+    stats.badLengths, stats.framesAborted, stats.rxOverflows,
+    stats.unknownDataTypes, stats.missingCallbacks, stats.maxLoopMicros,
+    stats.typeMismatches, stats.txWaits, stats.txDropped,
+    stats.txControlFrames, stats.txPreemptions
+  };
+  uint8_t i;
+
+  for (i=0; i<CHILLHUB_LINK_STATS_RESOURCES; i++) {
+    updateCloudResourceU32(firstResID + i, values[i]);
+  }
+}
+
+// Whether n more payload bytes follow bufIndex in the received packet.
+uint8_t chInterface::payloadHas(uint8_t n) {
+  return (chFrameLen_t)(bufIndex + n) <= packetLen;
+}
+
+// Bytes a value of the given data type takes in a received message; 0 for
+// types that carry their own length or are terminated.
+uint8_t chInterface::dataTypeSize(uint8_t type) {
+  switch(type) {
+    case unsigned8DataType:
+    case signed8DataType:
+    case booleanDataType:
+      return 1;
+    case unsigned16DataType:
+    case signed16DataType:
+      return 2;
+    case unsigned32DataType:
+    case signed32DataType:
+      return 4;
+    default:
+      return 0;
+  }
+}
+
+#if CHILLHUB_TRACE_SIZE > 0
+void chInterface::trace(uint8_t event, uint8_t arg) {
+  chTraceEntry *pEntry;
+
+  if (traceSuspended) {
+    return;
+  }
+  pEntry = &traceRing[traceNext];
+  pEntry->time = micros();
+  pEntry->event = event;
+  pEntry->arg = arg;
+  traceNext = (traceNext + 1 < CHILLHUB_TRACE_SIZE) ? traceNext + 1 : 0;
+  if (traceCount < CHILLHUB_TRACE_SIZE) {
+    traceCount++;
+  }
+}
+
+void chInterface::sendTraceDump(uint8_t msgType) {
+  uint8_t buf[5 + CHILLHUB_TRACE_HEADER_SIZE +
+      CHILLHUB_TRACE_ENTRIES_PER_MSG * CHILLHUB_TRACE_ENTRY_SIZE];
+  uint8_t msgCount = (traceCount + CHILLHUB_TRACE_ENTRIES_PER_MSG - 1) / CHILLHUB_TRACE_ENTRIES_PER_MSG;
+  uint8_t oldest = (traceCount < CHILLHUB_TRACE_SIZE) ? 0 : traceNext;
+  uint8_t sent = 0;
+  uint8_t msgIndex;
+  uint8_t index;
+  uint8_t i;
+
+  if (reservedMsgType(msgType)) {
+    return;
+  }
+
+  if (msgCount == 0) {
+    msgCount = 1; // an empty dump still says so
+  }
+
+  // the dump's own frames are not worth tracing
+  traceSuspended = 1;
+  for (msgIndex=0; msgIndex<msgCount; msgIndex++) {
+    index = 0;
+    buf[index++] = 0; // length, filled in below
+    buf[index++] = msgType;
+    buf[index++] = arrayDataType;
+    buf[index++] = 0; // number of elements, filled in below
+    buf[index++] = unsigned8DataType;
+    buf[index++] = CHILLHUB_TRACE_VERSION;
+    buf[index++] = msgIndex;
+    buf[index++] = msgCount;
+
+    for (i=0; (i<CHILLHUB_TRACE_ENTRIES_PER_MSG) && (sent<traceCount); i++, sent++) {
+      chTraceEntry *pEntry = &traceRing[(oldest + sent) % CHILLHUB_TRACE_SIZE];
+      buf[index++] = (pEntry->time >> 24) & 0xff;
+      buf[index++] = (pEntry->time >> 16) & 0xff;
+      buf[index++] = (pEntry->time >> 8) & 0xff;
+      buf[index++] = pEntry->time & 0xff;
+      buf[index++] = pEntry->event;
+      buf[index++] = pEntry->arg;
+    }
+
+    buf[0] = index - 1;
+    buf[3] = index - 5;
+    sendPacket(buf, index);
+  }
+  traceSuspended = 0;
+}
+
+void chInterface::setTraceDumpMsgType(uint8_t msgType) {
+  if (reservedMsgType(msgType)) {
+    return;
+  }
+  traceDumpMsgType = msgType;
+}
+
+void chInterface::clearTrace(void) {
+  traceNext = 0;
+  traceCount = 0;
+}
+#endif
+
+// Results of the payloadDispatchers
+#define DISPATCH_OK 0
+#define DISPATCH_UNKNOWN_TYPE 1   // no callback form for the data type
+#define DISPATCH_TYPE_MISMATCH 2  // a typed callback for another data type
+
+const chInterface::chDispatchFcn chInterface::payloadDispatchers[chCbKindCount] = {
+  dispatchUntyped,                                   // chCbKindUntyped
+  dispatchInteger<uint8_t, unsigned8DataType>,       // chCbKindU8
+  dispatchInteger<int8_t, signed8DataType>,          // chCbKindI8
+  dispatchInteger<uint16_t, unsigned16DataType>,     // chCbKindU16
+  dispatchInteger<int16_t, signed16DataType>,        // chCbKindI16
+  dispatchInteger<uint32_t, unsigned32DataType>,     // chCbKindU32
+  dispatchInteger<int32_t, signed32DataType>,        // chCbKindI32
+  dispatchString<char *>,                            // chCbKindString
+  dispatchString<const char *>                       // chCbKindConstString
+};
+
+// Callbacks registered with a chillhubCallbackFunction are called through
+// the signature the received data type implies.
+uint8_t chInterface::dispatchUntyped(chillhubCallbackFunction callback, uint8_t type, uint8_t *pData) {
+  switch(type) {
+    case stringDataType:
+      // CheckPacket() terminated the payload
+      CHLOG_DEBUG(CHLOG_DISPATCH, "Data type is a string.");
+      ((chCbFcnStr)callback)((char *)pData);
+      break;
+    case unsigned8DataType:
+    case booleanDataType:
+      ((chCbFcnU8)callback)(pData[0]);
+      break;
+    case unsigned16DataType: {
+      unsigned int payload = 0;
+      CHLOG_DEBUG(CHLOG_DISPATCH, "Data type is a U16.");
+      payload |= (pData[0] << 8);
+      payload |= pData[1];
+      ((chCbFcnU16)callback)(payload);
+      break;
+    }
+    case unsigned32DataType: {
+      unsigned long payload = 0;
+      CHLOG_DEBUG(CHLOG_DISPATCH, "Data type is a U32.");
+      for (uint8_t j = 0; j < 4; j++) {
+        payload = payload << 8;
+        payload |= pData[j];
+      }
+      ((chCbFcnU32)callback)(payload);
+      break;
+    }
+    default:
+      return DISPATCH_UNKNOWN_TYPE;
+  }
+  return DISPATCH_OK;
+}
+
+// A typed integer callback is called back through the signature it was
+// registered with, only for its own data type.
+template<typename T, uint8_t wireType>
+uint8_t chInterface::dispatchInteger(chillhubCallbackFunction callback, uint8_t type, uint8_t *pData) {
+  uint32_t payload = 0;
+  uint8_t i;
+
+  if ((type != wireType) && !((wireType == unsigned8DataType) && (type == booleanDataType))) {
+    return DISPATCH_TYPE_MISMATCH;
+  }
+  for (i=0; i<sizeof(T); i++) {
+    payload = (payload << 8) | pData[i];
+  }
+  ((void (*)(T))callback)((T)payload);
+  return DISPATCH_OK;
+}
+
+template<typename T>
+uint8_t chInterface::dispatchString(chillhubCallbackFunction callback, uint8_t type, uint8_t *pData) {
+  if (type != stringDataType) {
+    return DISPATCH_TYPE_MISMATCH;
+  }
+  // CheckPacket() terminated the payload
+  ((void (*)(T))callback)((T)pData);
+  return DISPATCH_OK;
 }
 
 void chInterface::processChillhubMessagePayload(void) {
   chillhubCallbackFunction callback = NULL;
+  uint8_t kind;
 
   // got the payload, process the message
+  if (packetLen < 2) {
+    CHLOG_WARN(CHLOG_DISPATCH, "Packet too short, ignoring.");
+    return;
+  }
   bufIndex = 0;
   payloadLen = recvBuf[bufIndex++];
   msgType = recvBuf[bufIndex++];
-  dataType = recvBuf[bufIndex++];
+  dataType = (packetLen > 2) ? recvBuf[bufIndex] : 0;
+  bufIndex++;
+
+#if CHILLHUB_TRACE_SIZE > 0
+  if (traceDumpMsgType && (msgType == traceDumpMsgType)) {
+    sendTraceDump(traceDumpMsgType);
+    return;
+  }
+#endif
 
-  if ((msgType == alarmNotifyMsgType) || (msgType == timeResponseMsgType)) {
+  if (compactUpdatesWanted && (msgType == compactNegotiateMsgType)) {
+    // the hub answers the offer from setup() with the version it accepts;
+    // without an offer the type is an ordinary user message
+    if ((dataType == unsigned8DataType) &&
+        payloadHas(1) && (recvBuf[bufIndex] == CHILLHUB_COMPACT_VERSION)) {
+      CHLOG_INFO(CHLOG_UPDATES, "Hub accepted compact updates.");
+      compactUpdatesActive = 1;
+    }
+  }
+  else if (batchUpdatesWanted && (msgType == batchNegotiateMsgType)) {
+    // likewise for batched JSON updates
+    if ((dataType == unsigned8DataType) &&
+        payloadHas(1) && (recvBuf[bufIndex] == CHILLHUB_BATCH_VERSION)) {
+      CHLOG_INFO(CHLOG_UPDATES, "Hub accepted batched updates.");
+      batchUpdatesActive = 1;
+    }
+  }
+  else if ((msgType == alarmNotifyMsgType) || (msgType == timeResponseMsgType)) {
     // data is an array, don't care about data type or length
     bufIndex+=2;
+    if (!payloadHas((msgType == alarmNotifyMsgType) ? 5 : 4)) {
+      CHLOG_WARN(CHLOG_DISPATCH, "Time payload too short.");
+      return;
+    }
     if (msgType == alarmNotifyMsgType) {
-      DebugUart_UartPutString("Got an alarm notification.\r\n");
-      callback = callbackLookup(recvBuf[bufIndex++], CHILLHUB_CB_TYPE_CRON);
+      CHLOG_DEBUG(CHLOG_DISPATCH, "Got an alarm notification.");
+      callback = callbackLookup(recvBuf[bufIndex++], CHILLHUB_CB_TYPE_CRON, &kind);
     }
     else {
-      DebugUart_UartPutString("Received a time response.\r\n");
-      callback = callbackLookup(0, CHILLHUB_CB_TYPE_TIME);
+      CHLOG_DEBUG(CHLOG_DISPATCH, "Received a time response.");
+      callback = callbackLookup(0, CHILLHUB_CB_TYPE_TIME, &kind);
     }
 
     if (callback) {
-      unsigned char time[4];
-      for (uint8_t j = 0; j < 4; j++)
-      {
-        time[j] = recvBuf[bufIndex++];
-      }
-      DebugUart_UartPutString("Calling time response/alarm callback.\r\n");
-      ((chCbFcnTime)callback)(time); // <-- I don't think this works this way...
+      // the four time bytes are handed over in place
+      CHLOG_DEBUG(CHLOG_DISPATCH, "Calling time response/alarm callback.");
+      ((chCbFcnTime)callback)(&recvBuf[bufIndex]);
+      bufIndex += 4;
 
       if (msgType == timeResponseMsgType) {
         callbackRemove(0, CHILLHUB_CB_TYPE_TIME);
       }
     } else {
-      DebugUart_UartPutString("No callback found.\r\n");
+      CHLOG_INFO(CHLOG_DISPATCH, "No callback found.");
+      stats.missingCallbacks++;
     }
   }
   else {
-    DebugUart_UartPutString("Received a message: ");
-    printU8(msgType);
-    DebugUart_UartPutString("\r\n");
-    callback = callbackLookup(msgType, (msgType <= CHILLHUB_RESV_MSG_MAX)?CHILLHUB_CB_TYPE_FRIDGE:CHILLHUB_CB_TYPE_CLOUD);
+    CHLOG_VALUE(CHLOG_LEVEL_DEBUG, CHLOG_DISPATCH, "Received a message: ", msgType);
+    callback = callbackLookup(msgType, (msgType <= CHILLHUB_RESV_MSG_MAX)?CHILLHUB_CB_TYPE_FRIDGE:CHILLHUB_CB_TYPE_CLOUD, &kind);
 
-    if (callback) {
-      DebugUart_UartPutString("Found a callback for this message, calling...\r\n");
-      switch(dataType) {
-        case stringDataType:
-          DebugUart_UartPutString("Data type is a string.\r\n");
-          ((chCbFcnStr)callback)((char *)&recvBuf[bufIndex]);
-          break;
-        case unsigned8DataType:
-        case booleanDataType:
-          ((chCbFcnU8)callback)(recvBuf[bufIndex++]);
-          break;
-        case unsigned16DataType: {
-          unsigned int payload = 0;
-          DebugUart_UartPutString("Data type is a U16.\r\n");
-          payload |= (recvBuf[bufIndex++] << 8);
-          payload |= recvBuf[bufIndex++];
-          ((chCbFcnU16)callback)(payload);
+    if (callback && !payloadHas(dataTypeSize(dataType))) {
+      CHLOG_WARN(CHLOG_DISPATCH, "Payload too short for its data type.");
+    }
+    else if (callback) {
+      CHLOG_DEBUG(CHLOG_DISPATCH, "Found a callback for this message, calling...");
+      switch (payloadDispatchers[kind](callback, dataType, &recvBuf[bufIndex])) {
+        case DISPATCH_OK:
           break;
-        }
-        case unsigned32DataType: {
-          unsigned long payload = 0;
-          DebugUart_UartPutString("Data type is a U32.\r\n");
-          for (char j = 0; j < 4; j++) {
-            payload = payload << 8;
-            payload |= recvBuf[bufIndex++];
-          }
-          ((chCbFcnU32)callback)(payload);
+        case DISPATCH_TYPE_MISMATCH:
+          stats.typeMismatches++;
+          CHLOG_VALUE(CHLOG_LEVEL_WARN, CHLOG_DISPATCH, "Callback does not take data type ", dataType);
           break;
-        }
         default:
-          DebugUart_UartPutString("Don't know what this data type is: ");
-          printU8(dataType);
-          DebugUart_UartPutString("\r\n");
+          stats.unknownDataTypes++;
+          CHLOG_VALUE(CHLOG_LEVEL_WARN, CHLOG_DISPATCH, "Don't know what this data type is: ", dataType);
       }
     } else {
-      DebugUart_UartPutString("No callback for this message found.\r\n");
+      CHLOG_INFO(CHLOG_DISPATCH, "No callback for this message found.");
+      stats.missingCallbacks++;
     }
   }
 }
 
-void chInterface::ReadFromSerialPort(void) {
-  if (Serial.available() > 0) {
-    // Get the payload length.  It is one less than the message length.
-    if (packetRB.IsFull() == RING_BUFFER_IS_FULL) {
-      DebugUart_UartPutString("Ringbuffer was full, removing a byte.\r\n");
-      packetRB.Read();
+uint8_t chInterface::ReadFromSerialPort(void) {
+  uint8_t chunk[RX_CHUNK_SIZE];
+  int available = port.available();
+  uint8_t room;
+  uint8_t count = 0;
+  uint8_t n;
+
+  if (available <= 0) {
+    return 0;
+  }
+
+  if (packetRB.IsFull() == RING_BUFFER_IS_FULL) {
+    CHLOG_WARN(CHLOG_RX, "Ringbuffer was full, removing a byte.");
+    packetRB.Read();
+    stats.rxOverflows++;
+    TRACE(rxOverflowTraceEvent, 0);
+  }
+
+  // Drain everything the port has, bounded by the free space in the ring
+  // buffer, so the framer sees a whole burst in a single loop() call.
+  room = packetRB.BytesAvailable();
+  if (available > room) {
+    available = room;
+  }
+  while (available > 0) {
+    n = (available > (int)sizeof(chunk)) ? sizeof(chunk) : available;
+    n = port.readBytes(chunk, n);
+    if (n == 0) {
+      break;
     }
-    packetRB.Write(Serial.read());
+    packetRB.WriteBulk(chunk, n);
+    count += n;
+    available -= n;
   }
+
+  return count;
 }
 
 void chInterface::CheckPacket(void) {
-  uint8_t i;
-  uint16_t crc = crc_init();
+  // the CRC has been accumulated byte by byte as the packet arrived
+  uint16_t crc = crc_finalize(recvCrc);
   uint16_t crcSent = (recvBuf[bufIndex-2]<<8) + recvBuf[bufIndex-1];
   bufIndex -= 2;
 
-  for(i=0; i<bufIndex; i++) {
-    crc = crc_update(crc, &recvBuf[i], 1);
-  }
-
-  crc = crc_finalize(crc);
-
   if (crc == crcSent) {
-    DebugUart_UartPutString("Checksum checks!\r\n");
+    CHLOG_DEBUG(CHLOG_RX, "Checksum checks!");
+    stats.framesReceived++;
+    TRACE(frameReceivedTraceEvent, recvBuf[1]);
+    // Terminate the payload in place of the CRC so string payloads can be
+    // handed to callbacks even if the hub did not include the NUL.
+    recvBuf[bufIndex] = 0;
     processChillhubMessagePayload();
   } else {
-    DebugUart_UartPutString("Checksum FAILED!\r\n");
-    DebugUart_UartPutString("Checksum received: ");
-    printU16(crcSent);
-    DebugUart_UartPutString("\r\nChecksum calc'd: ");
-    printU16(crc);
-    DebugUart_UartPutString("\r\n");
+    CHLOG_WARN(CHLOG_RX, "Checksum FAILED!");
+    stats.crcErrors++;
+    TRACE(crcErrorTraceEvent, recvBuf[1]);
+    CHLOG_VALUE(CHLOG_LEVEL_WARN, CHLOG_RX, "Checksum received: ", crcSent);
+    CHLOG_VALUE(CHLOG_LEVEL_WARN, CHLOG_RX, "Checksum calc'd: ", crc);
+  }
+}
+
+// Takes the next unescaped byte out of the ring buffer.  Returns 0 if no
+// complete byte is buffered yet, and FRAME_START, leaving it buffered, if
+// the next byte is an unescaped STX.
+uint8_t chInterface::ReadUnescaped(uint8_t *pByte) {
+  if (packetRB.IsEmpty() == RING_BUFFER_IS_EMPTY) {
+    return 0;
   }
+  if (packetRB.Peek(0) == STX) {
+    return FRAME_START;
+  }
+  if (packetRB.Peek(0) == ESC) {
+    if (packetRB.BytesUsed() > 1) {
+      packetRB.Read();
+    } else {
+      return 0;
+    }
+  }
+  *pByte = packetRB.Read();
+  return 1;
 }
 
 // state handlers
 uint8_t chInterface::StateHandler_WaitingForStx(void) {
-  ReadFromSerialPort();
-
   // process bytes in the buffer
   while(packetRB.IsEmpty() == RING_BUFFER_NOT_EMPTY) {
     if (packetRB.Read() == STX) {
-      DebugUart_UartPutString("Got STX.\r\n");
+      CHLOG_DEBUG(CHLOG_RX, "Got STX.");
+      lengthBytesLeft = 0;
       return State_WaitingForLength;
     }
   }
@@ -659,30 +1239,53 @@ uint8_t chInterface::StateHandler_WaitingForStx(void) {
   return State_WaitingForStx;
 }
 
+uint8_t chInterface::AcceptLength(void) {
+  if ((packetLen == 0) || (packetLen > sizeof(recvBuf)-2)) {
+    CHLOG_WARN(CHLOG_RX, "Bad length, aborting.");
+    stats.badLengths++;
+    TRACE(badLengthTraceEvent, packetLen & 0xff);
+    return State_WaitingForStx;
+  }
+
+  bufIndex = 0;
+  payloadLen = 0;
+  msgType = 0;
+  dataType = 0;
+  recvCrc = crc_init();
+  CHLOG_DEBUG(CHLOG_RX, "Got length!");
+  return State_WaitingForPacket;
+}
+
 uint8_t chInterface::StateHandler_WaitingForLength(void) {
-  ReadFromSerialPort();
-
-  if (packetRB.IsEmpty() == RING_BUFFER_NOT_EMPTY) {
-    packetLen = packetRB.Peek(0);
-    if (packetLen == ESC) {
-      if (packetRB.BytesUsed() > 1) {
-        packetRB.Read();
-      } else {
-        return State_WaitingForLength;
-      }
+  uint8_t b;
+  uint8_t result;
+
+  while ((result = ReadUnescaped(&b)) != 0) {
+    if (result == FRAME_START) {
+      CHLOG_INFO(CHLOG_RX, "STX in length, restarting.");
+      stats.framesAborted++;
+      TRACE(frameAbortedTraceEvent, 0);
+      return State_WaitingForStx;
     }
-    packetLen = packetRB.Read();
-    if (packetLen < sizeof(packetBuf)-2) {
-      bufIndex = 0;
-      payloadLen = 0;
-      msgType = 0;
-      dataType = 0;
-      packetIndex = 0;
-      DebugUart_UartPutString("Got length!\r\n");
-      return State_WaitingForPacket;
-    } else {
-      DebugUart_UartPutString("Length is too long, aborting.\r\n");
+    if (lengthBytesLeft == 0) {
+      if (b != EXT_LENGTH) {
+        packetLen = b;
+        return AcceptLength();
+      }
+#if CHILLHUB_MAX_FRAME_SIZE > 255
+      packetLen = 0;
+      lengthBytesLeft = 2;
+#else
+      CHLOG_WARN(CHLOG_RX, "Extended length not supported, aborting.");
+      stats.badLengths++;
+      TRACE(badLengthTraceEvent, 0);
       return State_WaitingForStx;
+#endif
+    } else {
+      packetLen = (packetLen << 8) | b;
+      if (--lengthBytesLeft == 0) {
+        return AcceptLength();
+      }
     }
   }
 
@@ -690,24 +1293,26 @@ uint8_t chInterface::StateHandler_WaitingForLength(void) {
 }
 
 uint8_t chInterface::StateHandler_WaitingForPacket(void) {
-  uint8_t bytesUsed;
   uint8_t b;
-  ReadFromSerialPort();
-
-  bytesUsed = packetRB.BytesUsed();
-  while (bytesUsed > packetIndex) {
-    if (packetRB.Peek(packetIndex) == ESC) {
-      if ((bytesUsed - packetIndex) > 1) {
-        packetIndex++;
-      } else {
-        return State_WaitingForPacket;
-      }
+  uint8_t result;
+
+  // Bytes are consumed from the ring buffer as they are unescaped straight
+  // into recvBuf, so each received byte is only touched once.
+  while ((result = ReadUnescaped(&b)) != 0) {
+    if (result == FRAME_START) {
+      // The sender never puts an unescaped STX inside a frame, so this one
+      // was cut short.  Start over with the new frame instead of feeding
+      // it to the old one.
+      CHLOG_INFO(CHLOG_RX, "STX in packet, restarting.");
+      stats.framesAborted++;
+      TRACE(frameAbortedTraceEvent, 0);
+      return State_WaitingForStx;
+    }
+    if (bufIndex < packetLen) {
+      recvCrc = crc_update(recvCrc, &b, 1);
     }
-    b = packetRB.Peek(packetIndex++);
     recvBuf[bufIndex++] =  b;
-    DebugUart_UartPutString("Got a byte: ");
-    printU8(b);
-    DebugUart_UartPutString("\r\n");
+    CHLOG_VALUE(CHLOG_LEVEL_DEBUG, CHLOG_RX, "Got a byte: ", b);
     if (bufIndex >= packetLen + 2) {
       CheckPacket();
       return State_WaitingForStx;
@@ -717,49 +1322,210 @@ uint8_t chInterface::StateHandler_WaitingForPacket(void) {
   return State_WaitingForPacket;
 }
 
+// Run the state machine until it stops making progress on the buffered bytes.
+void chInterface::RunStateMachine(void) {
+  uint8_t previousState;
+  StateHandler_fp handler;
+
+  do {
+    if (currentState >= State_NumerOfCommStates) {
+      return;
+    }
+    handler = StateHandlers[currentState];
+    if (handler == NULL) {
+      return;
+    }
+    previousState = currentState;
+    currentState = (this->*handler)();
+    if (currentState != previousState) {
+      TRACE(stateTraceEvent, currentState);
+    }
+  } while (currentState != previousState);
+}
+
+#if CHILLHUB_INTERBYTE_TIMEOUT_MS > 0
+// Abandon a partly received frame once its bytes stop coming.  Whatever is
+// still buffered is then searched for the next STX.
+void chInterface::checkRxTimeout(uint8_t gotBytes) {
+  unsigned long now = millis();
+
+  if (gotBytes || (currentState == State_WaitingForStx)) {
+    lastRxTime = now;
+  } else if ((now - lastRxTime) >= CHILLHUB_INTERBYTE_TIMEOUT_MS) {
+    CHLOG_INFO(CHLOG_RX, "Inter-byte timeout, dropping frame.");
+    stats.framesAborted++;
+    TRACE(frameAbortedTraceEvent, 1);
+    currentState = State_WaitingForStx;
+    lastRxTime = now;
+    RunStateMachine();
+  }
+}
+#endif
+
+#ifdef CHILLHUB_RX_FROM_ISR
+uint8_t chInterface::receiveFromIsr(uint8_t c) {
+  // Producer side of packetRB; never touches the consumer's head index.
+  // rxOverflows is only written here, a reader may see a torn value.
+  uint8_t result = packetRB.Write(c);
+
+  if (result == RING_BUFFER_ADD_FAILURE) {
+    stats.rxOverflows++;
+  }
+  return result;
+}
+
+void chInterface::ServiceReceiver(void) {
+#if CHILLHUB_INTERBYTE_TIMEOUT_MS > 0
+  // A frame can leave an ESC buffered until the byte it escapes arrives,
+  // so compare with what was left the last time.
+  uint8_t gotBytes = (packetRB.BytesUsed() != rxLeftover);
+#endif
+
+  RunStateMachine();
+#if CHILLHUB_INTERBYTE_TIMEOUT_MS > 0
+  checkRxTimeout(gotBytes);
+  rxLeftover = packetRB.BytesUsed();
+#endif
+}
+#else
+void chInterface::ServiceReceiver(void) {
+  int pending = port.available();
+#if CHILLHUB_INTERBYTE_TIMEOUT_MS > 0
+  uint8_t gotBytes = (pending > 0);
+#endif
+  uint8_t bytesRead;
+
+  // The framer consumes what it is given, so keep draining the port through
+  // the ring buffer until everything that was pending on entry is handled.
+  do {
+    bytesRead = ReadFromSerialPort();
+    pending -= bytesRead;
+    RunStateMachine();
+  } while ((pending > 0) && (bytesRead > 0));
+#if CHILLHUB_INTERBYTE_TIMEOUT_MS > 0
+  checkRxTimeout(gotBytes);
+#endif
+}
+#endif
+
 void chInterface::loop(void) {
-  if (currentState < State_Invalid) {
-    if(StateHandlers[currentState] != NULL) {
-      currentState = StateHandlers[currentState]();
+  unsigned long start = micros();
+  unsigned long elapsed;
+  // a callback may run another instance's loop()
+  chInterface *pOuter = pDispatching;
+
+#if CHILLHUB_TX_RING_SIZE > 0
+  drainTx(0);
+#endif
+  pDispatching = this;
+  ServiceReceiver();
+  pDispatching = pOuter;
+#if CHILLHUB_UPDATE_QUEUE_SIZE > 0
+  flushUpdates();
+#endif
+#if CHILLHUB_TX_RING_SIZE > 0
+  drainTx(0);
+#endif
+
+  elapsed = micros() - start;
+  if (elapsed > stats.maxLoopMicros) {
+    stats.maxLoopMicros = elapsed;
+  }
+}
+
+// Binary search of callbackTable.  Returns 1 and the entry's index if the
+// entry exists, otherwise 0 and the index it would be inserted at.
+uint8_t chInterface::callbackFind(unsigned char sym, unsigned char typ, uint8_t *pIndex) {
+  uint16_t key = (typ << 8) | sym;
+  uint16_t entryKey;
+  uint8_t lo = 0;
+  uint8_t hi = callbackCount;
+  uint8_t mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    entryKey = (callbackTable[mid].type << 8) | callbackTable[mid].symbol;
+    if (entryKey == key) {
+      *pIndex = mid;
+      return 1;
+    } else if (entryKey < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
   }
+
+  *pIndex = lo;
+  return 0;
 }
 
-void chInterface::storeCallbackEntry(unsigned char sym, unsigned char typ, chillhubCallbackFunction fcn) {
-  chCbTableType* newEntry = new chCbTableType;
-  newEntry->symbol = sym;
-  newEntry->type = typ;
-  newEntry->callback = fcn;
-  newEntry->rest = callbackTable;
-  callbackTable = newEntry;
+void chInterface::storeCallbackEntry(unsigned char sym, unsigned char typ, chillhubCallbackFunction fcn, uint8_t kind) {
+  uint8_t index;
+
+  if ((typ == CHILLHUB_CB_TYPE_FRIDGE) && (sym <= CHILLHUB_RESV_MSG_MAX)) {
+    fridgeCallbacks[sym] = fcn;
+    fridgeCallbackKinds[sym] = kind;
+    return;
+  }
+  if (typ == CHILLHUB_CB_TYPE_TIME) {
+    timeCallback = fcn;
+    return;
+  }
+
+  if (callbackFind(sym, typ, &index)) {
+    callbackTable[index].callback = fcn;
+    callbackTable[index].kind = kind;
+    return;
+  }
+  if (callbackCount >= CHILLHUB_MAX_CALLBACKS) {
+    CHLOG_ERROR(CHLOG_DISPATCH, "Callback table is full.");
+    return;
+  }
+
+  memmove(&callbackTable[index+1], &callbackTable[index],
+      (callbackCount - index) * sizeof(callbackTable[0]));
+  callbackTable[index].symbol = sym;
+  callbackTable[index].type = typ;
+  callbackTable[index].callback = fcn;
+  callbackTable[index].kind = kind;
+  callbackCount++;
 }
 
-chillhubCallbackFunction chInterface::callbackLookup(unsigned char sym, unsigned char typ) {
-  chCbTableType* entry = callbackTable;
-  while (entry) {
-    if ((entry->type == typ) && (entry->symbol == sym))
-      return (entry->callback);
-    else
-      entry = entry->rest;
+chillhubCallbackFunction chInterface::callbackLookup(unsigned char sym, unsigned char typ, uint8_t *pKind) {
+  uint8_t index;
+
+  *pKind = chCbKindUntyped;
+  if ((typ == CHILLHUB_CB_TYPE_FRIDGE) && (sym <= CHILLHUB_RESV_MSG_MAX)) {
+    *pKind = fridgeCallbackKinds[sym];
+    return fridgeCallbacks[sym];
+  }
+  if (typ == CHILLHUB_CB_TYPE_TIME) {
+    return timeCallback;
+  }
+
+  if (callbackFind(sym, typ, &index)) {
+    *pKind = callbackTable[index].kind;
+    return callbackTable[index].callback;
   }
   return NULL;
 }
 
 void chInterface::callbackRemove(unsigned char sym, unsigned char typ) {
-  chCbTableType* prev = callbackTable;
-  chCbTableType* entry;
-  if (prev)
-    entry = prev->rest;
+  uint8_t index;
 
-  while (entry) {
-    if ((entry->type == typ) && (entry->symbol == sym)) {
-      prev->rest = entry->rest;
-      delete entry;
-    }
-    else {
-      prev = entry;
-      entry = entry->rest;
-    }
+  if ((typ == CHILLHUB_CB_TYPE_FRIDGE) && (sym <= CHILLHUB_RESV_MSG_MAX)) {
+    fridgeCallbacks[sym] = NULL;
+    return;
+  }
+  if (typ == CHILLHUB_CB_TYPE_TIME) {
+    timeCallback = NULL;
+    return;
+  }
+
+  if (callbackFind(sym, typ, &index)) {
+    callbackCount--;
+    memmove(&callbackTable[index], &callbackTable[index+1],
+        (callbackCount - index) * sizeof(callbackTable[0]));
   }
 }
 
@@ -774,39 +1540,297 @@ uint8_t chInterface::isControlChar(uint8_t c) {
   }
 }
 
-void chInterface::outputChar(uint8_t c) {
-  uint8_t buf[2];
+uint8_t chInterface::encodeChar(uint8_t *pOut, uint8_t c) {
   uint8_t index=0;
 
   if (isControlChar(c)) {
-    buf[index++] = ESC;
+    pOut[index++] = ESC;
   }
-  buf[index++] = c;
+  pOut[index++] = c;
 
-  Serial.write(buf, index);
+  return index;
 }
 
-void chInterface::sendPacket(uint8_t *pBuf, uint8_t len){
-  uint16_t crc = crc_init();
-  uint8_t buf[1];
-  uint8_t i;
+// Queues the frame in the TX ring, or writes it to the port without one.
+// Returns the number of bytes queued or written, 0 if the frame was dropped.
+uint16_t chInterface::sendPacket(uint8_t *pBuf, chFrameLen_t len){
+  uint16_t crc = crc_finalize(crc_update(crc_init(), pBuf, len));
+  uint16_t bytesWritten = 0;
+  uint8_t index=0;
+  chFrameLen_t i;
+
+  if (len == 0) {
+    return 0;
+  }
+#if CHILLHUB_TX_RING_SIZE > 0
+#if CHILLHUB_TX_CONTROL_RING_SIZE > 0
+  txControl = (len > 1) && isControlMsgType(pBuf[1]);
+#endif
+  if (!makeTxRoom(frameSize(pBuf, len, crc))) {
+    return 0;
+  }
+#if CHILLHUB_TX_CONTROL_RING_SIZE > 0
+  if (txControl) {
+    stats.txControlFrames++;
+    if (txRing.BytesUsed() > 0) {
+      stats.txPreemptions++;
+    }
+  }
+  txQueuing = 1;
+#endif
+#endif
 
-  // send STX
-  buf[0] = STX;
-  Serial.write(buf, 1);
-  // send packet length
-  outputChar(len);
+  // Build the whole frame in txBuf and hand it on in one piece.
+  // Frames that do not fit are flushed in txBuf sized pieces.
+  txBuf[index++] = STX;
+#if CHILLHUB_MAX_FRAME_SIZE > 255
+  if (len > 0xff) {
+    txBuf[index++] = EXT_LENGTH;
+    index += encodeChar(&txBuf[index], MSB_OF_U16(len));
+    index += encodeChar(&txBuf[index], LSB_OF_U16(len));
+  } else {
+    index += encodeChar(&txBuf[index], len);
+  }
+#else
+  index += encodeChar(&txBuf[index], len);
+#endif
 
-  // send packet
   for(i=0; i<len; i++) {
-    crc = crc_update(crc, &pBuf[i], 1);
-    outputChar(pBuf[i]);
+    if (index > (sizeof(txBuf) - 2)) {
+      bytesWritten += txOut(txBuf, index);
+      index = 0;
+    }
+    index += encodeChar(&txBuf[index], pBuf[i]);
+  }
+
+  if (index > (sizeof(txBuf) - 4)) {
+    bytesWritten += txOut(txBuf, index);
+    index = 0;
+  }
+  index += encodeChar(&txBuf[index], MSB_OF_U16(crc));
+  index += encodeChar(&txBuf[index], LSB_OF_U16(crc));
+
+  bytesWritten += txOut(txBuf, index);
+#if (CHILLHUB_TX_RING_SIZE > 0) && (CHILLHUB_TX_CONTROL_RING_SIZE > 0)
+  txQueuing = 0;
+#endif
+  stats.framesSent++;
+  TRACE(frameSentTraceEvent, (len > 1) ? pBuf[1] : 0);
+#if CHILLHUB_TX_RING_SIZE > 0
+  drainTx(0);
+#endif
+  return bytesWritten;
+}
+
+#if CHILLHUB_TX_RING_SIZE > 0
+#if CHILLHUB_TX_CONTROL_RING_SIZE > 0
+// Protocol housekeeping the hub wants answered promptly.  Cloud resource
+// traffic and user messages are bulk.
+uint8_t chInterface::isControlMsgType(uint8_t type) {
+  switch(type) {
+    case deviceIdMsgType:
+    case subscribeMsgType:
+    case unsubscribeMsgType:
+    case setAlarmMsgType:
+    case unsetAlarmMsgType:
+    case getTimeMsgType:
+    case setDeviceUUIDType:
+    case keepAliveType:
+      return 1;
+    case compactNegotiateMsgType:
+      return compactUpdatesWanted;
+    case batchNegotiateMsgType:
+      return batchUpdatesWanted;
+    default:
+      return 0;
+  }
+}
+
+uint16_t chInterface::txFree(void) {
+  return txControl ? txControlRing.BytesAvailable() : txRing.BytesAvailable();
+}
+
+uint16_t chInterface::txUsed(void) {
+  return txControl ? txControlRing.BytesUsed() : txRing.BytesUsed();
+}
+
+uint16_t chInterface::txSize(void) {
+  return txControl ? CHILLHUB_TX_CONTROL_RING_SIZE : CHILLHUB_TX_RING_SIZE;
+}
+#else
+uint16_t chInterface::txFree(void) {
+  return txRing.BytesAvailable();
+}
+
+uint16_t chInterface::txUsed(void) {
+  return txRing.BytesUsed();
+}
+
+uint16_t chInterface::txSize(void) {
+  return CHILLHUB_TX_RING_SIZE;
+}
+#endif
+
+// Queues encoded frame bytes.  Only frames bigger than their ring can find
+// it full here; they wait for the port.
+uint16_t chInterface::txOut(const uint8_t *pData, uint8_t len) {
+  uint8_t done = 0;
+
+  while (1) {
+#if CHILLHUB_TX_CONTROL_RING_SIZE > 0
+    if (txControl) {
+      done += txControlRing.WriteBulk(&pData[done], len - done);
+    } else
+#endif
+    {
+      done += txRing.WriteBulk(&pData[done], len - done);
+    }
+    if (done == len) {
+      return len;
+    }
+    drainTx(1);
+  }
+}
+
+// Bytes the frame for the payload takes on the wire.
+uint16_t chInterface::frameSize(const uint8_t *pBuf, chFrameLen_t len, uint16_t crc) {
+  uint16_t size = 1 + 1 + 2;
+  chFrameLen_t i;
+
+#if CHILLHUB_MAX_FRAME_SIZE > 255
+  if (len > 0xff) {
+    size += 2 + isControlChar(MSB_OF_U16(len)) + isControlChar(LSB_OF_U16(len));
+  } else {
+    size += isControlChar(len);
+  }
+#else
+  size += isControlChar(len);
+#endif
+  for (i=0; i<len; i++) {
+    size += 1 + isControlChar(pBuf[i]);
   }
+  size += isControlChar(MSB_OF_U16(crc)) + isControlChar(LSB_OF_U16(crc));
+  return size;
+}
+
+// Returns 1 once a frame of frameLen bytes can be queued in its ring, 0 if
+// the policy says to drop it.
+uint8_t chInterface::makeTxRoom(uint16_t frameLen) {
+  if (frameLen <= txFree()) {
+    return 1;
+  }
+  drainTx(0);
+  if (frameLen <= txFree()) {
+    return 1;
+  }
+  if ((txFullPolicy == chTxFullDrop) && (frameLen <= txSize())) {
+    CHLOG_INFO(CHLOG_TX, "TX ring full, frame dropped.");
+    stats.txDropped++;
+    return 0;
+  }
+  stats.txWaits++;
+  while ((frameLen > txFree()) && (txUsed() > 0)) {
+    drainTx(1);
+  }
+  return 1;
+}
+
+// Writes up to room bytes from the front of ring to the port, with
+// toFrameEnd set no further than the end of the frame being written.
+// *pEscaped (if given) follows the escape state of the ring across writes:
+// an STX starts a frame unless it is the data byte after an ESC, and a
+// write can stop between the two.  Returns the number of bytes written.
+template<class RING>
+chTxIndex_t chInterface::writeOut(RING &ring, uint8_t *pEscaped, int room, uint8_t toFrameEnd) {
+  const uint8_t *pSpan;
+  const uint8_t *pSecond;
+  chTxIndex_t spanLen;
+  chTxIndex_t secondLen;
+  chTxIndex_t n;
+  chTxIndex_t i;
+  uint8_t escaped;
+
+  if ((room <= 0) || (ring.PeekSpan(&pSpan, &spanLen, &pSecond, &secondLen) == 0)) {
+    return 0;
+  }
+  n = (room < spanLen) ? room : spanLen;
+  if (toFrameEnd) {
+    escaped = !*pEscaped && (pSpan[0] == ESC);
+    for (i=1; i<n; i++) {
+      if ((pSpan[i] == STX) && !escaped) {
+        break;
+      }
+      escaped = !escaped && (pSpan[i] == ESC);
+    }
+    n = i;
+  }
+  n = port.write(pSpan, n);
+  ring.Discard(n);
+  if (pEscaped) {
+    for (i=0; i<n; i++) {
+      *pEscaped = !*pEscaped && (pSpan[i] == ESC);
+    }
+  }
+  return n;
+}
+
+// Writes queued bytes to the port as long as it takes them without
+// blocking; with wait set the first piece is written regardless, blocking
+// until the port has taken it.  Control frames go first, but a frame that
+// has been started is finished before the other ring gets the port.  A
+// ring is in the middle of a frame when its next byte is not an STX or is
+// the escaped data byte 0xFF, or when it is empty while the rest of a frame
+// is still being queued.
+void chInterface::drainTx(uint8_t wait) {
+  int room;
+  chTxIndex_t n;
+#if CHILLHUB_TX_CONTROL_RING_SIZE > 0
+  uint8_t bulkStarted;
+  uint8_t controlStarted;
+#endif
 
-  // send CS
-  outputChar(MSB_OF_U16(crc));
-  outputChar(LSB_OF_U16(crc));
+  do {
+    room = port.availableForWrite();
+    if (wait) {
+      room = 0x7fff;
+      wait = 0;
+    }
+#if CHILLHUB_TX_CONTROL_RING_SIZE > 0
+    bulkStarted = (txRing.BytesUsed() > 0) ?
+      ((txRing.Peek(0) != STX) || txBulkEscaped) : (txQueuing && !txControl);
+    controlStarted = (txControlRing.BytesUsed() > 0) ?
+      ((txControlRing.Peek(0) != STX) || txControlEscaped) : (txQueuing && txControl);
+    if (controlStarted || ((txControlRing.BytesUsed() > 0) && !bulkStarted)) {
+      n = writeOut(txControlRing, &txControlEscaped, room, 0);
+    } else {
+      n = writeOut(txRing, &txBulkEscaped, room, txControlRing.BytesUsed() > 0);
+    }
+#else
+    n = writeOut(txRing, (uint8_t *)NULL, room, 0);
+#endif
+  } while (n > 0);
 }
 
+void chInterface::setTxFullPolicy(uint8_t policy) {
+  txFullPolicy = policy;
+}
 
+uint16_t chInterface::getTxQueued(void) {
+#if CHILLHUB_TX_CONTROL_RING_SIZE > 0
+  return txRing.BytesUsed() + txControlRing.BytesUsed();
+#else
+  return txRing.BytesUsed();
+#endif
+}
 
+void chInterface::flushTx(void) {
+  while (getTxQueued() > 0) {
+    drainTx(1);
+  }
+  port.flush();
+}
+#else
+uint16_t chInterface::txOut(const uint8_t *pData, uint8_t len) {
+  return port.write(pData, len);
+}
+#endif
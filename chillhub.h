@@ -4,6 +4,121 @@
 #include <stdint.h>
 #include "ringbuf.h"
 
+// The settings down to CHILLHUB_TRACE_SIZE, and CHILLHUB_RX_FROM_ISR, size
+// members of chInterface.  Set them with the compiler flags of the whole
+// build, never with a #define in a sketch: a sketch that sees a different
+// sizeof(chInterface) than chillhub.cpp fails to link, see
+// chInterfaceLayout below.
+
+// Size of the buffer a complete outgoing frame is encoded into before it is
+// written to the serial port.  Larger frames are written in pieces.
+// Library build only.
+#ifndef CHILLHUB_TX_BUF_SIZE
+  #define CHILLHUB_TX_BUF_SIZE 64
+#endif
+
+// Largest frame (payload plus the two CRC bytes) that can be received.
+// Frames with up to 255 payload bytes use the original one byte length on
+// the wire; bigger ones send a zero length byte followed by a 16 bit length.
+// Capacities above 255 switch frame lengths and indices to 16 bits and
+// enable the extended length form.  Library build only.
+#ifndef CHILLHUB_MAX_FRAME_SIZE
+  #define CHILLHUB_MAX_FRAME_SIZE 64
+#endif
+
+#if CHILLHUB_MAX_FRAME_SIZE > 255
+typedef uint16_t chFrameLen_t;
+#else
+typedef uint8_t chFrameLen_t;
+#endif
+
+// Size of the ring buffer received bytes are staged in before they are
+// framed.  Frames are consumed as they are parsed, so this does not need to
+// hold a whole frame.  Must be a power of two, at most 128.  Library build
+// only.
+#ifndef CHILLHUB_RX_RING_SIZE
+  #define CHILLHUB_RX_RING_SIZE 32
+#endif
+
+// A partly received frame is abandoned when no byte of it has arrived for
+// this many milliseconds, so a truncated frame does not hold on to the bytes
+// of the frames after it.  0 disables the timeout.  Library build only.
+#ifndef CHILLHUB_INTERBYTE_TIMEOUT_MS
+  #define CHILLHUB_INTERBYTE_TIMEOUT_MS 100
+#endif
+
+// Size of the ring complete outgoing frames are queued in, e.g. 128.
+// loop() writes them out only as far as the port's availableForWrite()
+// allows, so sending does not stall reception once the UART's own buffer is
+// full; see setTxFullPolicy() for frames that find the ring full.  Must be
+// a power of two, up to 32768.  The default 0 writes frames straight to the
+// port, which blocks when its buffer is full.  Only for ports that report
+// their free space: Print::availableForWrite() returns 0 unless the port
+// overrides it, and nothing would be sent until the ring is full.  Library
+// build only.
+#ifndef CHILLHUB_TX_RING_SIZE
+  #define CHILLHUB_TX_RING_SIZE 0
+#endif
+
+// Size of a second ring for protocol housekeeping frames: the device
+// announcement, subscriptions, alarms, time requests, keepalives and
+// format negotiation.  loop() finishes the bulk frame it is writing and
+// then sends queued housekeeping frames ahead of the rest of the bulk data
+// (cloud resource traffic and user messages), so a burst of updates does
+// not delay a keepalive reply.  Must be a power of two; 0 sends everything
+// in call order through one ring.  Only used with a TX ring.  Library
+// build only.
+#ifndef CHILLHUB_TX_CONTROL_RING_SIZE
+  #define CHILLHUB_TX_CONTROL_RING_SIZE 64
+#endif
+
+#if (CHILLHUB_TX_RING_SIZE > 128) || (CHILLHUB_TX_CONTROL_RING_SIZE > 128)
+typedef uint16_t chTxIndex_t;
+#else
+typedef uint8_t chTxIndex_t;
+#endif
+
+// Define CHILLHUB_RX_FROM_ISR if received bytes are delivered by a UART
+// receive interrupt calling chInterface::receiveFromIsr() rather than by
+// polling Serial from loop().  The receive ring then has to absorb all bytes
+// arriving between two loop() calls, so size CHILLHUB_RX_RING_SIZE for that.
+// Library build only.
+
+// Number of callbacks other than fridge subscriptions and getTime() that
+// can be registered at once: alarms, cloud listeners and user messages,
+// at most 255.  Library build only.
+#ifndef CHILLHUB_MAX_CALLBACKS
+  #define CHILLHUB_MAX_CALLBACKS 16
+#endif
+
+// Number of cloud resources whose updates can be waiting to be sent at the
+// same time.  A newer value for a resource that is already waiting replaces
+// the old one.  When the queue is full, the oldest update is sent to make
+// room, unless the rate limit has no budget left; then the new update is
+// dropped and counted.  Set to 0 to send every update as soon as it is made.
+// Library build only.
+#ifndef CHILLHUB_UPDATE_QUEUE_SIZE
+  #define CHILLHUB_UPDATE_QUEUE_SIZE 8
+#endif
+
+// Size of the buffer a batched cloud resource update is built in; bounds
+// how many updates fit into one batch.  Library build only.
+#ifndef CHILLHUB_BATCH_BUF_SIZE
+  #define CHILLHUB_BATCH_BUF_SIZE 64
+#endif
+
+// Number of events kept in the binary trace ring, at most 255; 0 leaves
+// tracing out.  An entry takes 6 bytes of RAM on AVR.  Library build only.
+#ifndef CHILLHUB_TRACE_SIZE
+  #define CHILLHUB_TRACE_SIZE 0
+#endif
+
+// Highest message type reserved by the ChillHub protocol, see ChillHubMsgTypes.
+#define CHILLHUB_RESV_MSG_MAX 0x4F
+// First message type used by this library's update formats.  While one is
+// offered, the sketch cannot send or listen for types from here up.
+#define CHILLHUB_LIB_MSG_MIN 0xF0
+
 #define CHILLHUB_CB_TYPE_FRIDGE 0
 #define CHILLHUB_CB_TYPE_CRON 1
 #define CHILLHUB_CB_TYPE_TIME 2
@@ -14,11 +129,126 @@ struct chCbTableType {
   chillhubCallbackFunction callback;
   unsigned char symbol;
   unsigned char type;  // 0: fridge data, 1: cron alarm, 2: time, 3: cloud
-  chCbTableType* rest;
+  unsigned char kind;  // see chCallbackKinds
+};
+
+// The argument a registered callback takes.  Untyped callbacks are called
+// through the signature the received data type implies; typed ones, see
+// chInterface::subscribe<T>(), only for messages of their own data type.
+enum chCallbackKinds {
+  chCbKindUntyped,
+  chCbKindU8,
+  chCbKindI8,
+  chCbKindU16,
+  chCbKindI16,
+  chCbKindU32,
+  chCbKindI32,
+  chCbKindString,
+  chCbKindConstString,
+  chCbKindCount
+};
+
+// Callback argument types the typed registration accepts.  Any other type
+// fails to compile.
+template<typename T> struct chCallbackKind;
+template<> struct chCallbackKind<uint8_t> { enum { kind = chCbKindU8 }; };
+template<> struct chCallbackKind<int8_t> { enum { kind = chCbKindI8 }; };
+template<> struct chCallbackKind<uint16_t> { enum { kind = chCbKindU16 }; };
+template<> struct chCallbackKind<int16_t> { enum { kind = chCbKindI16 }; };
+template<> struct chCallbackKind<uint32_t> { enum { kind = chCbKindU32 }; };
+template<> struct chCallbackKind<int32_t> { enum { kind = chCbKindI32 }; };
+template<> struct chCallbackKind<char *> { enum { kind = chCbKindString }; };
+template<> struct chCallbackKind<const char *> { enum { kind = chCbKindConstString }; };
+
+// A cloud resource value, as waiting in the outbound queue or as decoded
+// from a compact update message by chGateway::decodeCompactUpdates().  Signed values are stored as their two's
+// complement bit pattern.
+struct chResourceUpdate {
+  uint32_t value;
+  uint8_t resID;
+  uint8_t dataType;
+};
+
+// Link layer counters, see chInterface::getLinkStats().  They count from
+// start-up or the last resetLinkStats() and wrap silently.
+struct chLinkStats {
+  unsigned long framesReceived;   // frames with a good CRC
+  unsigned long framesSent;       // frames queued for sending
+  unsigned long crcErrors;
+  unsigned long badLengths;       // zero, or too long for the receive buffer
+  unsigned long framesAborted;    // cut short by an STX or the inter-byte timeout
+  unsigned long rxOverflows;      // bytes dropped because the receive ring was full
+  unsigned long unknownDataTypes; // messages whose data type has no callback form
+  unsigned long missingCallbacks; // messages nobody registered a callback for
+  unsigned long typeMismatches;   // messages a typed callback did not take
+  unsigned long updatesSent;      // cloud resource updates sent
+  unsigned long updatesCoalesced; // updates replaced by a newer value before sending
+  unsigned long updatesDropped;   // updates that found the queue full and no rate budget
+  unsigned long maxLoopMicros;    // longest loop() call
+  unsigned long txWaits;          // frames that had to wait for TX ring room
+  unsigned long txDropped;        // frames dropped because the TX ring was full
+  unsigned long txControlFrames;  // frames queued in the control ring
+  unsigned long txPreemptions;    // control frames queued ahead of waiting bulk data
+  unsigned long reservedRejected; // sends and listeners refused a type an offered update format uses
+};
+
+// What happens to a frame that does not fit into the TX ring.
+enum chTxFullPolicies {
+  chTxFullWait,  // write queued bytes out, blocking if need be, until it fits
+  chTxFullDrop   // drop it and count it in chLinkStats::txDropped
 };
 
-typedef uint8_t (*StateHandler_fp)(void);
+// Events recorded in the trace ring, see CHILLHUB_TRACE_SIZE.
+enum chTraceEvents {
+  stateTraceEvent = 0x01,         // arg: the receive state entered
+  frameReceivedTraceEvent = 0x02, // arg: message type
+  crcErrorTraceEvent = 0x03,      // arg: message type byte as received
+  badLengthTraceEvent = 0x04,     // arg: low byte of the length
+  frameAbortedTraceEvent = 0x05,  // arg: 0 for an STX in the frame, 1 for the timeout
+  rxOverflowTraceEvent = 0x06,
+  frameSentTraceEvent = 0x07      // arg: message type
+};
+
+struct chTraceEntry {
+  unsigned long time;  // micros()
+  uint8_t event;
+  uint8_t arg;
+};
+
+// Layout of a trace dump, one or more messages of the dump message type
+// with an array of U8 holding a header and the entries, oldest first:
+//   version, message index, message count,
+//   per entry: time (4 bytes, big endian), event, arg
+#define CHILLHUB_TRACE_VERSION 1
+#define CHILLHUB_TRACE_HEADER_SIZE 3
+#define CHILLHUB_TRACE_ENTRY_SIZE 6
+#define CHILLHUB_TRACE_ENTRIES_PER_MSG 8
+
+// Number of cloud resources createLinkStatsResources() registers.
+#define CHILLHUB_LINK_STATS_RESOURCES 14
+
+class Stream;
+
+// Layout guard.  The inline chInterface constructors call this with the
+// sizeof(chInterface) of the code constructing it, and chillhub.cpp only
+// instantiates it for its own, so a sketch built with other settings fails
+// to link with an undefined chInterfaceLayout<N>() instead of corrupting
+// memory.
+template<unsigned int N> void chInterfaceLayout(void);
 
+// Where the instance running callbacks is kept: per thread on hosted
+// builds, which may run links on several threads.
+#if defined(ARDUINO)
+  #define CHILLHUB_THREAD_LOCAL
+#else
+  #define CHILLHUB_THREAD_LOCAL thread_local
+#endif
+
+// One link to a hub.  The sketch's ChillHub talks over Serial; boards with
+// more UARTs, and host programs, can create further instances on other
+// Streams.  Instances share no state except dispatching(), which is per
+// thread on hosted builds; on a board, call every instance's loop() from
+// the main loop, not from interrupts.
 class chInterface {
    // Callbacks
   typedef void (*chCbFcnU8)(unsigned char);
@@ -27,13 +257,6 @@ class chInterface {
   typedef void (*chCbFcnTime)(unsigned char[4]);
   typedef void (*chCbFcnStr)(char *);
 
-  // Convenience functions
-  static void printU16(uint16_t val);
-  static void printI16(int16_t val);
-  static void printU8(uint8_t val);
-  static void printU32(uint32_t val);
-  static void printI32(int32_t val);
-
   private:
   // the communication states
   enum ECommState {
@@ -44,19 +267,48 @@ class chInterface {
      State_Invalid = 0xff
   };
 
-  static unsigned char recvBuf[64];
-  static uint8_t bufIndex;
-  static uint8_t payloadLen;
-  static uint8_t msgType;
-  static uint8_t dataType;
-  static unsigned char packetBuf[64];
-  static uint8_t packetLen;
-  static uint8_t packetIndex;
-  static RingBuffer packetRB;
-    static chCbTableType* callbackTable;
-    static void storeCallbackEntry(unsigned char id, unsigned char typ, void(*fcn)());
-    static chillhubCallbackFunction callbackLookup(unsigned char sym, unsigned char typ);
-    static void callbackRemove(unsigned char sym, unsigned char typ);
+  Stream &port;
+  // the instance whose loop() is running callbacks
+  static CHILLHUB_THREAD_LOCAL chInterface *pDispatching;
+  static Stream &openSerial(void);
+  void initState(void);
+  unsigned char recvBuf[CHILLHUB_MAX_FRAME_SIZE];
+  chFrameLen_t bufIndex;
+  uint8_t payloadLen;
+  uint8_t msgType;
+  uint8_t dataType;
+  chFrameLen_t packetLen;
+  uint8_t lengthBytesLeft;
+  uint16_t recvCrc;
+  uint8_t txBuf[CHILLHUB_TX_BUF_SIZE];
+  FixedRingBuffer<CHILLHUB_RX_RING_SIZE> packetRB;
+    // Fridge subscriptions are indexed directly by message type, the single
+    // pending getTime() has its own slot and everything else is kept in
+    // callbackTable sorted by (type, symbol).
+    chillhubCallbackFunction fridgeCallbacks[CHILLHUB_RESV_MSG_MAX+1];
+    uint8_t fridgeCallbackKinds[CHILLHUB_RESV_MSG_MAX+1];
+    chillhubCallbackFunction timeCallback;
+    chCbTableType callbackTable[CHILLHUB_MAX_CALLBACKS];
+    uint8_t callbackCount;
+    static_assert(CHILLHUB_MAX_CALLBACKS <= 255, "callbackCount and the table indices are uint8_t");
+    uint8_t callbackFind(unsigned char sym, unsigned char typ, uint8_t *pIndex);
+    void storeCallbackEntry(unsigned char id, unsigned char typ, void(*fcn)(), uint8_t kind);
+    chillhubCallbackFunction callbackLookup(unsigned char sym, unsigned char typ, uint8_t *pKind);
+    void subscribeKind(unsigned char type, chillhubCallbackFunction cb, uint8_t kind);
+    void addCloudListenerKind(unsigned char msgType, chillhubCallbackFunction cb, uint8_t kind);
+    uint8_t reservedMsgType(uint8_t msgType);
+    void sendFormatOffer(uint8_t msgType, uint8_t version);
+    // Dispatch thunks indexed by callback kind; each decodes the payload
+    // and calls the callback, returning one of the DISPATCH_ results in
+    // chillhub.cpp.
+    typedef uint8_t (*chDispatchFcn)(chillhubCallbackFunction cb, uint8_t type, uint8_t *pData);
+    static const chDispatchFcn payloadDispatchers[chCbKindCount];
+    static uint8_t dispatchUntyped(chillhubCallbackFunction cb, uint8_t type, uint8_t *pData);
+    template<typename T, uint8_t wireType>
+    static uint8_t dispatchInteger(chillhubCallbackFunction cb, uint8_t type, uint8_t *pData);
+    template<typename T>
+    static uint8_t dispatchString(chillhubCallbackFunction cb, uint8_t type, uint8_t *pData);
+    void callbackRemove(unsigned char sym, unsigned char typ);
     static uint8_t appendJsonKey(uint8_t *pBuf, const char *key);
     static uint8_t appendJsonString(uint8_t *pBuf, const char *s);
     static uint8_t appendJsonU8(uint8_t *pBuf, uint8_t v);
@@ -66,44 +318,206 @@ class chInterface {
     static uint8_t appendJsonI16(uint8_t *pBuf, int16_t v);
     static uint8_t appendJsonI32(uint8_t *pBuf, int32_t v);
     static uint8_t sizeOfJsonKey(const char *key);
-    static void processChillhubMessagePayload(void);
-    static void ReadFromSerialPort(void);
-    static void CheckPacket(void);
-    static uint8_t StateHandler_WaitingForStx(void);
-    static uint8_t StateHandler_WaitingForLength(void);
-    static uint8_t StateHandler_WaitingForPacket(void);
-    static uint8_t currentState;
+    uint8_t payloadHas(uint8_t n);
+    static uint8_t dataTypeSize(uint8_t type);
+    void processChillhubMessagePayload(void);
+    uint8_t ReadFromSerialPort(void);
+    void RunStateMachine(void);
+    void ServiceReceiver(void);
+    void CheckPacket(void);
+    uint8_t StateHandler_WaitingForStx(void);
+    uint8_t StateHandler_WaitingForLength(void);
+    uint8_t StateHandler_WaitingForPacket(void);
+    uint8_t currentState;
     // Array of state handlers
+    typedef uint8_t (chInterface::*StateHandler_fp)(void);
     static const StateHandler_fp StateHandlers[];
-    static uint8_t isControlChar(uint8_t c);
-    static void outputChar(uint8_t c);
-    static void sendPacket(uint8_t *pBuf, uint8_t len);
+    uint8_t isControlChar(uint8_t c);
+    uint8_t encodeChar(uint8_t *pOut, uint8_t c);
+    uint8_t ReadUnescaped(uint8_t *pByte);
+#if CHILLHUB_INTERBYTE_TIMEOUT_MS > 0
+    unsigned long lastRxTime;
+#ifdef CHILLHUB_RX_FROM_ISR
+    uint8_t rxLeftover;
+#endif
+    void checkRxTimeout(uint8_t gotBytes);
+#endif
+    uint8_t AcceptLength(void);
+    uint16_t sendPacket(uint8_t *pBuf, chFrameLen_t len);
+    uint16_t txOut(const uint8_t *pData, uint8_t len);
+#if CHILLHUB_TX_RING_SIZE > 0
+    FixedRingBuffer<CHILLHUB_TX_RING_SIZE, chTxIndex_t> txRing;
+#if CHILLHUB_TX_CONTROL_RING_SIZE > 0
+    FixedRingBuffer<CHILLHUB_TX_CONTROL_RING_SIZE, chTxIndex_t> txControlRing;
+    // the frame being queued goes to txControlRing
+    uint8_t txControl;
+    // a frame is being queued, possibly in pieces
+    uint8_t txQueuing;
+    // the last byte written from the ring was an ESC, so the next one is data
+    uint8_t txBulkEscaped;
+    uint8_t txControlEscaped;
+    uint8_t isControlMsgType(uint8_t type);
+#endif
+    uint8_t txFullPolicy;
+    // the ring the current frame is queued in
+    uint16_t txFree(void);
+    uint16_t txUsed(void);
+    uint16_t txSize(void);
+    uint16_t frameSize(const uint8_t *pBuf, chFrameLen_t len, uint16_t crc);
+    uint8_t makeTxRoom(uint16_t frameLen);
+    template<class RING>
+    chTxIndex_t writeOut(RING &ring, uint8_t *pEscaped, int room, uint8_t toFrameEnd);
+    void drainTx(uint8_t wait);
+#endif
+    // outbound cloud resource updates
+#if CHILLHUB_UPDATE_QUEUE_SIZE > 0
+    chResourceUpdate updateQueue[CHILLHUB_UPDATE_QUEUE_SIZE];
+    uint8_t updateQueueCount;
+    uint16_t updateRateLimit;
+    int32_t updateCredit;
+    unsigned long updateCreditTime;
+    void sendOldestUpdate(void);
+    void flushUpdates(void);
+#endif
+    chLinkStats stats;
+#if CHILLHUB_TRACE_SIZE > 0
+    chTraceEntry traceRing[CHILLHUB_TRACE_SIZE];
+    uint8_t traceNext;
+    uint8_t traceCount;
+    uint8_t traceDumpMsgType;
+    uint8_t traceSuspended;
+    void trace(uint8_t event, uint8_t arg);
+#endif
+    void queueUpdate(uint8_t resID, uint8_t dataType, uint32_t val);
+    void dropQueuedUpdate(uint8_t resID);
+    // batched cloud resource updates
+    uint8_t batchBuf[CHILLHUB_BATCH_BUF_SIZE];
+    uint8_t batchIndex;
+    uint8_t batchCount;
+    uint8_t batchFormat;
+    uint8_t batchUpdatesWanted;
+    uint8_t batchUpdatesActive;
+    uint8_t appendBatchKey(uint8_t resID, uint8_t valSize);
+    void sendBatchAsUpdates(void);
+    // compact update format
+    uint8_t compactUpdatesWanted;
+    uint8_t compactUpdatesActive;
+    uint16_t sendResourceUpdate(uint8_t resID, uint8_t dataType, uint32_t val);
 
 
   public:
-    chInterface(void);
-    static void setup(const char* name, const char *UUID);
-    static void subscribe(unsigned char type, chillhubCallbackFunction cb);
-    static void unsubscribe(unsigned char type);
-    static void setAlarm(unsigned char ID, char* cronString, unsigned char strLength, chillhubCallbackFunction cb);
-    static void unsetAlarm(unsigned char ID);
-    static void getTime(chillhubCallbackFunction cb);
-    static void addCloudListener(unsigned char msgType, chillhubCallbackFunction cb);
-    static void createCloudResourceU16(const char *name, uint8_t resId, uint8_t canUpdate, uint16_t initVal);
-    static void createCloudResourceU32(const char *name, uint8_t resId, uint8_t canUpdate, uint32_t initVal);
-    static void createCloudResourceI16(const char *name, uint8_t resId, uint8_t canUpdate, int16_t initVal);
-    static void createCloudResourceI32(const char *name, uint8_t resId, uint8_t canUpdate, int32_t initVal);
-    static void updateCloudResourceU16(uint8_t resID, uint16_t val);
-    static void updateCloudResourceU32(uint8_t resID, uint32_t val);
-    static void updateCloudResourceI16(uint8_t resID, int16_t val);
-    static void updateCloudResourceI32(uint8_t resID, int32_t val);
-    static void sendU8Msg(unsigned char msgType, unsigned char payload);
-    static void sendU16Msg(unsigned char msgType, unsigned int payload);
-    static void sendI8Msg(unsigned char msgType, signed char payload);
-    static void sendI16Msg(unsigned char msgType, signed int payload);
-    static void sendBooleanMsg(unsigned char msgType, unsigned char payload);
-
-    static void loop();
+    // Opens Serial at 115200 baud and uses it.
+    chInterface(void) : port(openSerial()) {
+      chInterfaceLayout<sizeof(chInterface)>();
+      initState();
+    }
+    // Uses port, which the caller has already opened.
+    chInterface(Stream &newPort) : port(newPort) {
+      chInterfaceLayout<sizeof(chInterface)>();
+      initState();
+    }
+    // The instance whose loop() is calling the current callback, so a
+    // callback shared by several instances can answer on the right link;
+    // NULL outside of callbacks.
+    static chInterface *dispatching(void);
+    void setup(const char* name, const char *UUID);
+    void subscribe(unsigned char type, chillhubCallbackFunction cb);
+    void unsubscribe(unsigned char type);
+    void setAlarm(unsigned char ID, char* cronString, unsigned char strLength, chillhubCallbackFunction cb);
+    void setAlarm(unsigned char ID, char* cronString, unsigned char strLength, chCbFcnTime cb);
+    void unsetAlarm(unsigned char ID);
+    void getTime(chillhubCallbackFunction cb);
+    void getTime(chCbFcnTime cb);
+    void addCloudListener(unsigned char msgType, chillhubCallbackFunction cb);
+    // Typed registration, e.g. subscribe(doorStatusMsgType, onDoor) with
+    // void onDoor(uint8_t).  The callback is only called for messages whose
+    // data type matches its argument (uint8_t also takes booleans), with
+    // the value already decoded; other messages for it are dropped and
+    // counted in chLinkStats::typeMismatches.
+    template<typename T>
+    void subscribe(unsigned char type, void (*cb)(T)) {
+      subscribeKind(type, (chillhubCallbackFunction)cb, chCallbackKind<T>::kind);
+    }
+    template<typename T>
+    void addCloudListener(unsigned char msgType, void (*cb)(T)) {
+      addCloudListenerKind(msgType, (chillhubCallbackFunction)cb, chCallbackKind<T>::kind);
+    }
+    void createCloudResourceU16(const char *name, uint8_t resId, uint8_t canUpdate, uint16_t initVal);
+    void createCloudResourceU32(const char *name, uint8_t resId, uint8_t canUpdate, uint32_t initVal);
+    void createCloudResourceI16(const char *name, uint8_t resId, uint8_t canUpdate, int16_t initVal);
+    void createCloudResourceI32(const char *name, uint8_t resId, uint8_t canUpdate, int32_t initVal);
+    void updateCloudResourceU16(uint8_t resID, uint16_t val);
+    void updateCloudResourceU32(uint8_t resID, uint32_t val);
+    void updateCloudResourceI16(uint8_t resID, int16_t val);
+    void updateCloudResourceI32(uint8_t resID, int32_t val);
+    // Send several resource updates in one message: call beginCloudUpdate(),
+    // add the values, then commitCloudUpdate().  The add functions return 0
+    // if the value no longer fits into the batch.  Until the hub has
+    // accepted batches (see useBatchUpdates()) or compact updates, the
+    // commit sends one update message per value.
+    void beginCloudUpdate(void);
+    uint8_t addCloudUpdateU16(uint8_t resID, uint16_t val);
+    uint8_t addCloudUpdateU32(uint8_t resID, uint32_t val);
+    uint8_t addCloudUpdateI16(uint8_t resID, int16_t val);
+    uint8_t addCloudUpdateI32(uint8_t resID, int32_t val);
+    void commitCloudUpdate(void);
+    // Offer batched JSON updates to the hub on the next setup().  They are
+    // only sent once the hub accepts them.
+    void useBatchUpdates(uint8_t enable);
+    uint8_t batchUpdatesEnabled(void);
+    // Offer the compact binary update format to the hub on the next setup().
+    // It is only used once the hub accepts it, older hubs keep getting the
+    // JSON form.
+    void useCompactUpdates(uint8_t enable);
+    uint8_t compactUpdatesEnabled(void);
+    // Limit the serial bandwidth used for cloud resource updates; queued
+    // updates are sent from loop() as the budget allows.  0 means no limit.
+    void setUpdateRateLimit(uint16_t bytesPerSecond);
+    // Updates actually sent, and updates that were replaced by a newer
+    // value for the same resource before they could be sent.
+    unsigned long getUpdatesSent(void);
+    unsigned long getUpdatesCoalesced(void);
+    // Copy out or clear the link layer counters.
+    void getLinkStats(chLinkStats *pStats);
+    void resetLinkStats(void);
+    // Register CHILLHUB_LINK_STATS_RESOURCES read-only U32 cloud resources
+    // with consecutive IDs from firstResID; reportLinkStats() then queues
+    // the current counters as updates to them.
+    void createLinkStatsResources(uint8_t firstResID);
+    void reportLinkStats(uint8_t firstResID);
+#if CHILLHUB_TRACE_SIZE > 0
+    // Send the trace ring to the hub as messages of msgType, see
+    // CHILLHUB_TRACE_VERSION for the layout.  The ring is kept.
+    void sendTraceDump(uint8_t msgType);
+    // Answer every message of msgType from the hub with a trace dump of
+    // the same type; 0 turns this off.
+    void setTraceDumpMsgType(uint8_t msgType);
+    void clearTrace(void);
+#endif
+#if CHILLHUB_TX_RING_SIZE > 0
+    // chTxFullWait (the default) or chTxFullDrop.  Waiting can block the
+    // caller, loop() included when a callback sends, but loses nothing;
+    // dropping keeps loop() from blocking.  Frames bigger than the whole
+    // ring always wait.
+    void setTxFullPolicy(uint8_t policy);
+    // Bytes queued in the TX rings.
+    uint16_t getTxQueued(void);
+    // Write out everything queued, blocking until the port has sent it.
+    void flushTx(void);
+#endif
+    void sendU8Msg(unsigned char msgType, unsigned char payload);
+    void sendU16Msg(unsigned char msgType, unsigned int payload);
+    void sendI8Msg(unsigned char msgType, signed char payload);
+    void sendI16Msg(unsigned char msgType, signed int payload);
+    void sendBooleanMsg(unsigned char msgType, unsigned char payload);
+
+    void loop();
+#ifdef CHILLHUB_RX_FROM_ISR
+    // Feed one received byte from a UART receive interrupt.  Safe to call
+    // while loop() runs; returns RING_BUFFER_ADD_FAILURE if the byte had to
+    // be dropped because the receive ring is full.
+    uint8_t receiveFromIsr(uint8_t c);
+#endif
 };
 
 // Chill Hub data types
@@ -166,12 +580,21 @@ enum ChillHubMsgTypes {
   relayStatusMsgType = 0x2A,
   ductDoorStatusMsgType = 0x2B,
   iceMakerStateSelectionMsgType = 0x2C,
-  iceMakerOperationalStateMsgType = 0x2D
+  iceMakerOperationalStateMsgType = 0x2D,
   // 0x2E-0x4F Reserved for Future Use
-  // 0x50-0xFF User Defined Messages
+  // 0x50-0xEF User Defined Messages
+  // 0xF0-0xFF Used by this library, refused for user messages while
+  //           useCompactUpdates() or useBatchUpdates() is on
+  compactNegotiateMsgType = 0xF0,
+  compactUpdateMsgType = 0xF1,
+  batchNegotiateMsgType = 0xF2,
+  batchUpdateMsgType = 0xF3
 };
 
-#define CHILLHUB_RESV_MSG_MAX 0x4F
+// Version of the compact update format offered to the hub.
+#define CHILLHUB_COMPACT_VERSION 1
+// Version of the batched JSON update message offered to the hub.
+#define CHILLHUB_BATCH_VERSION 1
 
 extern chInterface ChillHub;
 
@@ -0,0 +1,83 @@
+/*
+ * Compile-time configurable diagnostics for the ChillHub library.
+ *
+ * Messages have a level and belong to a subsystem.  Only those at or below
+ * CHLOG_LEVEL and in a subsystem enabled in CHLOG_SUBSYSTEMS are compiled
+ * in; everything else, including the number formatting, disappears from the
+ * build.  The default level is CHLOG_LEVEL_NONE.
+ *
+ * The library does not know where diagnostics should go (Serial is the hub
+ * link), so with logging enabled the sketch has to provide
+ *
+ *   void chlogWrite(const char *s);
+ *
+ * e.g. writing to a SoftwareSerial port.  Messages end in "\r\n".
+ */
+#ifndef CHLOG_H
+#define CHLOG_H
+
+#include <stdint.h>
+
+#define CHLOG_LEVEL_NONE  0
+#define CHLOG_LEVEL_ERROR 1
+#define CHLOG_LEVEL_WARN  2
+#define CHLOG_LEVEL_INFO  3
+#define CHLOG_LEVEL_DEBUG 4  // includes messages for every received byte
+
+#ifndef CHLOG_LEVEL
+  #define CHLOG_LEVEL CHLOG_LEVEL_NONE
+#endif
+
+// subsystems
+#define CHLOG_RX       0x01  // framing and the receive state machine
+#define CHLOG_DISPATCH 0x02  // message handling and callbacks
+#define CHLOG_UPDATES  0x04  // cloud resource updates
+#define CHLOG_TX       0x08  // the transmit ring
+#define CHLOG_ALL      0xff
+
+#ifndef CHLOG_SUBSYSTEMS
+  #define CHLOG_SUBSYSTEMS CHLOG_ALL
+#endif
+
+#if CHLOG_LEVEL > CHLOG_LEVEL_NONE
+
+void chlogWrite(const char *s);
+
+static inline void chlogWriteValue(const char *msg, unsigned long val) {
+  char digits[11];
+  uint8_t i = sizeof(digits) - 1;
+
+  digits[i] = 0;
+  do {
+    digits[--i] = '0' + (val % 10);
+    val /= 10;
+  } while (val);
+
+  chlogWrite(msg);
+  chlogWrite(&digits[i]);
+  chlogWrite("\r\n");
+}
+
+// The subsystem test is on constants and folds away.
+#define CHLOG_IF(level, sub) \
+  if ((CHLOG_LEVEL >= (level)) && ((CHLOG_SUBSYSTEMS) & (sub)))
+
+#define CHLOG(level, sub, msg) \
+  do { CHLOG_IF(level, sub) chlogWrite(msg "\r\n"); } while (0)
+// Logs msg followed by val in decimal.
+#define CHLOG_VALUE(level, sub, msg, val) \
+  do { CHLOG_IF(level, sub) chlogWriteValue(msg, (unsigned long)(val)); } while (0)
+
+#else
+
+#define CHLOG(level, sub, msg) do { } while (0)
+#define CHLOG_VALUE(level, sub, msg, val) do { } while (0)
+
+#endif
+
+#define CHLOG_ERROR(sub, msg) CHLOG(CHLOG_LEVEL_ERROR, sub, msg)
+#define CHLOG_WARN(sub, msg)  CHLOG(CHLOG_LEVEL_WARN, sub, msg)
+#define CHLOG_INFO(sub, msg)  CHLOG(CHLOG_LEVEL_INFO, sub, msg)
+#define CHLOG_DEBUG(sub, msg) CHLOG(CHLOG_LEVEL_DEBUG, sub, msg)
+
+#endif
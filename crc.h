@@ -12,6 +12,8 @@
  *    XorOut       = 0x0000
  *    ReflectOut   = False
  *    Algorithm    = table-driven
+ *
+ * Extended by hand with the alternative back-ends selected by CRC_ENGINE.
  *****************************************************************************/
 #ifndef __CRC_H__
 #define __CRC_H__
@@ -33,6 +35,35 @@ extern "C" {
 #define CRC_ALGO_TABLE_DRIVEN 1
 
 
+/**
+ * The crc_update() back-ends.
+ *
+ * CRC_ENGINE_TABLE          256 entry table in RAM (the pycrc default).
+ * CRC_ENGINE_TABLE_PROGMEM  256 entry table in flash, read with
+ *                           pgm_read_word() on AVR.
+ * CRC_ENGINE_NIBBLE         16 entry table, two lookups per byte, for
+ *                           targets that are short on RAM and flash.
+ * CRC_ENGINE_SLICE4         slicing-by-4, 2 KB of tables.
+ * CRC_ENGINE_SLICE8         slicing-by-8, 4 KB of tables, for hosts.
+ *
+ * All back-ends compute the same crc.  Define CRC_ENGINE to one of these
+ * to override the default, which keeps the table out of SRAM on AVR.
+ *****************************************************************************/
+#define CRC_ENGINE_TABLE         0
+#define CRC_ENGINE_TABLE_PROGMEM 1
+#define CRC_ENGINE_NIBBLE        2
+#define CRC_ENGINE_SLICE4        3
+#define CRC_ENGINE_SLICE8        4
+
+#ifndef CRC_ENGINE
+#if defined(__AVR__)
+#define CRC_ENGINE CRC_ENGINE_TABLE_PROGMEM
+#else
+#define CRC_ENGINE CRC_ENGINE_TABLE
+#endif
+#endif
+
+
 /**
  * The type of the CRC values.
  *
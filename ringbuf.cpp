@@ -106,6 +106,8 @@ uint8_t RingBuffer::IsFull(void) {
 }
 
 uint8_t RingBuffer::Peek(uint8_t pos) {
+   uint16_t index;
+
    if (pBuf == NULL) {
       return 0xff;
    }
@@ -119,12 +121,13 @@ uint8_t RingBuffer::Peek(uint8_t pos) {
       return 0xff;
    }
 
-   pos += head;
-   if (pos >= size) {
-      pos -= (size - 1);
+   // 16 bit so head + pos cannot wrap for buffers close to 255 bytes
+   index = head + pos;
+   if (index >= size) {
+      index -= size;
    }
 
-   return pBuf[pos];
+   return pBuf[index];
 }
 
 
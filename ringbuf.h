@@ -26,6 +26,9 @@
  * THE SOFTWARE.
  */
 
+#ifndef RINGBUF_H
+#define RINGBUF_H
+
 #include <stdint.h>
 
 #define RING_BUFFER_IS_FULL 1
@@ -58,4 +61,188 @@ class RingBuffer {
    uint8_t BytesAvailable(void);
 };
 
+/*
+ * Index shared between the producer and the consumer of a FixedRingBuffer.
+ * Load() has acquire and Store() release semantics, so the bytes written
+ * before the tail is published are visible to whoever sees the new tail.
+ * AVR is single core and reads a uint8_t index atomically, so volatile plus
+ * a compiler barrier is enough there; everywhere else the GCC atomic
+ * builtins are used, which keeps <atomic> out of sketches.
+ */
+template <typename INDEX>
+class RingBufferIndex {
+   private:
+#if defined(__AVR__)
+   volatile INDEX value;
+#else
+   INDEX value;
+#endif
+
+   public:
+   RingBufferIndex(void) : value(0) {}
+
+#if defined(__AVR__)
+   INDEX Load(void) const {
+      INDEX v = value;
+      __asm__ __volatile__("" ::: "memory");
+      return v;
+   }
+
+   void Store(INDEX v) {
+      __asm__ __volatile__("" ::: "memory");
+      value = v;
+   }
+#else
+   INDEX Load(void) const {
+      return __atomic_load_n(&value, __ATOMIC_ACQUIRE);
+   }
+
+   void Store(INDEX v) {
+      __atomic_store_n(&value, v, __ATOMIC_RELEASE);
+   }
+#endif
+};
+
+/*
+ * Ring buffer with a power of two capacity given as a template parameter.
+ * The head and tail indices run freely and are masked on access, so the
+ * fill level is simply tail - head and no other bookkeeping is updated on
+ * Write() or Read().  INDEX must be able to count to SIZE, so the default
+ * uint8_t allows up to 128 bytes; use uint16_t for bigger buffers.
+ *
+ * The buffer is safe for one producer and one consumer running
+ * concurrently, e.g. a UART receive interrupt and the main loop: the
+ * producer side (Write, WriteBulk) only stores tail and the consumer side
+ * (Read, ReadBulk, Peek, PeekSpan, Discard) only stores head.  On 8-bit
+ * MCUs keep INDEX at uint8_t so the indices are read atomically.
+ */
+template <uint16_t SIZE, typename INDEX = uint8_t>
+class FixedRingBuffer {
+   static_assert((SIZE != 0) && ((SIZE & (SIZE - 1)) == 0), "SIZE must be a power of two");
+   static_assert(SIZE <= ((INDEX)~(INDEX)0 / 2 + 1), "INDEX is too small for SIZE");
+
+   private:
+   static const INDEX mask = SIZE - 1;
+   uint8_t buf[SIZE];
+   RingBufferIndex<INDEX> head;
+   RingBufferIndex<INDEX> tail;
+
+   public:
+   uint8_t Write(uint8_t val) {
+      INDEX t = tail.Load();
+
+      if ((INDEX)(t - head.Load()) == SIZE) {
+         return RING_BUFFER_ADD_FAILURE;
+      }
+      buf[t & mask] = val;
+      tail.Store(t + 1);
+      return RING_BUFFER_ADD_SUCCESS;
+   }
+
+   uint8_t Read(void) {
+      INDEX h = head.Load();
+      uint8_t retVal;
+
+      if (h == tail.Load()) {
+         return 0xff;
+      }
+      retVal = buf[h & mask];
+      head.Store(h + 1);
+      return retVal;
+   }
+
+   uint8_t IsEmpty(void) {
+      return (BytesUsed() == 0) ? RING_BUFFER_IS_EMPTY : RING_BUFFER_NOT_EMPTY;
+   }
+
+   uint8_t IsFull(void) {
+      return (BytesUsed() == SIZE) ? RING_BUFFER_IS_FULL : RING_BUFFER_NOT_FULL;
+   }
+
+   uint8_t Peek(INDEX pos) {
+      INDEX h = head.Load();
+
+      if (pos >= (INDEX)(tail.Load() - h)) {
+         return 0xff;
+      }
+      return buf[(INDEX)(h + pos) & mask];
+   }
+
+   INDEX BytesUsed(void) {
+      INDEX h = head.Load();
+      return (INDEX)(tail.Load() - h);
+   }
+
+   INDEX BytesAvailable(void) {
+      return SIZE - BytesUsed();
+   }
+
+   // Copies up to len bytes in, returns the number of bytes written.
+   INDEX WriteBulk(const uint8_t *pData, INDEX len) {
+      INDEX t = tail.Load();
+      INDEX room = SIZE - (INDEX)(t - head.Load());
+      INDEX i;
+
+      if (len > room) {
+         len = room;
+      }
+      for (i=0; i<len; i++) {
+         buf[(INDEX)(t + i) & mask] = pData[i];
+      }
+      tail.Store(t + len);
+      return len;
+   }
+
+   // Copies up to len bytes out, returns the number of bytes read.
+   INDEX ReadBulk(uint8_t *pData, INDEX len) {
+      INDEX h = head.Load();
+      INDEX used = tail.Load() - h;
+      INDEX i;
+
+      if (len > used) {
+         len = used;
+      }
+      for (i=0; i<len; i++) {
+         pData[i] = buf[(INDEX)(h + i) & mask];
+      }
+      head.Store(h + len);
+      return len;
+   }
+
+   // Describes the buffered bytes as up to two contiguous spans without
+   // consuming them.  Returns the number of non-empty spans.
+   uint8_t PeekSpan(const uint8_t **ppFirst, INDEX *pFirstLen,
+         const uint8_t **ppSecond, INDEX *pSecondLen) {
+      INDEX h = head.Load();
+      INDEX used = tail.Load() - h;
+      INDEX start = h & mask;
+      INDEX firstLen = SIZE - start;
+
+      if (firstLen > used) {
+         firstLen = used;
+      }
+      *ppFirst = &buf[start];
+      *pFirstLen = firstLen;
+      *ppSecond = &buf[0];
+      *pSecondLen = used - firstLen;
+
+      if (used == 0) {
+         return 0;
+      }
+      return (*pSecondLen == 0) ? 1 : 2;
+   }
+
+   // Drops up to len bytes, returns the number of bytes dropped.
+   INDEX Discard(INDEX len) {
+      INDEX h = head.Load();
+      INDEX used = tail.Load() - h;
+
+      if (len > used) {
+         len = used;
+      }
+      head.Store(h + len);
+      return len;
+   }
+};
 
+#endif
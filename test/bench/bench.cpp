@@ -0,0 +1,838 @@
+/*
+ * Host benchmarks for the ChillHub protocol stack.
+ *
+ * Built and run by `make bench` in test/.  Every result is printed as one
+ * JSON object per line so runs on different commits can be collected and
+ * compared by a script.  Throughput numbers are for the host CPU and only
+ * meaningful relative to each other and to earlier runs on the same machine.
+ *
+ * Usage: chillhub_bench [filter]   runs only benchmarks whose name
+ *                                  contains filter
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Arduino.h"
+#include "chillhub.h"
+#include "crc.h"
+#include "chlog.h"
+#include "ringbuf.h"
+#include "HostFrame.h"
+#include "chframe.h"
+
+#ifndef BENCH_REV
+  #define BENCH_REV "unknown"
+#endif
+
+// How long each measurement runs.
+#define BENCH_NS 200000000ULL
+
+chInterface ChillHub;
+
+static const char *filter;
+static volatile uint32_t sink;
+
+#if CHLOG_LEVEL > CHLOG_LEVEL_NONE
+// Logging build: count the messages and throw them away, which leaves
+// the cost of producing them.
+static unsigned long logWrites;
+
+void chlogWrite(const char *s) {
+   logWrites++;
+   sink += s[0];
+}
+#else
+static const unsigned long logWrites = 0;
+#endif
+
+static unsigned long long nowNs(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int selected(const char *name) {
+   return (filter == NULL) || (strstr(name, filter) != NULL);
+}
+
+// Starts a result line; the caller adds its fields and calls endResult().
+static void beginResult(const char *name) {
+   printf("{\"bench\":\"%s\",\"rev\":\"%s\",\"crc_engine\":%d,\"chlog_level\":%d",
+         name, BENCH_REV, CRC_ENGINE, CHLOG_LEVEL);
+}
+
+static void endResult(void) {
+   printf("}\n");
+   fflush(stdout);
+}
+
+static void onU16(unsigned int v) {
+   sink += v;
+}
+
+static void onTypedU16(uint16_t v) {
+   sink += v;
+}
+
+// Plays the hub accepting an update format offered by setup().
+static void hubAccepts(HostLoopbackStream &port, uint8_t msgType, uint8_t version) {
+   const uint8_t accept[] = { 3, msgType, unsigned8DataType, version };
+   uint8_t frame[16];
+
+   port.hubWrite(frame, hostEncodeFrame(accept, sizeof(accept), frame));
+   ChillHub.loop();
+}
+
+/*
+ * Transmit path: frames encoded by sendPacket() into a port that discards
+ * them.
+ */
+static void benchSendPacket(void) {
+   HostFdStream nullPort(-1, -1);
+   HostLoopbackStream hub;
+   unsigned long long start, elapsed;
+   unsigned long frames = 0;
+   unsigned long sent;
+   int i;
+
+   if (!selected("send_packet")) return;
+   Serial.attach(&hub);
+   ChillHub.useBatchUpdates(1);
+   ChillHub.setup("bench", "0");
+   hubAccepts(hub, batchNegotiateMsgType, CHILLHUB_BATCH_VERSION);
+   Serial.attach(&nullPort);
+
+   Serial.resetStats();
+   start = nowNs();
+   do {
+      for (i=0; i<1024; i++) {
+         ChillHub.sendU16Msg(0x60, i);
+      }
+      frames += 1024;
+      elapsed = nowNs() - start;
+   } while (elapsed < BENCH_NS);
+   beginResult("send_packet");
+   printf(",\"frame\":\"u16\",\"frames_per_s\":%.0f,\"bytes_per_s\":%.0f,"
+         "\"writes_per_frame\":%.2f",
+         frames * 1e9 / elapsed, Serial.getBytesWritten() * 1e9 / elapsed,
+         (double)Serial.getWriteCalls() / frames);
+   endResult();
+
+   // resource updates as a sketch sends them: queued, then sent by loop()
+   Serial.resetStats();
+   sent = ChillHub.getUpdatesSent();
+   start = nowNs();
+   do {
+      for (i=0; i<256; i++) {
+         ChillHub.updateCloudResourceU16(0x80 + (i & 0x07), i);
+         if ((i & 0x07) == 0x07) {
+            ChillHub.loop();
+         }
+      }
+      elapsed = nowNs() - start;
+   } while (elapsed < BENCH_NS);
+   frames = ChillHub.getUpdatesSent() - sent;
+   beginResult("send_packet");
+   printf(",\"frame\":\"update_u16\",\"frames_per_s\":%.0f,\"bytes_per_s\":%.0f,"
+         "\"writes_per_frame\":%.2f,\"ns_per_frame\":%.1f",
+         frames * 1e9 / elapsed, Serial.getBytesWritten() * 1e9 / elapsed,
+         (double)Serial.getWriteCalls() / frames, (double)elapsed / frames);
+   endResult();
+
+   // the largest frame the batch buffer produces
+   Serial.resetStats();
+   frames = 0;
+   start = nowNs();
+   do {
+      for (i=0; i<256; i++) {
+         ChillHub.beginCloudUpdate();
+         while (ChillHub.addCloudUpdateU32(0x80 + (ChillHub.getUpdatesSent() & 0x0f), 0xfffefdfc)) {
+         }
+         ChillHub.commitCloudUpdate();
+      }
+      frames += 256;
+      elapsed = nowNs() - start;
+   } while (elapsed < BENCH_NS);
+   beginResult("send_packet");
+   printf(",\"frame\":\"batch\",\"frames_per_s\":%.0f,\"bytes_per_s\":%.0f,"
+         "\"writes_per_frame\":%.2f",
+         frames * 1e9 / elapsed, Serial.getBytesWritten() * 1e9 / elapsed,
+         (double)Serial.getWriteCalls() / frames);
+   endResult();
+
+   ChillHub.useBatchUpdates(0);
+   Serial.attach(0);
+}
+
+/*
+ * Receive path: pre-encoded U16 frames for a registered listener fed
+ * through loop(), which runs the StateHandlers state machine and
+ * dispatches each frame.  Returns nanoseconds per frame.
+ */
+static double decodeFrames(uint8_t msgType, unsigned long *pFrames, unsigned long long *pBytes) {
+   HostLoopbackStream port;
+   static uint8_t burst[16384];
+   uint8_t msg[] = { 4, msgType, unsigned16DataType, 0x12, 0x34 };
+   size_t burstLen = 0;
+   unsigned long framesPerBurst = 0;
+   unsigned long long start, elapsed;
+   unsigned long frames = 0;
+   unsigned long long bytes = 0;
+
+   while (burstLen + 16 < sizeof(burst)) {
+      msg[4] = framesPerBurst;
+      burstLen += hostEncodeFrame(msg, sizeof(msg), &burst[burstLen]);
+      framesPerBurst++;
+   }
+
+   Serial.attach(&port);
+   start = nowNs();
+   do {
+      port.hubWrite(burst, burstLen);
+      while (Serial.available() > 0) {
+         ChillHub.loop();
+      }
+      frames += framesPerBurst;
+      bytes += burstLen;
+      elapsed = nowNs() - start;
+   } while (elapsed < BENCH_NS);
+   Serial.attach(0);
+
+   if (pFrames) *pFrames = frames;
+   if (pBytes) *pBytes = bytes;
+   return (double)elapsed / frames;
+}
+
+static void benchDecode(void) {
+   unsigned long frames;
+   unsigned long long bytes;
+   double nsPerFrame;
+
+   unsigned long writesBefore = logWrites;
+
+   if (!selected("decode")) return;
+   ChillHub.addCloudListener(0x50, (chillhubCallbackFunction)onU16);
+   nsPerFrame = decodeFrames(0x50, &frames, &bytes);
+   beginResult("decode");
+   printf(",\"frames_per_s\":%.0f,\"bytes_per_s\":%.0f,\"log_writes_per_frame\":%.1f",
+         1e9 / nsPerFrame, bytes * 1e9 / (nsPerFrame * frames),
+         (double)(logWrites - writesBefore) / frames);
+   endResult();
+}
+
+/*
+ * Dispatch cost against the number of registered callbacks.  Frames go to
+ * the most recently registered listener, registered untyped and then typed.
+ */
+static void benchDispatch(void) {
+   static const int counts[] = { 1, 2, 4, 8, 16, 32, 64, 128, 200 };
+   int registered = 0;
+   unsigned int i;
+
+   if (!selected("dispatch")) return;
+   for (i=0; i<sizeof(counts)/sizeof(counts[0]); i++) {
+      if (counts[i] > CHILLHUB_MAX_CALLBACKS) {
+         break;
+      }
+      while (registered < counts[i]) {
+         ChillHub.addCloudListener(0x50 + registered, (chillhubCallbackFunction)onU16);
+         registered++;
+      }
+      beginResult("dispatch");
+      printf(",\"callbacks\":%d,\"typed\":0,\"ns_per_frame\":%.1f",
+            registered, decodeFrames(0x50 + registered - 1, NULL, NULL));
+      endResult();
+      ChillHub.addCloudListener(0x50 + registered - 1, onTypedU16);
+      beginResult("dispatch");
+      printf(",\"callbacks\":%d,\"typed\":1,\"ns_per_frame\":%.1f",
+            registered, decodeFrames(0x50 + registered - 1, NULL, NULL));
+      endResult();
+   }
+}
+
+/*
+ * Latency of a single loop() call that finds a burst of frames waiting,
+ * the figure a sketch doing other work in loop() cares about.
+ */
+static int compareNs(const void *a, const void *b) {
+   unsigned long long x = *(const unsigned long long *)a;
+   unsigned long long y = *(const unsigned long long *)b;
+   return (x > y) - (x < y);
+}
+
+static void benchLoopLatency(void) {
+   static const int bursts[] = { 1, 8, 32 };
+   static unsigned long long samples[20000];
+   HostLoopbackStream port;
+   uint8_t msg[] = { 4, 0x50, unsigned16DataType, 0, 0 };
+   uint8_t burst[1024];
+   size_t burstLen;
+   unsigned int b;
+   int i, j;
+
+   if (!selected("loop_latency")) return;
+   ChillHub.addCloudListener(0x50, (chillhubCallbackFunction)onU16);
+   Serial.attach(&port);
+
+   for (b=0; b<sizeof(bursts)/sizeof(bursts[0]); b++) {
+      burstLen = 0;
+      for (j=0; j<bursts[b]; j++) {
+         msg[4] = j;
+         burstLen += hostEncodeFrame(msg, sizeof(msg), &burst[burstLen]);
+      }
+      for (i=0; i<(int)(sizeof(samples)/sizeof(samples[0])); i++) {
+         unsigned long long start;
+         port.hubWrite(burst, burstLen);
+         start = nowNs();
+         ChillHub.loop();
+         samples[i] = nowNs() - start;
+         while (Serial.available() > 0) {
+            ChillHub.loop();
+         }
+      }
+      qsort(samples, sizeof(samples)/sizeof(samples[0]), sizeof(samples[0]), compareNs);
+      beginResult("loop_latency");
+      printf(",\"frames_per_loop\":%d,\"p50_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu",
+            bursts[b], samples[10000], samples[19800], samples[19999]);
+      endResult();
+   }
+
+   Serial.attach(0);
+}
+
+/*
+ * Cost of the loop() call that takes a frame's last byte against the call
+ * before it, with the hub's bytes arriving one per loop().  The receive CRC
+ * is accumulated as bytes arrive, so the last call only finalizes it and
+ * dispatches, and end_p50_ns stays flat as the frame grows.  crc_walk_ns is
+ * what re-walking the payload in CheckPacket() would add to that call.
+ */
+#define FRAME_END_FRAMES 5000
+
+static void onFrameEndStr(char *s) {
+   sink += s[0];
+}
+
+static void frameEndLatency(size_t strLen) {
+   static unsigned long long endNs[FRAME_END_FRAMES];
+   static unsigned long long midNs[FRAME_END_FRAMES];
+   HostLoopbackStream port;
+   uint8_t msg[256];
+   uint8_t frame[CHFRAME_ENCODED_SIZE(256)];
+   size_t msgLen = strLen + 4;
+   size_t frameLen;
+   unsigned long long start, elapsed;
+   unsigned long walks = 0;
+   crc_t crc;
+   size_t i, j;
+
+   msg[0] = msgLen - 1;
+   msg[1] = 0x50;
+   msg[2] = stringDataType;
+   for (i=0; i<strLen; i++) {
+      msg[3 + i] = 'a' + (i % 26);
+   }
+   msg[msgLen - 1] = 0;
+   frameLen = hostEncodeFrame(msg, msgLen, frame);
+
+   Serial.attach(&port);
+   for (i=0; i<FRAME_END_FRAMES; i++) {
+      for (j=0; j<frameLen; j++) {
+         port.hubWrite(&frame[j], 1);
+         start = nowNs();
+         ChillHub.loop();
+         elapsed = nowNs() - start;
+         if (j == frameLen - 2) {
+            midNs[i] = elapsed;
+         } else if (j == frameLen - 1) {
+            endNs[i] = elapsed;
+         }
+      }
+   }
+   Serial.attach(0);
+
+   crc = crc_init();
+   start = nowNs();
+   do {
+      for (i=0; i<256; i++) {
+         crc = crc_update(crc, msg, msgLen);
+      }
+      walks += 256;
+      elapsed = nowNs() - start;
+   } while (elapsed < BENCH_NS / 10);
+   sink += crc;
+
+   qsort(midNs, FRAME_END_FRAMES, sizeof(midNs[0]), compareNs);
+   qsort(endNs, FRAME_END_FRAMES, sizeof(endNs[0]), compareNs);
+   beginResult("frame_end_latency");
+   printf(",\"payload\":%lu,\"frames\":%d,\"mid_p50_ns\":%llu,\"end_p50_ns\":%llu,"
+         "\"end_p99_ns\":%llu,\"end_max_ns\":%llu,\"crc_walk_ns\":%.1f",
+         (unsigned long)msgLen, FRAME_END_FRAMES, midNs[FRAME_END_FRAMES / 2],
+         endNs[FRAME_END_FRAMES / 2], endNs[FRAME_END_FRAMES * 99 / 100],
+         endNs[FRAME_END_FRAMES - 1], (double)elapsed / walks);
+   endResult();
+}
+
+static void benchFrameEndLatency(void) {
+   static const size_t strLens[] = { 4, 28, 60, 124, 250 };
+   unsigned int i;
+
+   if (!selected("frame_end_latency")) return;
+   ChillHub.addCloudListener(0x50, (chillhubCallbackFunction)onFrameEndStr);
+   for (i=0; i<sizeof(strLens)/sizeof(strLens[0]); i++) {
+      // the length byte, type, data type and terminator share the frame
+      if (strLens[i] + 4 > CHILLHUB_MAX_FRAME_SIZE) {
+         break;
+      }
+      frameEndLatency(strLens[i]);
+   }
+}
+
+/*
+ * Receive draining at 115200 baud on the simulated clock: the hub sends
+ * frames back to back at line rate and the sketch calls loop() every
+ * period_us.  Reports the bytes one loop() call takes off the port and the
+ * latency from a frame's last byte arriving to its callback.
+ */
+#define RX_DRAIN_FRAMES 4000
+
+static unsigned long long rxDoneUs[RX_DRAIN_FRAMES];
+static unsigned long long rxLatencyUs[RX_DRAIN_FRAMES];
+static unsigned int rxCalls;
+
+static void onRxFrame(uint16_t n) {
+   if (n < RX_DRAIN_FRAMES) {
+      rxLatencyUs[rxCalls++] = hostClockNow() - rxDoneUs[n];
+   }
+}
+
+static void rxDrain(unsigned long periodUs) {
+   static uint8_t stream[RX_DRAIN_FRAMES * 16];
+   HostLoopbackStream hub;
+   HostSerial port;
+   uint8_t msg[] = { 4, 0x50, unsigned16DataType, 0, 0 };
+   size_t streamLen = 0;
+   size_t sent = 0;
+   unsigned long loops = 0;
+   unsigned long maxPerLoop = 0;
+   unsigned long before;
+   unsigned long long t;
+   unsigned int n;
+
+   for (n=0; n<RX_DRAIN_FRAMES; n++) {
+      msg[3] = n >> 8;
+      msg[4] = n;
+      streamLen += hostEncodeFrame(msg, sizeof(msg), &stream[streamLen]);
+      // 10 bits per byte on the wire
+      rxDoneUs[n] = streamLen * 10 * 1000000ULL / 115200;
+   }
+
+   port.attach(&hub);
+   chInterface link(port);
+   link.addCloudListener(0x50, onRxFrame);
+   rxCalls = 0;
+   hostClockSet(0);
+   for (t=periodUs; sent<streamLen; t+=periodUs) {
+      size_t arrived = t * 115200 / 10 / 1000000;
+      if (arrived > streamLen) {
+         arrived = streamLen;
+      }
+      hub.hubWrite(&stream[sent], arrived - sent);
+      sent = arrived;
+      hostClockSet(t);
+      before = port.getBytesRead();
+      link.loop();
+      if (port.getBytesRead() - before > maxPerLoop) {
+         maxPerLoop = port.getBytesRead() - before;
+      }
+      loops++;
+   }
+
+   qsort(rxLatencyUs, rxCalls, sizeof(rxLatencyUs[0]), compareNs);
+   beginResult("rx_drain");
+   printf(",\"baud\":115200,\"period_us\":%lu,\"frames\":%u,\"bytes_per_loop\":%.1f,"
+         "\"max_bytes_per_loop\":%lu,\"latency_p50_us\":%llu,\"latency_max_us\":%llu",
+         periodUs, rxCalls, (double)port.getBytesRead() / loops, maxPerLoop,
+         rxLatencyUs[rxCalls / 2], rxLatencyUs[rxCalls - 1]);
+   endResult();
+}
+
+static void benchRxDrain(void) {
+   static const unsigned long periods[] = { 100, 1000, 10000 };
+   unsigned int i;
+
+   if (!selected("rx_drain")) return;
+   hostClockUseRealTime(0);
+   for (i=0; i<sizeof(periods)/sizeof(periods[0]); i++) {
+      rxDrain(periods[i]);
+   }
+   hostClockUseRealTime(1);
+}
+
+/*
+ * Longest loop() call at 115200 baud on the simulated clock, which only
+ * moves when a write blocks: the sketch updates a resource every
+ * millisecond and every 10 ms the hub sends a request whose callback sends
+ * a number of replies.  Together they ask for more than the line carries.
+ */
+static void onRequestReplies(uint8_t n) {
+   chInterface *pLink = chInterface::dispatching();
+   uint8_t i;
+
+   for (i=0; i<n; i++) {
+      pLink->sendU16Msg(0x61, i);
+   }
+}
+
+static void loopBlocking(uint8_t replies, uint8_t policy, const char *policyName) {
+   HostLoopbackStream hub;
+   HostSerial port;
+   uint8_t msg[] = { 3, 0x60, unsigned8DataType, replies };
+   uint8_t frame[16];
+   uint8_t drain[256];
+   size_t frameLen = hostEncodeFrame(msg, sizeof(msg), frame);
+   chLinkStats stats;
+   unsigned int ms;
+
+   port.attach(&hub);
+   port.setBaud(115200);
+   chInterface link(port);
+#if CHILLHUB_TX_RING_SIZE > 0
+   link.setTxFullPolicy(policy);
+#else
+   (void)policy;
+#endif
+   link.addCloudListener(0x60, onRequestReplies);
+   for (ms=0; ms<1000; ms++) {
+      if (ms % 10 == 0) {
+         hub.hubWrite(frame, frameLen);
+      }
+      link.updateCloudResourceU16(0x40 + (ms & 7), ms);
+      link.loop();
+      hostClockAdvance(1000);
+      while (hub.hubRead(drain, sizeof(drain)) > 0) {
+      }
+   }
+   link.getLinkStats(&stats);
+   beginResult("loop_blocking");
+   printf(",\"tx_ring\":%d,\"policy\":\"%s\",\"replies\":%d,\"max_loop_us\":%lu,"
+         "\"tx_waits\":%lu,\"tx_dropped\":%lu,\"updates_sent\":%lu,\"updates_coalesced\":%lu",
+         CHILLHUB_TX_RING_SIZE, policyName, replies, stats.maxLoopMicros,
+         stats.txWaits, stats.txDropped, stats.updatesSent, stats.updatesCoalesced);
+   endResult();
+}
+
+static void benchLoopBlocking(void) {
+   static const uint8_t replies[] = { 1, 4, 16 };
+   unsigned int i;
+
+   if (!selected("loop_blocking")) return;
+   hostClockUseRealTime(0);
+   for (i=0; i<sizeof(replies)/sizeof(replies[0]); i++) {
+#if CHILLHUB_TX_RING_SIZE > 0
+      loopBlocking(replies[i], chTxFullWait, "wait");
+      loopBlocking(replies[i], chTxFullDrop, "drop");
+#else
+      loopBlocking(replies[i], 0, "none");
+#endif
+   }
+   hostClockUseRealTime(1);
+}
+
+/*
+ * Keepalive latency under bulk load at 115200 baud on the simulated clock:
+ * loop() runs every 100 us, the sketch updates eight resources and sends
+ * two user messages every millisecond, more than the line carries, and
+ * every 20 ms the hub sends a keepalive the sketch answers.  The latency
+ * is from the keepalive reaching the device to the whole reply having been
+ * handed to the UART; control_ring is CHILLHUB_TX_CONTROL_RING_SIZE.
+ */
+static void onKeepAlive(uint8_t v) {
+   chInterface::dispatching()->sendU8Msg(keepAliveType, v);
+}
+
+static void controlLatency(uint8_t policy, const char *policyName) {
+   static unsigned long long samples[64];
+   HostLoopbackStream hub;
+   HostSerial port;
+   uint8_t request[] = { 3, keepAliveType, unsigned8DataType, 0 };
+   uint8_t frame[16];
+   uint8_t rxBuf[64];
+   uint8_t c;
+   chFrameParser parser(rxBuf, sizeof(rxBuf));
+   unsigned long long sentAt[256];
+   unsigned int requests = 0;
+   unsigned int replies = 0;
+   unsigned int tick;
+   unsigned int i;
+   chLinkStats stats;
+
+   port.attach(&hub);
+   port.setBaud(115200);
+   chInterface link(port);
+#if CHILLHUB_TX_RING_SIZE > 0
+   link.setTxFullPolicy(policy);
+#else
+   (void)policy;
+#endif
+   link.subscribe(keepAliveType, onKeepAlive);
+   hostClockSet(0);
+   for (tick=0; tick<20000; tick++) {
+      if (tick % 10 == 0) {
+         for (i=0; i<8; i++) {
+            link.updateCloudResourceU16(0x40 + i, tick);
+         }
+         link.sendU16Msg(0x62, tick);
+         link.sendU16Msg(0x63, tick);
+      }
+      if (tick % 200 == 0) {
+         request[3] = requests;
+         sentAt[requests & 0xff] = hostClockNow();
+         hub.hubWrite(frame, hostEncodeFrame(request, sizeof(request), frame));
+         requests++;
+      }
+      link.loop();
+      while (hub.hubRead(&c, 1) == 1) {
+         if ((parser.feed(c) == CHFRAME_OK) && (parser.payload()[1] == keepAliveType)) {
+            samples[replies % 64] = hostClockNow() - sentAt[parser.payload()[3]];
+            replies++;
+         }
+      }
+      hostClockAdvance(100);
+   }
+   link.getLinkStats(&stats);
+
+   unsigned int n = (replies < 64) ? replies : 64;
+   qsort(samples, n, sizeof(samples[0]), compareNs);
+   beginResult("control_latency");
+   printf(",\"tx_ring\":%d,\"control_ring\":%d,\"policy\":\"%s\",\"requests\":%u,\"replies\":%u,"
+         "\"p50_us\":%llu,\"max_us\":%llu,\"tx_preemptions\":%lu,\"tx_dropped\":%lu",
+         CHILLHUB_TX_RING_SIZE, (CHILLHUB_TX_RING_SIZE > 0) ? CHILLHUB_TX_CONTROL_RING_SIZE : 0,
+         policyName, requests, replies,
+         n ? samples[n / 2] : 0, n ? samples[n - 1] : 0, stats.txPreemptions, stats.txDropped);
+   endResult();
+}
+
+static void benchControlLatency(void) {
+   if (!selected("control_latency")) return;
+   hostClockUseRealTime(0);
+#if CHILLHUB_TX_RING_SIZE > 0
+   controlLatency(chTxFullWait, "wait");
+   controlLatency(chTxFullDrop, "drop");
+#else
+   controlLatency(0, "none");
+#endif
+   hostClockUseRealTime(1);
+}
+
+static void benchCrc(void) {
+   static const size_t lengths[] = { 8, 64, 4096 };
+   static uint8_t data[4096];
+   unsigned long long start, elapsed;
+   unsigned long long bytes;
+   unsigned int i;
+   size_t j;
+
+   if (!selected("crc")) return;
+   for (j=0; j<sizeof(data); j++) {
+      data[j] = j * 7;
+   }
+
+   for (i=0; i<sizeof(lengths)/sizeof(lengths[0]); i++) {
+      crc_t crc = crc_init();
+      bytes = 0;
+      start = nowNs();
+      do {
+         for (j=0; j<256; j++) {
+            crc = crc_update(crc, data, lengths[i]);
+         }
+         bytes += 256 * lengths[i];
+         elapsed = nowNs() - start;
+      } while (elapsed < BENCH_NS);
+      sink += crc;
+      beginResult("crc_update");
+      printf(",\"block\":%lu,\"mb_per_s\":%.1f",
+            (unsigned long)lengths[i], bytes * 1e3 / elapsed);
+      endResult();
+   }
+}
+
+static void benchRingBuffer(void) {
+   static uint8_t storage[32];
+   RingBuffer rb(storage, sizeof(storage));
+   FixedRingBuffer<32> frb;
+   uint8_t chunk[16];
+   unsigned long long start, elapsed;
+   unsigned long long ops;
+   int i;
+
+   if (!selected("ringbuf")) return;
+
+   ops = 0;
+   start = nowNs();
+   do {
+      for (i=0; i<4096; i++) {
+         rb.Write(i);
+         sink += rb.Read();
+      }
+      ops += 2 * 4096;
+      elapsed = nowNs() - start;
+   } while (elapsed < BENCH_NS);
+   beginResult("ringbuf");
+   printf(",\"impl\":\"RingBuffer\",\"ops_per_s\":%.0f", ops * 1e9 / elapsed);
+   endResult();
+
+   ops = 0;
+   start = nowNs();
+   do {
+      for (i=0; i<4096; i++) {
+         frb.Write(i);
+         sink += frb.Read();
+      }
+      ops += 2 * 4096;
+      elapsed = nowNs() - start;
+   } while (elapsed < BENCH_NS);
+   beginResult("ringbuf");
+   printf(",\"impl\":\"FixedRingBuffer\",\"ops_per_s\":%.0f", ops * 1e9 / elapsed);
+   endResult();
+
+   // one op per byte moved
+   memset(chunk, 0x55, sizeof(chunk));
+   ops = 0;
+   start = nowNs();
+   do {
+      for (i=0; i<1024; i++) {
+         frb.WriteBulk(chunk, sizeof(chunk));
+         frb.ReadBulk(chunk, sizeof(chunk));
+      }
+      ops += 2 * 1024 * sizeof(chunk);
+      elapsed = nowNs() - start;
+   } while (elapsed < BENCH_NS);
+   sink += chunk[0];
+   beginResult("ringbuf");
+   printf(",\"impl\":\"FixedRingBuffer bulk\",\"ops_per_s\":%.0f", ops * 1e9 / elapsed);
+   endResult();
+}
+
+/*
+ * Updates per second a sketch gets through a 115200 baud link on the
+ * simulated clock, calling loop() every 100 us and offering more updates
+ * than the line carries: one single update per call, or a full batch.
+ */
+static double updatesPerSecond(uint8_t batch) {
+   HostFdStream nullPort(-1, -1);
+   unsigned long sent = ChillHub.getUpdatesSent();
+   unsigned long long start;
+   int i, n;
+
+   Serial.attach(&nullPort);
+   Serial.setBaud(115200);
+   hostClockUseRealTime(0);
+   start = hostClockNow();
+   for (i=0; hostClockNow() - start < 1000000; i++) {
+      if (batch) {
+         ChillHub.beginCloudUpdate();
+         for (n=0; ChillHub.addCloudUpdateU16(0x10 + n, i); n++) {
+         }
+         ChillHub.commitCloudUpdate();
+      } else {
+         ChillHub.updateCloudResourceU16(0x10 + (i & 0x07), i);
+      }
+      ChillHub.loop();
+      hostClockAdvance(100);
+   }
+#if CHILLHUB_TX_RING_SIZE > 0
+   ChillHub.flushTx();
+#endif
+   Serial.flush();
+   sent = ChillHub.getUpdatesSent() - sent;
+
+   hostClockUseRealTime(1);
+   Serial.setBaud(0);
+   return sent * 1e6 / (hostClockNow() - start);
+}
+
+/*
+ * Serial bytes per cloud resource update in each wire format.  These do
+ * not depend on the machine, so any change is a format change.  The
+ * updates per second at 115200 baud follow from them and the loop()
+ * overhead.
+ */
+static void benchUpdateWireBytes(void) {
+   HostLoopbackStream port;
+   double rate;
+   int i;
+
+   if (!selected("update_wire_bytes")) return;
+   Serial.attach(&port);
+   ChillHub.setUpdateRateLimit(0);
+   ChillHub.useBatchUpdates(1);
+   ChillHub.setup("bench", "0");
+   hubAccepts(port, batchNegotiateMsgType, CHILLHUB_BATCH_VERSION);
+
+   for (i=0; i<2; i++) {
+      const char *format = i ? "compact" : "json";
+      unsigned long bytes;
+      int n;
+
+      if (i) {
+         ChillHub.useCompactUpdates(1);
+         ChillHub.setup("bench", "0");
+         hubAccepts(port, compactNegotiateMsgType, CHILLHUB_COMPACT_VERSION);
+      }
+
+      Serial.resetStats();
+      ChillHub.updateCloudResourceU16(0x10, 1234);
+      ChillHub.loop();
+      bytes = Serial.getBytesWritten();
+      rate = updatesPerSecond(0);
+      Serial.attach(&port);
+      beginResult("update_wire_bytes");
+      printf(",\"format\":\"%s\",\"mode\":\"single_u16\",\"bytes_per_update\":%lu,"
+            "\"updates_per_s_115200\":%.0f", format, bytes, rate);
+      endResult();
+
+      Serial.resetStats();
+      ChillHub.beginCloudUpdate();
+      for (n=0; ChillHub.addCloudUpdateU16(0x10 + n, 1234); n++) {
+      }
+      ChillHub.commitCloudUpdate();
+      bytes = Serial.getBytesWritten();
+      rate = updatesPerSecond(1);
+      Serial.attach(&port);
+      beginResult("update_wire_bytes");
+      printf(",\"format\":\"%s\",\"mode\":\"batch_u16\",\"updates\":%d,\"bytes_per_update\":%.1f,"
+            "\"updates_per_s_115200\":%.0f", format, n, (double)bytes / n, rate);
+      endResult();
+   }
+
+   ChillHub.useCompactUpdates(0);
+   ChillHub.useBatchUpdates(0);
+   Serial.attach(0);
+}
+
+int main(int argc, char **argv) {
+   if (argc > 1) {
+      filter = argv[1];
+   }
+
+   hostClockUseRealTime(1);
+   Serial.setBaud(0);
+
+   benchSendPacket();
+   benchDecode();
+   benchDispatch();
+   benchLoopLatency();
+   benchFrameEndLatency();
+   benchRxDrain();
+   benchLoopBlocking();
+   benchControlLatency();
+   benchCrc();
+   benchRingBuffer();
+   benchUpdateWireBytes();
+
+   return 0;
+}
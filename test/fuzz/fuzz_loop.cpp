@@ -0,0 +1,98 @@
+/*
+ * Fuzz target for the receive path: arbitrary bytes from the hub are fed
+ * through chInterface::loop(), which runs the StateHandlers state machine
+ * and processChillhubMessagePayload().
+ *
+ * Works with libFuzzer (clang -fsanitize=fuzzer) or with the standalone
+ * driver in standalone_main.cpp; see the Makefile.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "Arduino.h"
+#include "chillhub.h"
+
+chInterface ChillHub;
+
+static HostLoopbackStream port;
+static volatile uint32_t sink;
+
+// The callbacks touch everything they are handed so the sanitizers see
+// any read past the payload.
+static void onU8(uint8_t v) { sink += v; }
+static void onI8(int8_t v) { sink += v; }
+static void onU16(uint16_t v) { sink += v; }
+static void onI16(int16_t v) { sink += v; }
+static void onU32(uint32_t v) { sink += v; }
+static void onI32(int32_t v) { sink += v; }
+static void onString(char *s) { sink += strlen(s); }
+static void onConstString(const char *s) { sink += strlen(s); }
+static void onTime(unsigned char t[4]) { sink += t[0] + t[1] + t[2] + t[3]; }
+
+static void registerCallbacks(void) {
+   static char cron[] = "* * * * *";
+   unsigned int i;
+
+   // Typed callbacks only see their own data type, so each signature is
+   // registered for some message types.
+   for (i=filterAlertMsgType; i<=CHILLHUB_RESV_MSG_MAX; i++) {
+      switch (i % 6) {
+         case 0: ChillHub.subscribe(i, onU8); break;
+         case 1: ChillHub.subscribe(i, onI8); break;
+         case 2: ChillHub.subscribe(i, onU16); break;
+         case 3: ChillHub.subscribe(i, onI16); break;
+         case 4: ChillHub.subscribe(i, onU32); break;
+         default: ChillHub.subscribe(i, onI32); break;
+      }
+   }
+   ChillHub.addCloudListener(0x50, onString);
+   ChillHub.addCloudListener(0x51, onU8);
+   ChillHub.addCloudListener(0x52, onU16);
+   ChillHub.addCloudListener(0x53, onU32);
+   ChillHub.addCloudListener(0x54, onI32);
+   ChillHub.addCloudListener(0xff, onConstString);
+   ChillHub.setAlarm('a', cron, strlen(cron), onTime);
+   ChillHub.useCompactUpdates(1);
+   ChillHub.useBatchUpdates(1);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+   static uint8_t initialized = 0;
+   static const uint8_t idle[CHILLHUB_MAX_FRAME_SIZE + 8] = {0};
+   size_t chunk;
+   size_t offset;
+
+   if (!initialized) {
+      Serial.attach(&port);
+      registerCallbacks();
+      initialized = 1;
+   }
+   // getTime() callbacks are one shot
+   ChillHub.getTime(onTime);
+
+   // The first byte picks how the rest arrives: 1 to 15 bytes per loop()
+   // call, or everything at once, to cover frames split across calls.
+   if (size == 0) {
+      return 0;
+   }
+   chunk = data[0] & 0x0f;
+   data++;
+   size--;
+   if (chunk == 0) {
+      chunk = size;
+   }
+
+   for (offset=0; offset<size; offset+=chunk) {
+      port.hubWrite(&data[offset], (size - offset < chunk) ? size - offset : chunk);
+      ChillHub.loop();
+   }
+
+   // Zeros complete or abort whatever frame is in progress, so every input
+   // starts with the framer waiting for STX.
+   port.hubWrite(idle, sizeof(idle));
+   ChillHub.loop();
+   port.clear();
+
+   return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * Writes the seed corpus for fuzz_loop.cpp: valid frames for every
+ * ChillHubMsgTypes value with each data type the library decodes, plus a
+ * few user messages and framing corner cases.
+ *
+ *   gen_corpus <directory>
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "chillhub.h"
+#include "HostFrame.h"
+
+static const uint8_t msgTypes[] = {
+   deviceIdMsgType, subscribeMsgType, unsubscribeMsgType, setAlarmMsgType,
+   unsetAlarmMsgType, alarmNotifyMsgType, getTimeMsgType, timeResponseMsgType,
+   deviceIdRequestType, registerResourceType, updateResourceType,
+   resourceUpdatedType, setDeviceUUIDType, keepAliveType,
+   filterAlertMsgType,
+   waterFilterCalendarTimerMsgType, waterFilterCalendarPercentUsedMsgType,
+   waterFilterHoursRemainingMsgType, waterUsageTimerMsgType,
+   waterFilterUsageTimePercentUsedMsgType, waterFilterOuncesRemainingMsgType,
+   commandFeaturesMsgType, temperatureAlertMsgType,
+   freshFoodDisplayTemperatureMsgType, freezerDisplayTemperatureMsgType,
+   freshFoodSetpointTemperatureMsgType, freezerSetpointTemperatureMsgType,
+   doorAlarmAlertMsgType, iceMakerBucketStatusMsgType,
+   odorFilterCalendarTimerMsgType, odorFilterPercentUsedMsgType,
+   odorFilterHoursRemainingMsgType, doorStatusMsgType, dcSwitchStateMsgType,
+   acInputStateMsgType, iceMakerMoldThermistorTemperatureMsgType,
+   iceCabinetThermistorTemperatureMsgType,
+   hotWaterThermistor1TemperatureMsgType,
+   hotWaterThermistor2TemperatureMsgType, dctSwitchStateMsgType,
+   relayStatusMsgType, ductDoorStatusMsgType, iceMakerStateSelectionMsgType,
+   iceMakerOperationalStateMsgType, compactNegotiateMsgType,
+   compactUpdateMsgType, batchNegotiateMsgType, batchUpdateMsgType,
+   // user defined
+   0x50, 0x51, 0x52, 0x53, 0xff
+};
+
+static const char *dir;
+static unsigned int written;
+
+// Writes one corpus file: the fuzz target's chunking byte (0, everything
+// at once) followed by the frame.
+static void writeSeed(const char *name, uint8_t msgType, const uint8_t *pPayload, size_t len) {
+   uint8_t file[2 * CHILLHUB_MAX_FRAME_SIZE + 16];
+   char path[512];
+   FILE *f;
+   size_t n;
+
+   file[0] = 0;
+   n = 1 + hostEncodeFrame(pPayload, len, &file[1]);
+   snprintf(path, sizeof(path), "%s/%02x_%s", dir, msgType, name);
+   f = fopen(path, "wb");
+   if (f == NULL) {
+      perror(path);
+      return;
+   }
+   fwrite(file, 1, n, f);
+   fclose(f);
+   written++;
+}
+
+static void writeSeedsFor(uint8_t msgType) {
+   uint8_t p[CHILLHUB_MAX_FRAME_SIZE];
+   size_t n;
+
+   p[1] = msgType;
+
+   p[0] = 3; p[2] = unsigned8DataType; p[3] = 1;
+   writeSeed("u8", msgType, p, 4);
+   p[2] = booleanDataType;
+   writeSeed("bool", msgType, p, 4);
+
+   p[0] = 4; p[2] = unsigned16DataType; p[3] = 0xfe; p[4] = 0xff;
+   writeSeed("u16", msgType, p, 5);
+
+   p[0] = 6; p[2] = unsigned32DataType; p[3] = 0x12; p[4] = 0x34; p[5] = 0x56; p[6] = 0x78;
+   writeSeed("u32", msgType, p, 7);
+
+   p[2] = stringDataType;
+   strcpy((char *)&p[3], "hello");
+   n = 3 + strlen("hello") + 1;
+   p[0] = n - 1;
+   writeSeed("string", msgType, p, n);
+
+   // array of four bytes, the time response and alarm layout
+   p[2] = arrayDataType; p[3] = 5; p[4] = unsigned8DataType;
+   p[5] = 'a'; p[6] = 12; p[7] = 30; p[8] = 1; p[9] = 7;
+   p[0] = 9;
+   writeSeed("array", msgType, p, 10);
+
+   // JSON as used by updateResourceType, with a U16 value
+   p[2] = jsonDataType; p[3] = 1;
+   n = 4;
+   strcpy((char *)&p[n], "val"); n += 4;
+   p[n++] = unsigned16DataType; p[n++] = 0; p[n++] = 42;
+   p[0] = n - 1;
+   writeSeed("json", msgType, p, n);
+}
+
+int main(int argc, char **argv) {
+   uint8_t p[CHILLHUB_MAX_FRAME_SIZE];
+   unsigned int i;
+
+   if (argc != 2) {
+      fprintf(stderr, "usage: %s <directory>\n", argv[0]);
+      return 1;
+   }
+   dir = argv[1];
+
+   for (i=0; i<sizeof(msgTypes); i++) {
+      writeSeedsFor(msgTypes[i]);
+   }
+
+   // the largest frame that fits the receive buffer, a string payload
+   // without a terminator
+   memset(p, 'x', sizeof(p));
+   p[0] = CHILLHUB_MAX_FRAME_SIZE - 3;
+   p[1] = 0x50;
+   p[2] = stringDataType;
+   writeSeed("string_max_unterminated", 0x50, p, CHILLHUB_MAX_FRAME_SIZE - 2);
+
+   // a data type with its value cut off
+   p[0] = 2; p[1] = 0x53; p[2] = unsigned32DataType;
+   writeSeed("u32_truncated", 0x53, p, 3);
+
+   printf("wrote %u seeds to %s\n", written, dir);
+   return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Driver for fuzz_loop.cpp where libFuzzer is not available (e.g. gcc).
+ *
+ * Runs every file given on the command line, or every file in a given
+ * directory, through the fuzz target.  With -runs=N it then runs N inputs
+ * made by randomly mutating those files, which is not coverage guided but
+ * still finds a lot when built with the sanitizers.
+ *
+ *   fuzz_loop_standalone [-runs=N] [-seed=S] corpus/ [file...]
+ */
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+#define MAX_INPUTS 4096
+#define MAX_INPUT_SIZE 4096
+
+static uint8_t *inputs[MAX_INPUTS];
+static size_t inputSizes[MAX_INPUTS];
+static unsigned int inputCount;
+
+static void runFile(const char *path) {
+   FILE *f = fopen(path, "rb");
+   uint8_t *buf;
+   size_t len;
+
+   if (f == NULL) {
+      perror(path);
+      return;
+   }
+   buf = (uint8_t *)malloc(MAX_INPUT_SIZE);
+   len = fread(buf, 1, MAX_INPUT_SIZE, f);
+   fclose(f);
+
+   LLVMFuzzerTestOneInput(buf, len);
+   if (inputCount < MAX_INPUTS) {
+      inputs[inputCount] = buf;
+      inputSizes[inputCount] = len;
+      inputCount++;
+   } else {
+      free(buf);
+   }
+}
+
+static void runPath(const char *path) {
+   struct stat st;
+   DIR *dir;
+   struct dirent *entry;
+   char name[1024];
+
+   if ((stat(path, &st) == 0) && S_ISDIR(st.st_mode)) {
+      dir = opendir(path);
+      while (dir && ((entry = readdir(dir)) != NULL)) {
+         if (entry->d_name[0] == '.') continue;
+         snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+         runFile(name);
+      }
+      if (dir) closedir(dir);
+   } else {
+      runFile(path);
+   }
+}
+
+// Random edits biased towards the bytes the framer cares about.
+static size_t mutate(uint8_t *buf, size_t len) {
+   static const uint8_t special[] = { 0xff, 0xfe, 0x00, 0x01, 0x02, 0x3e, 0x3f, 0x40 };
+   int edits = 1 + rand() % 4;
+   size_t pos;
+
+   while (edits--) {
+      pos = len ? rand() % len : 0;
+      switch (rand() % 6) {
+         case 0:
+            if (len) buf[pos] ^= 1 << (rand() % 8);
+            break;
+         case 1:
+            if (len) buf[pos] = special[rand() % sizeof(special)];
+            break;
+         case 2:
+            if (len) buf[pos] = rand();
+            break;
+         case 3:
+            if (len < MAX_INPUT_SIZE) {
+               memmove(&buf[pos+1], &buf[pos], len - pos);
+               buf[pos] = special[rand() % sizeof(special)];
+               len++;
+            }
+            break;
+         case 4:
+            if (len) {
+               memmove(&buf[pos], &buf[pos+1], len - pos - 1);
+               len--;
+            }
+            break;
+         default:
+            // splice in part of another input
+            if (inputCount) {
+               unsigned int other = rand() % inputCount;
+               size_t n = inputSizes[other];
+               if (n > MAX_INPUT_SIZE - pos) n = MAX_INPUT_SIZE - pos;
+               memcpy(&buf[pos], inputs[other], n);
+               if (pos + n > len) len = pos + n;
+            }
+            break;
+      }
+   }
+   return len;
+}
+
+int main(int argc, char **argv) {
+   static uint8_t buf[MAX_INPUT_SIZE];
+   unsigned long runs = 0;
+   unsigned long i;
+   int arg;
+
+   srand(1);
+   for (arg=1; arg<argc; arg++) {
+      if (strncmp(argv[arg], "-runs=", 6) == 0) {
+         runs = strtoul(&argv[arg][6], NULL, 0);
+      } else if (strncmp(argv[arg], "-seed=", 6) == 0) {
+         srand(strtoul(&argv[arg][6], NULL, 0));
+      } else {
+         runPath(argv[arg]);
+      }
+   }
+   printf("ran %u inputs\n", inputCount);
+
+   for (i=0; i<runs; i++) {
+      size_t len = 0;
+      if (inputCount) {
+         unsigned int pick = rand() % inputCount;
+         len = inputSizes[pick];
+         memcpy(buf, inputs[pick], len);
+      }
+      len = mutate(buf, len);
+      LLVMFuzzerTestOneInput(buf, len);
+   }
+   if (runs) {
+      printf("ran %lu mutated inputs\n", runs);
+   }
+
+   for (i=0; i<inputCount; i++) {
+      free(inputs[i]);
+   }
+   return 0;
+}
@@ -0,0 +1,22 @@
+/*
+ * Host stand-in for the parts of the Arduino core the ChillHub library
+ * uses, so chillhub.cpp can be built and run unchanged on a PC.
+ *
+ * Serial is a HostSerial whose bytes come from and go to a pluggable
+ * HostStream (in-memory loopback, pty or file), and millis()/micros() read
+ * a clock that tests can drive by hand.  See HostSerial.h.
+ */
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "HostSerial.h"
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+#endif
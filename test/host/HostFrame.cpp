@@ -0,0 +1,9 @@
+/*
+ * Hub side framing for host tests, benchmarks and the fuzzer corpus.
+ */
+#include "HostFrame.h"
+#include "chframe.h"
+
+size_t hostEncodeFrame(const uint8_t *pPayload, size_t len, uint8_t *pOut) {
+   return chFrameEncode(pPayload, len, pOut);
+}
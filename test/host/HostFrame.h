@@ -0,0 +1,19 @@
+/*
+ * Hub side framing for host tests, benchmarks and the fuzzer corpus.
+ */
+#ifndef HOST_FRAME_H
+#define HOST_FRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chframe.h"
+
+#define HOST_FRAME_STX CHFRAME_STX
+#define HOST_FRAME_ESC CHFRAME_ESC
+
+// Frames a payload the way the hub does, see chframe.h.  pOut needs room
+// for CHFRAME_ENCODED_SIZE(len) bytes.  Returns the frame length.
+size_t hostEncodeFrame(const uint8_t *pPayload, size_t len, uint8_t *pOut);
+
+#endif
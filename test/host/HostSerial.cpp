@@ -0,0 +1,292 @@
+/*
+ * Simulated serial port and clock for host builds; see HostSerial.h.
+ */
+#include "Arduino.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+HostSerial Serial;
+
+/*
+ * Clock
+ */
+static unsigned long long simulatedUs = 0;
+static uint8_t realTime = 0;
+static unsigned long long realTimeBase = 0;
+
+static unsigned long long monotonicUs(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void hostClockAdvance(unsigned long us) {
+   if (realTime)
+      usleep(us);
+   else
+      simulatedUs += us;
+}
+
+void hostClockSet(unsigned long long us) {
+   simulatedUs = us;
+   realTimeBase = monotonicUs() - us;
+}
+
+unsigned long long hostClockNow(void) {
+   if (realTime)
+      return monotonicUs() - realTimeBase;
+   return simulatedUs;
+}
+
+void hostClockUseRealTime(uint8_t enable) {
+   if (enable && !realTime)
+      realTimeBase = monotonicUs() - simulatedUs;
+   else if (!enable && realTime)
+      simulatedUs = monotonicUs() - realTimeBase;
+   realTime = enable;
+}
+
+unsigned long millis(void) {
+   return (unsigned long)(hostClockNow() / 1000);
+}
+
+unsigned long micros(void) {
+   return (unsigned long)hostClockNow();
+}
+
+void delay(unsigned long ms) {
+   hostClockAdvance(ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+   hostClockAdvance(us);
+}
+
+/*
+ * Loopback stream
+ */
+HostLoopbackStream::HostLoopbackStream(void) {
+   toDevice = (uint8_t*)malloc(HOST_STREAM_QUEUE_SIZE);
+   fromDevice = (uint8_t*)malloc(HOST_STREAM_QUEUE_SIZE);
+   clear();
+}
+
+HostLoopbackStream::~HostLoopbackStream() {
+   free(toDevice);
+   free(fromDevice);
+}
+
+void HostLoopbackStream::clear(void) {
+   toDeviceHead = toDeviceTail = 0;
+   fromDeviceHead = fromDeviceTail = 0;
+}
+
+int HostLoopbackStream::available(void) {
+   return (int)(toDeviceTail - toDeviceHead);
+}
+
+int HostLoopbackStream::read(void) {
+   if (toDeviceHead == toDeviceTail)
+      return -1;
+   return toDevice[toDeviceHead++ % HOST_STREAM_QUEUE_SIZE];
+}
+
+size_t HostLoopbackStream::write(const uint8_t *pBuf, size_t len) {
+   size_t n = 0;
+   while ((n < len) && (fromDeviceTail - fromDeviceHead < HOST_STREAM_QUEUE_SIZE))
+      fromDevice[fromDeviceTail++ % HOST_STREAM_QUEUE_SIZE] = pBuf[n++];
+   return n;
+}
+
+size_t HostLoopbackStream::hubWrite(const uint8_t *pBuf, size_t len) {
+   size_t n = 0;
+   while ((n < len) && (toDeviceTail - toDeviceHead < HOST_STREAM_QUEUE_SIZE))
+      toDevice[toDeviceTail++ % HOST_STREAM_QUEUE_SIZE] = pBuf[n++];
+   return n;
+}
+
+size_t HostLoopbackStream::hubRead(uint8_t *pBuf, size_t len) {
+   size_t n = 0;
+   while ((n < len) && (fromDeviceHead != fromDeviceTail))
+      pBuf[n++] = fromDevice[fromDeviceHead++ % HOST_STREAM_QUEUE_SIZE];
+   return n;
+}
+
+size_t HostLoopbackStream::hubAvailable(void) {
+   return fromDeviceTail - fromDeviceHead;
+}
+
+/*
+ * File descriptor stream
+ */
+HostFdStream::HostFdStream(int newReadFd, int newWriteFd) {
+   readFd = newReadFd;
+   writeFd = newWriteFd;
+   peeked = -1;
+   if (readFd >= 0)
+      fcntl(readFd, F_SETFL, fcntl(readFd, F_GETFL) | O_NONBLOCK);
+}
+
+int HostFdStream::available(void) {
+   if (peeked < 0) {
+      uint8_t c;
+      if ((readFd < 0) || (::read(readFd, &c, 1) != 1))
+         return 0;
+      peeked = c;
+   }
+   return 1;
+}
+
+int HostFdStream::read(void) {
+   int c;
+
+   if (!available())
+      return -1;
+   c = peeked;
+   peeked = -1;
+   return c;
+}
+
+size_t HostFdStream::write(const uint8_t *pBuf, size_t len) {
+   size_t n = 0;
+
+   if (writeFd < 0)
+      return len;
+   while (n < len) {
+      ssize_t w = ::write(writeFd, pBuf + n, len - n);
+      if (w > 0)
+         n += w;
+      else if ((w < 0) && (errno != EAGAIN) && (errno != EINTR))
+         break;
+   }
+   return n;
+}
+
+int HostFdStream::openPty(char *pSlaveName, size_t nameLen) {
+   int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+   if (fd < 0)
+      return -1;
+   if ((grantpt(fd) < 0) || (unlockpt(fd) < 0) ||
+       (ptsname_r(fd, pSlaveName, nameLen) != 0)) {
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/*
+ * Serial port
+ */
+void HostSerial::begin(unsigned long baudRate) {
+   setBaud(baudRate);
+}
+
+void HostSerial::end(void) {
+   flush();
+}
+
+void HostSerial::attach(HostStream *pNewStream) {
+   pStream = pNewStream;
+   txFifoUsed = 0;
+   txDrainTime = hostClockNow();
+}
+
+void HostSerial::setBaud(unsigned long baudRate) {
+   drainTxFifo();
+   baud = baudRate;
+}
+
+// Retire the bytes that went out on the line since the last call.  A byte
+// with start and stop bit takes 10 bit times.
+void HostSerial::drainTxFifo(void) {
+   unsigned long long now = hostClockNow();
+
+   if ((baud == 0) || (txFifoUsed == 0)) {
+      txFifoUsed = 0;
+      txDrainTime = now;
+      return;
+   }
+   unsigned long long sent = (now - txDrainTime) * baud / 10000000ULL;
+   if (sent >= txFifoUsed) {
+      txFifoUsed = 0;
+      txDrainTime = now;
+   }
+   else if (sent > 0) {
+      txFifoUsed -= sent;
+      txDrainTime += sent * 10000000ULL / baud;
+   }
+}
+
+int HostSerial::available(void) {
+   return pStream ? pStream->available() : 0;
+}
+
+int HostSerial::read(void) {
+   int c = pStream ? pStream->read() : -1;
+   if (c >= 0)
+      bytesRead++;
+   return c;
+}
+
+size_t HostSerial::write(const uint8_t *pBuf, size_t len) {
+   writeCalls++;
+   if (baud) {
+      // Like HardwareSerial, block until everything fits in the FIFO.
+      size_t queued = 0;
+      while (queued < len) {
+         drainTxFifo();
+         if (txFifoUsed == HOST_SERIAL_TX_FIFO_SIZE) {
+            unsigned long byteUs = 10000000UL / baud + 1;
+            blockedUs += byteUs;
+            hostClockAdvance(byteUs);
+            continue;
+         }
+         size_t n = HOST_SERIAL_TX_FIFO_SIZE - txFifoUsed;
+         if (n > len - queued)
+            n = len - queued;
+         if (txFifoUsed == 0)
+            txDrainTime = hostClockNow();
+         txFifoUsed += n;
+         queued += n;
+      }
+   }
+   bytesWritten += len;
+   if (pStream)
+      pStream->write(pBuf, len);
+   return len;
+}
+
+size_t HostSerial::write(uint8_t c) {
+   return write(&c, 1);
+}
+
+int HostSerial::availableForWrite(void) {
+   if (baud == 0)
+      return HOST_SERIAL_TX_FIFO_SIZE;
+   drainTxFifo();
+   return HOST_SERIAL_TX_FIFO_SIZE - txFifoUsed;
+}
+
+void HostSerial::flush(void) {
+   if (baud == 0)
+      return;
+   drainTxFifo();
+   while (txFifoUsed) {
+      unsigned long byteUs = 10000000UL / baud + 1;
+      hostClockAdvance(byteUs * txFifoUsed);
+      drainTxFifo();
+   }
+}
+
+void HostSerial::resetStats(void) {
+   bytesWritten = 0;
+   bytesRead = 0;
+   writeCalls = 0;
+   blockedUs = 0;
+}
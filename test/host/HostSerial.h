@@ -0,0 +1,143 @@
+/*
+ * Simulated serial port and clock for host builds of the ChillHub library.
+ *
+ * HostSerial provides the subset of the Arduino HardwareSerial interface
+ * used by the library, behind the same Stream base class a chInterface
+ * takes, so tests can run several links on HostSerial instances.  The
+ * bytes themselves are exchanged with whatever HostStream is attached:
+ *
+ *   HostLoopbackStream  two in-memory queues, the test plays the hub
+ *   HostFdStream        file descriptors, e.g. a pty or a replay file
+ *
+ * With a baud rate set, transmitted bytes leave a 64 byte TX FIFO at the
+ * line rate of the host clock, so availableForWrite() and blocking writes
+ * behave like on a board.  The host clock is simulated and only moves when
+ * hostClockAdvance() is called or a write has to wait for the FIFO, unless
+ * hostClockUseRealTime() switches it to the real monotonic clock.
+ */
+#ifndef HOST_SERIAL_H
+#define HOST_SERIAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HOST_SERIAL_TX_FIFO_SIZE 64
+#define HOST_STREAM_QUEUE_SIZE 65536
+
+// Clock behind millis() and micros().
+void hostClockAdvance(unsigned long us);
+void hostClockSet(unsigned long long us);
+unsigned long long hostClockNow(void);
+void hostClockUseRealTime(uint8_t enable);
+
+class HostStream {
+   public:
+   virtual ~HostStream() {}
+   // device side: bytes waiting to be read, read one (-1 if none)
+   virtual int available(void) = 0;
+   virtual int read(void) = 0;
+   // device side: bytes leaving the port
+   virtual size_t write(const uint8_t *pBuf, size_t len) = 0;
+};
+
+// A pair of byte queues.  The library reads what the test pushed with
+// hubWrite() and the test collects what the library sent with hubRead().
+class HostLoopbackStream : public HostStream {
+   private:
+   uint8_t *toDevice;
+   uint8_t *fromDevice;
+   size_t toDeviceHead, toDeviceTail;
+   size_t fromDeviceHead, fromDeviceTail;
+
+   public:
+   HostLoopbackStream(void);
+   ~HostLoopbackStream();
+   int available(void);
+   int read(void);
+   size_t write(const uint8_t *pBuf, size_t len);
+
+   size_t hubWrite(const uint8_t *pBuf, size_t len);
+   size_t hubRead(uint8_t *pBuf, size_t len);
+   size_t hubAvailable(void);
+   void clear(void);
+};
+
+// Non-blocking file descriptors: a pty, a pipe, or a capture file to replay
+// (pass -1 as writeFd to discard output).
+class HostFdStream : public HostStream {
+   private:
+   int readFd;
+   int writeFd;
+   int peeked;
+
+   public:
+   HostFdStream(int readFd, int writeFd);
+   int available(void);
+   int read(void);
+   size_t write(const uint8_t *pBuf, size_t len);
+   // Opens a pty pair; the library side is the master, pSlaveName gets the
+   // path a hub process can open.  Returns the master fd or -1.
+   static int openPty(char *pSlaveName, size_t nameLen);
+};
+
+// The part of the Arduino Stream (and Print) interface the library uses.
+class Stream {
+   public:
+   virtual int available(void) = 0;
+   virtual int read(void) = 0;
+   virtual size_t write(uint8_t c) = 0;
+   virtual size_t write(const uint8_t *pBuf, size_t len) = 0;
+   virtual int availableForWrite(void) { return 0; }
+   virtual void flush(void) {}
+   // Arduino's waits up to a timeout for bytes that have not arrived yet;
+   // the library only asks for what available() reported.
+   size_t readBytes(uint8_t *pBuf, size_t len) {
+      size_t n = 0;
+      int c;
+      while ((n < len) && ((c = read()) >= 0)) {
+         pBuf[n++] = c;
+      }
+      return n;
+   }
+};
+
+class HostSerial : public Stream {
+   private:
+   HostStream *pStream = 0;
+   unsigned long baud = 0;
+   unsigned long long txDrainTime = 0;
+   uint16_t txFifoUsed = 0;
+   unsigned long bytesWritten = 0;
+   unsigned long bytesRead = 0;
+   unsigned long writeCalls = 0;
+   unsigned long long blockedUs = 0;
+
+   void drainTxFifo(void);
+
+   public:
+   void begin(unsigned long baudRate);
+   void end(void);
+   // Attach the stream the port talks to; 0 detaches.
+   void attach(HostStream *pNewStream);
+   // Simulated line rate; 0 makes the port infinitely fast.
+   void setBaud(unsigned long baudRate);
+
+   int available(void);
+   int read(void);
+   size_t write(const uint8_t *pBuf, size_t len);
+   size_t write(uint8_t c);
+   int availableForWrite(void);
+   void flush(void);
+
+   // statistics for tests and benchmarks
+   unsigned long getBytesWritten(void) { return bytesWritten; }
+   unsigned long getBytesRead(void) { return bytesRead; }
+   unsigned long getWriteCalls(void) { return writeCalls; }
+   // simulated time spent blocked in write() waiting for the TX FIFO
+   unsigned long long getBlockedUs(void) { return blockedUs; }
+   void resetStats(void);
+};
+
+extern HostSerial Serial;
+
+#endif
@@ -0,0 +1,128 @@
+#include "CppUTest/TestHarness.h"
+#include <stdint.h>
+#include <string.h>
+
+#include "chframe.h"
+
+static uint8_t parseBuf[66];
+
+TEST_GROUP(chframeTests)
+{
+   chFrameParser *pParser;
+
+   void setup()
+   {
+      pParser = new chFrameParser(parseBuf, sizeof(parseBuf));
+   }
+
+   void teardown()
+   {
+      delete pParser;
+   }
+
+   // Feeds a whole byte string, returns the last result that was not NONE.
+   uint8_t feedAll(const uint8_t *pBytes, size_t len)
+   {
+      uint8_t result = CHFRAME_NONE;
+      uint8_t r;
+      size_t i;
+
+      for (i=0; i<len; i++) {
+         r = pParser->feed(pBytes[i]);
+         if (r != CHFRAME_NONE) {
+            result = r;
+         }
+      }
+      return result;
+   }
+};
+
+TEST(chframeTests, encodedFrameParsesBack)
+{
+   const uint8_t payload[] = { 5, 0x60, 0x05, 0xff, 0xfe, 0x00 };
+   uint8_t frame[CHFRAME_ENCODED_SIZE(sizeof(payload))];
+   size_t n = chFrameEncode(payload, sizeof(payload), frame);
+
+   LONGS_EQUAL(CHFRAME_OK, feedAll(frame, n));
+   LONGS_EQUAL(sizeof(payload), pParser->length());
+   MEMCMP_EQUAL(payload, pParser->payload(), sizeof(payload));
+   LONGS_EQUAL(0, pParser->payload()[sizeof(payload)]);
+}
+
+TEST(chframeTests, controlBytesAreEscaped)
+{
+   const uint8_t payload[] = { 0xff, 0xfe };
+   uint8_t frame[CHFRAME_ENCODED_SIZE(sizeof(payload))];
+   size_t n = chFrameEncode(payload, sizeof(payload), frame);
+   size_t i;
+
+   // only the leading STX goes out unescaped
+   for (i=1; i<n; i++) {
+      if (frame[i] == CHFRAME_STX) {
+         LONGS_EQUAL(CHFRAME_ESC, frame[i-1]);
+      }
+   }
+   LONGS_EQUAL(CHFRAME_STX, frame[0]);
+   LONGS_EQUAL(CHFRAME_ESC, frame[2]);
+}
+
+TEST(chframeTests, corruptFrameIsReported)
+{
+   const uint8_t payload[] = { 3, 0x60, 0x03, 7 };
+   uint8_t frame[CHFRAME_ENCODED_SIZE(sizeof(payload))];
+   size_t n = chFrameEncode(payload, sizeof(payload), frame);
+
+   frame[4] ^= 0x01;
+   LONGS_EQUAL(CHFRAME_CRC_ERROR, feedAll(frame, n));
+}
+
+TEST(chframeTests, stxInFrameAbortsAndStartsTheNextOne)
+{
+   const uint8_t payload[] = { 3, 0x60, 0x03, 7 };
+   uint8_t frame[CHFRAME_ENCODED_SIZE(sizeof(payload))];
+   size_t n = chFrameEncode(payload, sizeof(payload), frame);
+
+   LONGS_EQUAL(CHFRAME_NONE, feedAll(frame, 3));
+   LONGS_EQUAL(CHFRAME_ABORTED, pParser->feed(frame[0]));
+   LONGS_EQUAL(CHFRAME_OK, feedAll(&frame[1], n - 1));
+}
+
+TEST(chframeTests, lengthsOutsideTheBufferAreRejected)
+{
+   const uint8_t zero[] = { CHFRAME_STX, 0x00, 0x00, 0x00 };
+   const uint8_t tooLong[] = { CHFRAME_STX, sizeof(parseBuf) - 1 };
+   uint8_t payload[sizeof(parseBuf) - 2];
+   uint8_t frame[CHFRAME_ENCODED_SIZE(sizeof(payload))];
+   size_t n;
+
+   LONGS_EQUAL(CHFRAME_BAD_LENGTH, feedAll(zero, sizeof(zero)));
+   LONGS_EQUAL(CHFRAME_BAD_LENGTH, feedAll(tooLong, sizeof(tooLong)));
+
+   memset(payload, 0xab, sizeof(payload));
+   payload[0] = sizeof(payload) - 1;
+   n = chFrameEncode(payload, sizeof(payload), frame);
+   LONGS_EQUAL(CHFRAME_OK, feedAll(frame, n));
+}
+
+TEST(chframeTests, extendedLengthRoundTrips)
+{
+   static uint8_t bigBuf[602];
+   static uint8_t payload[600];
+   static uint8_t frame[CHFRAME_ENCODED_SIZE(sizeof(payload))];
+   chFrameParser parser(bigBuf, sizeof(bigBuf));
+   size_t n;
+   size_t i;
+   uint8_t result = CHFRAME_NONE;
+
+   for (i=0; i<sizeof(payload); i++) {
+      payload[i] = i * 7;
+   }
+   n = chFrameEncode(payload, sizeof(payload), frame);
+   LONGS_EQUAL(CHFRAME_EXT_LENGTH, frame[1]);
+   for (i=0; i<n; i++) {
+      result = parser.feed(frame[i]);
+   }
+   LONGS_EQUAL(CHFRAME_OK, result);
+   LONGS_EQUAL(sizeof(payload), parser.length());
+   MEMCMP_EQUAL(payload, parser.payload(), sizeof(payload));
+}
@@ -0,0 +1,1253 @@
+#include "CppUTest/TestHarness.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "Arduino.h"
+#include "chillhub.h"
+#include "crc.h"
+#include "HostFrame.h"
+#include "chframe.h"
+#include "chgateway.h"
+
+// The sketch normally defines the instance.
+chInterface ChillHub;
+
+#define STX HOST_FRAME_STX
+#define ESC HOST_FRAME_ESC
+
+static HostLoopbackStream *pHub;
+
+static void hubSend(const uint8_t *pPayload, size_t len)
+{
+   uint8_t frame[CHFRAME_ENCODED_SIZE(CHILLHUB_MAX_FRAME_SIZE)];
+   size_t n = hostEncodeFrame(pPayload, len, frame);
+   pHub->hubWrite(frame, n);
+}
+
+// Takes the next frame the library sent off the wire.  Returns the payload
+// length, or -1 if there is no complete frame or its CRC is wrong.
+static int hubReceive(uint8_t *pPayload, size_t maxLen)
+{
+   uint8_t c;
+   size_t len = 0;
+   size_t i;
+   uint8_t lenBytes = 1;
+   uint8_t tail[2];
+
+   do {
+      if (pHub->hubRead(&c, 1) == 0) return -1;
+   } while (c != STX);
+
+   for (i=0; i<lenBytes; i++) {
+      if (pHub->hubRead(&c, 1) == 0) return -1;
+      if ((c == ESC) && (pHub->hubRead(&c, 1) == 0)) return -1;
+      if ((i == 0) && (c == 0)) {
+         lenBytes = 3;
+      }
+      len = (len << 8) | c;
+   }
+   if (len > maxLen) return -1;
+
+   for (i=0; i<len+2; i++) {
+      if (pHub->hubRead(&c, 1) == 0) return -1;
+      if ((c == ESC) && (pHub->hubRead(&c, 1) == 0)) return -1;
+      if (i < len) pPayload[i] = c; else tail[i-len] = c;
+   }
+
+   if (crc_finalize(crc_update(crc_init(), pPayload, len)) !=
+         (uint16_t)((tail[0] << 8) | tail[1])) {
+      return -1;
+   }
+   return (int)len;
+}
+
+static unsigned int u16Calls;
+static unsigned int u16Value;
+static unsigned int u8Value;
+static unsigned long u32Value;
+static char strValue[CHILLHUB_MAX_FRAME_SIZE];
+static uint8_t timeValue[4];
+
+static void onU16(unsigned int v) { u16Calls++; u16Value = v; }
+static void onU8(unsigned char v) { u8Value = v; }
+static void onU32(unsigned long v) { u32Value = v; }
+static void onString(char *s) { strncpy(strValue, s, sizeof(strValue)-1); }
+static void onTime(unsigned char t[4]) { memcpy(timeValue, t, 4); }
+
+TEST_GROUP(chillhubTests)
+{
+   void setup()
+   {
+      pHub = new HostLoopbackStream();
+      hostClockSet(0);
+      Serial.setBaud(0);
+      Serial.attach(pHub);
+      Serial.resetStats();
+      ChillHub.setUpdateRateLimit(0);
+      u16Calls = 0;
+      u16Value = 0;
+      u8Value = 0;
+      u32Value = 0;
+      memset(strValue, 0, sizeof(strValue));
+      memset(timeValue, 0, sizeof(timeValue));
+   }
+
+   void teardown()
+   {
+      ChillHub.loop();
+#if CHILLHUB_TX_RING_SIZE > 0
+      ChillHub.flushTx();
+      ChillHub.setTxFullPolicy(chTxFullWait);
+#endif
+      ChillHub.useCompactUpdates(0);
+      ChillHub.useBatchUpdates(0);
+      Serial.attach(0);
+      delete pHub;
+   }
+};
+
+TEST(chillhubTests, fridgeMessageCallsSubscriber)
+{
+   const uint8_t msg[] = { 4, freshFoodDisplayTemperatureMsgType, unsigned16DataType, 0x12, 0x34 };
+
+   ChillHub.subscribe(freshFoodDisplayTemperatureMsgType, (chillhubCallbackFunction)onU16);
+   hubSend(msg, sizeof(msg));
+   ChillHub.loop();
+
+   LONGS_EQUAL(1, u16Calls);
+   LONGS_EQUAL(0x1234, u16Value);
+   ChillHub.unsubscribe(freshFoodDisplayTemperatureMsgType);
+}
+
+TEST(chillhubTests, subscribeSendsSubscription)
+{
+   uint8_t payload[64];
+   const uint8_t expected[] = { 3, subscribeMsgType, unsigned8DataType, doorStatusMsgType };
+
+   ChillHub.subscribe(doorStatusMsgType, (chillhubCallbackFunction)onU8);
+
+   LONGS_EQUAL(sizeof(expected), hubReceive(payload, sizeof(payload)));
+   MEMCMP_EQUAL(expected, payload, sizeof(expected));
+   ChillHub.unsubscribe(doorStatusMsgType);
+}
+
+TEST(chillhubTests, frameSplitAcrossLoopCalls)
+{
+   const uint8_t msg[] = { 4, freezerDisplayTemperatureMsgType, unsigned16DataType, 0x00, 0x2a };
+   uint8_t frame[32];
+   size_t n = hostEncodeFrame(msg, sizeof(msg), frame);
+   size_t i;
+
+   ChillHub.subscribe(freezerDisplayTemperatureMsgType, (chillhubCallbackFunction)onU16);
+   for (i=0; i<n; i++) {
+      LONGS_EQUAL(0, u16Calls);
+      pHub->hubWrite(&frame[i], 1);
+      ChillHub.loop();
+   }
+
+   LONGS_EQUAL(1, u16Calls);
+   LONGS_EQUAL(42, u16Value);
+   ChillHub.unsubscribe(freezerDisplayTemperatureMsgType);
+}
+
+// A burst larger than the receive ring is handled in one loop() call.
+TEST(chillhubTests, burstOfFramesHandledInOneLoop)
+{
+   uint8_t msg[] = { 4, freezerSetpointTemperatureMsgType, unsigned16DataType, 0, 0 };
+   int i;
+
+   ChillHub.subscribe(freezerSetpointTemperatureMsgType, (chillhubCallbackFunction)onU16);
+   for (i=0; i<20; i++) {
+      msg[4] = i;
+      hubSend(msg, sizeof(msg));
+   }
+   ChillHub.loop();
+
+   LONGS_EQUAL(20, u16Calls);
+   LONGS_EQUAL(19, u16Value);
+   ChillHub.unsubscribe(freezerSetpointTemperatureMsgType);
+}
+
+TEST(chillhubTests, controlBytesInPayloadAreUnescaped)
+{
+   const uint8_t msg[] = { 4, freshFoodSetpointTemperatureMsgType, unsigned16DataType, STX, ESC };
+
+   ChillHub.subscribe(freshFoodSetpointTemperatureMsgType, (chillhubCallbackFunction)onU16);
+   hubSend(msg, sizeof(msg));
+   ChillHub.loop();
+
+   LONGS_EQUAL(1, u16Calls);
+   LONGS_EQUAL(0xfffe, u16Value);
+   ChillHub.unsubscribe(freshFoodSetpointTemperatureMsgType);
+}
+
+TEST(chillhubTests, corruptFrameIsDroppedAndNextOneAccepted)
+{
+   const uint8_t msg[] = { 4, waterUsageTimerMsgType, unsigned16DataType, 0x01, 0x02 };
+   uint8_t frame[32];
+   size_t n = hostEncodeFrame(msg, sizeof(msg), frame);
+
+   ChillHub.subscribe(waterUsageTimerMsgType, (chillhubCallbackFunction)onU16);
+   frame[n-1] ^= 0x01;
+   pHub->hubWrite(frame, n);
+   hubSend(msg, sizeof(msg));
+   ChillHub.loop();
+
+   LONGS_EQUAL(1, u16Calls);
+   LONGS_EQUAL(0x0102, u16Value);
+   ChillHub.unsubscribe(waterUsageTimerMsgType);
+}
+
+TEST(chillhubTests, userMessagesGoToCloudListener)
+{
+   const uint8_t u32Msg[] = { 6, 0x60, unsigned32DataType, 0xde, 0xad, 0xbe, 0xef };
+   const uint8_t strMsg[] = { 8, 0x61, stringDataType, 'h', 'e', 'l', 'l', 'o', 0 };
+
+   ChillHub.addCloudListener(0x60, (chillhubCallbackFunction)onU32);
+   ChillHub.addCloudListener(0x61, (chillhubCallbackFunction)onString);
+   hubSend(u32Msg, sizeof(u32Msg));
+   hubSend(strMsg, sizeof(strMsg));
+   ChillHub.loop();
+
+   LONGS_EQUAL(0xdeadbeef, u32Value);
+   STRCMP_EQUAL("hello", strValue);
+}
+
+TEST(chillhubTests, timeResponseCallsGetTimeCallbackOnce)
+{
+   const uint8_t msg[] = { 8, timeResponseMsgType, arrayDataType, 4, unsigned8DataType, 1, 2, 3, 4 };
+   const uint8_t expected[] = { 1, 2, 3, 4 };
+
+   ChillHub.getTime((chillhubCallbackFunction)onTime);
+   hubSend(msg, sizeof(msg));
+   ChillHub.loop();
+   MEMCMP_EQUAL(expected, timeValue, 4);
+
+   memset(timeValue, 0, sizeof(timeValue));
+   hubSend(msg, sizeof(msg));
+   ChillHub.loop();
+   LONGS_EQUAL(0, timeValue[0]);
+}
+
+static int16_t i16Value;
+static int32_t i32Value;
+static unsigned int typedCalls;
+
+static void onTypedU8(uint8_t v) { typedCalls++; u8Value = v; }
+static void onTypedI16(int16_t v) { typedCalls++; i16Value = v; }
+static void onTypedI32(int32_t v) { typedCalls++; i32Value = v; }
+static void onTypedString(const char *s) { typedCalls++; strncpy(strValue, s, sizeof(strValue)-1); }
+
+TEST(chillhubTests, typedCallbacksGetDecodedValues)
+{
+   const uint8_t boolMsg[] = { 3, doorStatusMsgType, booleanDataType, 1 };
+   const uint8_t i16Msg[] = { 4, 0x68, signed16DataType, 0xff, 0x85 };
+   const uint8_t i32Msg[] = { 6, 0x69, signed32DataType, 0xff, 0xff, 0xfe, 0x0c };
+   const uint8_t strMsg[] = { 5, 0x6a, stringDataType, 'o', 'k', 0 };
+   const uint8_t timeMsg[] = { 8, timeResponseMsgType, arrayDataType, 4, unsigned8DataType, 5, 6, 7, 8 };
+   const uint8_t expected[] = { 5, 6, 7, 8 };
+
+   typedCalls = 0;
+   ChillHub.subscribe(doorStatusMsgType, onTypedU8);
+   ChillHub.addCloudListener(0x68, onTypedI16);
+   ChillHub.addCloudListener(0x69, onTypedI32);
+   ChillHub.addCloudListener(0x6a, onTypedString);
+   ChillHub.getTime(onTime);
+   hubSend(boolMsg, sizeof(boolMsg));
+   hubSend(i16Msg, sizeof(i16Msg));
+   hubSend(i32Msg, sizeof(i32Msg));
+   hubSend(strMsg, sizeof(strMsg));
+   hubSend(timeMsg, sizeof(timeMsg));
+   ChillHub.loop();
+
+   LONGS_EQUAL(4, typedCalls);
+   LONGS_EQUAL(1, u8Value);
+   LONGS_EQUAL(-123, i16Value);
+   LONGS_EQUAL(-500, i32Value);
+   STRCMP_EQUAL("ok", strValue);
+   MEMCMP_EQUAL(expected, timeValue, 4);
+   ChillHub.unsubscribe(doorStatusMsgType);
+}
+
+// A typed callback is never handed a value of another type; the message is
+// dropped and counted instead.
+TEST(chillhubTests, typedCallbackRejectsOtherDataTypes)
+{
+   const uint8_t u16Msg[] = { 4, 0x6b, unsigned16DataType, 0x12, 0x34 };
+   const uint8_t strMsg[] = { 5, 0x6b, stringDataType, 'n', 'o', 0 };
+   const uint8_t jsonMsg[] = { 3, 0x6b, jsonDataType, 0 };
+   const uint8_t i16Msg[] = { 4, 0x6b, signed16DataType, 0x00, 0x07 };
+   chLinkStats stats;
+
+   typedCalls = 0;
+   i16Value = 0;
+   ChillHub.addCloudListener(0x6b, onTypedI16);
+   ChillHub.resetLinkStats();
+   hubSend(u16Msg, sizeof(u16Msg));
+   hubSend(strMsg, sizeof(strMsg));
+   hubSend(jsonMsg, sizeof(jsonMsg));
+   hubSend(i16Msg, sizeof(i16Msg));
+   ChillHub.loop();
+   ChillHub.getLinkStats(&stats);
+
+   LONGS_EQUAL(1, typedCalls);
+   LONGS_EQUAL(7, i16Value);
+   LONGS_EQUAL(3, stats.typeMismatches);
+   LONGS_EQUAL(0, stats.unknownDataTypes);
+}
+
+static chInterface *pDispatchedBy;
+static void onDispatched(uint8_t v) { u8Value = v; pDispatchedBy = chInterface::dispatching(); }
+
+// A second link on its own port shares no subscriptions, buffers or
+// counters with ChillHub, and callbacks can tell which link called them.
+TEST(chillhubTests, instancesAreIndependent)
+{
+   const uint8_t msg[] = { 3, 0x6c, unsigned8DataType, 0x2a };
+   const uint8_t half[] = { 5, 0x6c, unsigned16DataType, 0x12, 0x34 };
+   HostLoopbackStream hub2;
+   HostSerial port2;
+   uint8_t frame[32];
+   size_t n;
+   chLinkStats stats;
+
+   port2.attach(&hub2);
+   chInterface link2(port2);
+   link2.addCloudListener(0x6c, onDispatched);
+   ChillHub.resetLinkStats();
+   pDispatchedBy = NULL;
+
+   // a partial frame on ChillHub's port does not disturb link2's parser
+   n = hostEncodeFrame(half, sizeof(half), frame);
+   pHub->hubWrite(frame, 3);
+   ChillHub.loop();
+   n = hostEncodeFrame(msg, sizeof(msg), frame);
+   hub2.hubWrite(frame, n);
+   link2.loop();
+   LONGS_EQUAL(0x2a, u8Value);
+   POINTERS_EQUAL(&link2, pDispatchedBy);
+   POINTERS_EQUAL(NULL, chInterface::dispatching());
+
+   // ChillHub has no listener for it
+   u8Value = 0;
+   hubSend(msg, sizeof(msg));
+   ChillHub.loop();
+   LONGS_EQUAL(0, u8Value);
+   LONGS_EQUAL(0, hub2.hubAvailable());
+
+   link2.sendU8Msg(0x6d, 1);
+   LONGS_EQUAL(0, pHub->hubAvailable());
+   CHECK(hub2.hubAvailable() > 0);
+   link2.getLinkStats(&stats);
+   LONGS_EQUAL(1, stats.framesReceived);
+   ChillHub.getLinkStats(&stats);
+   LONGS_EQUAL(1, stats.framesAborted);
+}
+
+// Links running loop() on two threads at once each see themselves in
+// dispatching().
+struct dispatchThread {
+   HostLoopbackStream hub;
+   HostSerial port;
+   chInterface *pLink;
+   unsigned long calls;
+   unsigned long wrong;
+};
+
+static thread_local dispatchThread *pThreadLink;
+
+static void onThreadDispatched(uint8_t v) {
+   (void)v;
+   pThreadLink->calls++;
+   if (chInterface::dispatching() != pThreadLink->pLink) {
+      pThreadLink->wrong++;
+   }
+}
+
+static void *runDispatchThread(void *pArg) {
+   const uint8_t msg[] = { 3, 0x6e, unsigned8DataType, 1 };
+   uint8_t frame[16];
+   size_t n = hostEncodeFrame(msg, sizeof(msg), frame);
+   int i;
+
+   pThreadLink = (dispatchThread *)pArg;
+   for (i=0; i<20000; i++) {
+      pThreadLink->hub.hubWrite(frame, n);
+      pThreadLink->pLink->loop();
+   }
+   return NULL;
+}
+
+TEST(chillhubTests, dispatchingIsPerThread)
+{
+   dispatchThread links[2];
+   pthread_t threads[2];
+   int i;
+
+   for (i=0; i<2; i++) {
+      links[i].port.attach(&links[i].hub);
+      links[i].pLink = new chInterface(links[i].port);
+      links[i].pLink->addCloudListener(0x6e, onThreadDispatched);
+      links[i].calls = 0;
+      links[i].wrong = 0;
+   }
+   for (i=0; i<2; i++) {
+      pthread_create(&threads[i], NULL, runDispatchThread, &links[i]);
+   }
+   for (i=0; i<2; i++) {
+      pthread_join(threads[i], NULL);
+      LONGS_EQUAL(20000, links[i].calls);
+      LONGS_EQUAL(0, links[i].wrong);
+      delete links[i].pLink;
+   }
+}
+
+// The largest frame the receive buffer holds still gets through, one byte
+// more is rejected without upsetting the next frame.
+TEST(chillhubTests, largestFrameAcceptedLargerRejected)
+{
+   uint8_t msg[CHILLHUB_MAX_FRAME_SIZE];
+   size_t maxLen = CHILLHUB_MAX_FRAME_SIZE - 2;
+   const uint8_t small[] = { 4, 0x62, stringDataType, 'o', 0 };
+
+   ChillHub.addCloudListener(0x62, (chillhubCallbackFunction)onString);
+   memset(msg, 'x', sizeof(msg));
+   msg[0] = maxLen - 1;
+   msg[1] = 0x62;
+   msg[2] = stringDataType;
+   msg[maxLen-1] = 0;
+   hubSend(msg, maxLen);
+   ChillHub.loop();
+   LONGS_EQUAL(maxLen - 4, strlen(strValue));
+
+   memset(strValue, 0, sizeof(strValue));
+   msg[0] = maxLen;
+   msg[maxLen] = 0;
+   hubSend(msg, maxLen + 1);
+   hubSend(small, sizeof(small));
+   ChillHub.loop();
+   STRCMP_EQUAL("o", strValue);
+}
+
+#if CHILLHUB_MAX_FRAME_SIZE > 255
+// Frames over 255 bytes carry a 16-bit length.  A max-size string with
+// every byte value but 0, STX and ESC included, arrives unchanged.
+TEST(chillhubTests, extendedLengthFrameRoundTrips)
+{
+   uint8_t msg[CHILLHUB_MAX_FRAME_SIZE];
+   size_t len = CHILLHUB_MAX_FRAME_SIZE - 2;
+   size_t i;
+
+   ChillHub.addCloudListener(0x62, (chillhubCallbackFunction)onString);
+   msg[0] = 0; // does not fit, the frame length counts
+   msg[1] = 0x62;
+   msg[2] = stringDataType;
+   for (i=3; i<len-1; i++) {
+      msg[i] = 1 + (i % 255);
+   }
+   msg[len-1] = 0;
+   hubSend(msg, len);
+   ChillHub.loop();
+
+   LONGS_EQUAL(len - 4, strlen(strValue));
+   MEMCMP_EQUAL(&msg[3], strValue, len - 3);
+}
+#endif
+
+TEST(chillhubTests, sentFramesRoundTrip)
+{
+   uint8_t payload[64];
+   const uint8_t expectedU16[] = { 4, 0x70, unsigned16DataType, STX, ESC };
+   const uint8_t expectedI8[] = { 3, 0x71, signed8DataType, 0xfe };
+
+   ChillHub.sendU16Msg(0x70, 0xfffe);
+   ChillHub.sendI8Msg(0x71, -2);
+
+   LONGS_EQUAL(sizeof(expectedU16), hubReceive(payload, sizeof(payload)));
+   MEMCMP_EQUAL(expectedU16, payload, sizeof(expectedU16));
+   LONGS_EQUAL(sizeof(expectedI8), hubReceive(payload, sizeof(payload)));
+   MEMCMP_EQUAL(expectedI8, payload, sizeof(expectedI8));
+   LONGS_EQUAL(-1, hubReceive(payload, sizeof(payload)));
+}
+
+TEST(chillhubTests, queuedUpdatesAreCoalesced)
+{
+   uint8_t payload[64];
+   unsigned long sent = ChillHub.getUpdatesSent();
+   unsigned long coalesced = ChillHub.getUpdatesCoalesced();
+   int i;
+
+   for (i=0; i<10; i++) {
+      ChillHub.updateCloudResourceU16(5, i);
+   }
+   LONGS_EQUAL(0, pHub->hubAvailable());
+   ChillHub.loop();
+
+   LONGS_EQUAL(sent + 1, ChillHub.getUpdatesSent());
+   LONGS_EQUAL(coalesced + 9, ChillHub.getUpdatesCoalesced());
+   CHECK(hubReceive(payload, sizeof(payload)) > 0);
+   BYTES_EQUAL(updateResourceType, payload[1]);
+   LONGS_EQUAL(9, payload[payload[0]]);
+   LONGS_EQUAL(-1, hubReceive(payload, sizeof(payload)));
+}
+
+TEST(chillhubTests, rateLimitSpreadsUpdatesOverTime)
+{
+   uint8_t payload[64];
+   int frames = 0;
+   int i;
+
+   ChillHub.setUpdateRateLimit(100);
+   for (i=0; i<4; i++) {
+      ChillHub.updateCloudResourceU32(0x20 + i, i);
+   }
+   ChillHub.loop();
+   LONGS_EQUAL(0, pHub->hubAvailable());
+
+   for (i=0; i<2000; i++) {
+      hostClockAdvance(1000);
+      ChillHub.loop();
+   }
+   while (hubReceive(payload, sizeof(payload)) > 0) {
+      frames++;
+   }
+   LONGS_EQUAL(4, frames);
+}
+
+#if CHILLHUB_UPDATE_QUEUE_SIZE > 0
+TEST(chillhubTests, fullQueueKeepsToTheRateLimit)
+{
+   uint8_t payload[64];
+   chLinkStats stats;
+   int frames = 0;
+   int i;
+
+   ChillHub.resetLinkStats();
+   ChillHub.setUpdateRateLimit(100);
+   for (i=0; i<CHILLHUB_UPDATE_QUEUE_SIZE + 1; i++) {
+      ChillHub.updateCloudResourceU16(0x20 + i, i);
+   }
+   LONGS_EQUAL(0, pHub->hubAvailable());
+   ChillHub.getLinkStats(&stats);
+   LONGS_EQUAL(1, stats.updatesDropped);
+
+   for (i=0; i<5000; i++) {
+      hostClockAdvance(1000);
+      ChillHub.loop();
+   }
+   while (hubReceive(payload, sizeof(payload)) > 0) {
+      BYTES_EQUAL(updateResourceType, payload[1]);
+      frames++;
+   }
+   LONGS_EQUAL(CHILLHUB_UPDATE_QUEUE_SIZE, frames);
+}
+#endif
+
+TEST(chillhubTests, batchIsOneMessage)
+{
+   uint8_t payload[64];
+   const uint8_t accept[] = { 3, batchNegotiateMsgType, unsigned8DataType, CHILLHUB_BATCH_VERSION };
+
+   ChillHub.useBatchUpdates(1);
+   ChillHub.setup("test", "0123");
+   CHECK(hubReceive(payload, sizeof(payload)) > 0);
+   BYTES_EQUAL(deviceIdMsgType, payload[1]);
+   CHECK(hubReceive(payload, sizeof(payload)) > 0);
+   BYTES_EQUAL(batchNegotiateMsgType, payload[1]);
+   CHECK(!ChillHub.batchUpdatesEnabled());
+   hubSend(accept, sizeof(accept));
+   ChillHub.loop();
+   CHECK(ChillHub.batchUpdatesEnabled());
+
+   ChillHub.updateCloudResourceU16(0x31, 1);
+   ChillHub.beginCloudUpdate();
+   CHECK(ChillHub.addCloudUpdateU16(0x30, 0x1234));
+   CHECK(ChillHub.addCloudUpdateU16(0x31, 0x5678));
+   ChillHub.commitCloudUpdate();
+   ChillHub.loop();
+
+   CHECK(hubReceive(payload, sizeof(payload)) > 0);
+   BYTES_EQUAL(batchUpdateMsgType, payload[1]);
+   BYTES_EQUAL(jsonDataType, payload[2]);
+   LONGS_EQUAL(2, payload[3]);
+   // the queued update for 0x31 was superseded by the batch
+   LONGS_EQUAL(-1, hubReceive(payload, sizeof(payload)));
+}
+
+// Hubs that did not accept batches get one ordinary update per value.
+TEST(chillhubTests, batchIsSingleUpdatesUntilHubAccepts)
+{
+   uint8_t expected[2][64];
+   uint8_t payload[64];
+   int expectedLen[2];
+   int i;
+
+   ChillHub.updateCloudResourceU16(0x30, 0x1234);
+   ChillHub.loop();
+   expectedLen[0] = hubReceive(expected[0], sizeof(expected[0]));
+   ChillHub.updateCloudResourceI32(0x31, -5);
+   ChillHub.loop();
+   expectedLen[1] = hubReceive(expected[1], sizeof(expected[1]));
+
+   ChillHub.useBatchUpdates(1);
+   ChillHub.setup("test", "0123");
+   while (hubReceive(payload, sizeof(payload)) > 0) {
+   }
+   ChillHub.beginCloudUpdate();
+   CHECK(ChillHub.addCloudUpdateU16(0x30, 0x1234));
+   CHECK(ChillHub.addCloudUpdateI32(0x31, -5));
+   ChillHub.commitCloudUpdate();
+   ChillHub.loop();
+
+   for (i=0; i<2; i++) {
+      LONGS_EQUAL(expectedLen[i], hubReceive(payload, sizeof(payload)));
+      BYTES_EQUAL(updateResourceType, payload[1]);
+      MEMCMP_EQUAL(expected[i], payload, expectedLen[i]);
+   }
+   LONGS_EQUAL(-1, hubReceive(payload, sizeof(payload)));
+}
+
+#if CHILLHUB_UPDATE_QUEUE_SIZE > 0
+TEST(chillhubTests, batchAsSingleUpdatesKeepsToTheRateLimit)
+{
+   uint8_t payload[64];
+   int frames = 0;
+   int i;
+
+   ChillHub.setUpdateRateLimit(100);
+   ChillHub.beginCloudUpdate();
+   for (i=0; i<4; i++) {
+      CHECK(ChillHub.addCloudUpdateU16(0x30 + i, i));
+   }
+   ChillHub.commitCloudUpdate();
+   ChillHub.loop();
+   LONGS_EQUAL(0, pHub->hubAvailable());
+
+   for (i=0; i<2000; i++) {
+      hostClockAdvance(1000);
+      ChillHub.loop();
+   }
+   while (hubReceive(payload, sizeof(payload)) > 0) {
+      BYTES_EQUAL(updateResourceType, payload[1]);
+      frames++;
+   }
+   LONGS_EQUAL(4, frames);
+}
+#endif
+
+TEST(chillhubTests, compactUpdatesAfterHubAccepts)
+{
+   uint8_t payload[64];
+   const uint8_t accept[] = { 3, compactNegotiateMsgType, unsigned8DataType, CHILLHUB_COMPACT_VERSION };
+   chResourceUpdate updates[2];
+   int len;
+
+   ChillHub.useCompactUpdates(1);
+   ChillHub.setup("test", "0123");
+   CHECK(hubReceive(payload, sizeof(payload)) > 0);
+   BYTES_EQUAL(deviceIdMsgType, payload[1]);
+   CHECK(hubReceive(payload, sizeof(payload)) > 0);
+   BYTES_EQUAL(compactNegotiateMsgType, payload[1]);
+   CHECK(!ChillHub.compactUpdatesEnabled());
+
+   hubSend(accept, sizeof(accept));
+   ChillHub.loop();
+   CHECK(ChillHub.compactUpdatesEnabled());
+
+   ChillHub.updateCloudResourceI16(7, -3);
+   ChillHub.loop();
+   len = hubReceive(payload, sizeof(payload));
+   CHECK(len > 0);
+   LONGS_EQUAL(1, chGateway::decodeCompactUpdates(payload, len, updates, 2));
+   LONGS_EQUAL(7, updates[0].resID);
+   LONGS_EQUAL(signed16DataType, updates[0].dataType);
+   LONGS_EQUAL(-3, (int32_t)updates[0].value);
+}
+
+// Without an offer the negotiation types are ordinary user messages.
+TEST(chillhubTests, negotiationTypesReachListenersWhenNotOffered)
+{
+   const uint8_t msg[] = { 3, compactNegotiateMsgType, unsigned8DataType, CHILLHUB_COMPACT_VERSION };
+
+   ChillHub.addCloudListener(compactNegotiateMsgType, (chillhubCallbackFunction)onU8);
+   hubSend(msg, sizeof(msg));
+   ChillHub.loop();
+
+   LONGS_EQUAL(CHILLHUB_COMPACT_VERSION, u8Value);
+   CHECK(!ChillHub.compactUpdatesEnabled());
+}
+
+TEST(chillhubTests, reservedTypesAreRefusedWhileAFormatIsOffered)
+{
+   const uint8_t msg[] = { 3, 0xf5, unsigned8DataType, 9 };
+   chLinkStats stats;
+
+   ChillHub.resetLinkStats();
+   ChillHub.useBatchUpdates(1);
+   ChillHub.addCloudListener(0xf5, (chillhubCallbackFunction)onU8);
+   ChillHub.sendU8Msg(batchUpdateMsgType, 1);
+   ChillHub.sendU16Msg(0xff, 1);
+   LONGS_EQUAL(0, pHub->hubAvailable());
+
+   hubSend(msg, sizeof(msg));
+   ChillHub.loop();
+   LONGS_EQUAL(0, u8Value);
+
+   ChillHub.getLinkStats(&stats);
+   LONGS_EQUAL(3, stats.reservedRejected);
+   LONGS_EQUAL(1, stats.missingCallbacks);
+}
+
+TEST(chillhubTests, simulatedBaudRateBlocksFullFifo)
+{
+   uint8_t payload[40];
+
+   memset(payload, 0x11, sizeof(payload));
+   Serial.setBaud(9600);
+   LONGS_EQUAL(HOST_SERIAL_TX_FIFO_SIZE, Serial.availableForWrite());
+
+   Serial.write(payload, sizeof(payload));
+   LONGS_EQUAL(HOST_SERIAL_TX_FIFO_SIZE - sizeof(payload), Serial.availableForWrite());
+   LONGS_EQUAL(0, Serial.getBlockedUs());
+
+   Serial.write(payload, sizeof(payload));
+   CHECK(Serial.getBlockedUs() > 0);
+
+   // 80 bytes at 960 bytes/s are on the wire after ~83ms
+   hostClockAdvance(100000);
+   LONGS_EQUAL(HOST_SERIAL_TX_FIFO_SIZE, Serial.availableForWrite());
+}
+
+TEST(chillhubTests, unterminatedStringIsTerminated)
+{
+   uint8_t msg[CHILLHUB_MAX_FRAME_SIZE];
+   size_t len = CHILLHUB_MAX_FRAME_SIZE - 2;
+
+   ChillHub.addCloudListener(0x63, (chillhubCallbackFunction)onString);
+   memset(msg, 'y', sizeof(msg));
+   msg[0] = len - 1;
+   msg[1] = 0x63;
+   msg[2] = stringDataType;
+   hubSend(msg, len);
+   ChillHub.loop();
+
+   LONGS_EQUAL(len - 3, strlen(strValue));
+}
+
+TEST(chillhubTests, truncatedValueIsNotDelivered)
+{
+   const uint8_t shortMsg[] = { 4, 0x64, unsigned32DataType, 0x01, 0x02 };
+   const uint8_t fullMsg[] = { 6, 0x64, unsigned32DataType, 0x01, 0x02, 0x03, 0x04 };
+
+   ChillHub.addCloudListener(0x64, (chillhubCallbackFunction)onU32);
+   hubSend(shortMsg, sizeof(shortMsg));
+   ChillHub.loop();
+   LONGS_EQUAL(0, u32Value);
+
+   hubSend(fullMsg, sizeof(fullMsg));
+   ChillHub.loop();
+   LONGS_EQUAL(0x01020304, u32Value);
+}
+
+TEST(chillhubTests, truncatedFrameDoesNotSwallowNextFrame)
+{
+   const uint8_t msg[] = { 4, iceMakerBucketStatusMsgType, unsigned16DataType, 0x00, 0x07 };
+   uint8_t frame[32];
+   size_t n = hostEncodeFrame(msg, sizeof(msg), frame);
+
+   ChillHub.subscribe(iceMakerBucketStatusMsgType, (chillhubCallbackFunction)onU16);
+   pHub->hubWrite(frame, n - 3);
+   ChillHub.loop();
+   hubSend(msg, sizeof(msg));
+   ChillHub.loop();
+
+   LONGS_EQUAL(1, u16Calls);
+   LONGS_EQUAL(7, u16Value);
+   ChillHub.unsubscribe(iceMakerBucketStatusMsgType);
+}
+
+#if CHILLHUB_INTERBYTE_TIMEOUT_MS > 0
+// A frame cut off right after an ESC would otherwise escape the next STX.
+TEST(chillhubTests, interByteTimeoutDropsPartialFrame)
+{
+   const uint8_t msg[] = { 4, iceMakerBucketStatusMsgType, unsigned16DataType, 0x00, 0x08 };
+   const uint8_t partial[] = { STX, 4, 3, iceMakerBucketStatusMsgType, ESC };
+
+   ChillHub.subscribe(iceMakerBucketStatusMsgType, (chillhubCallbackFunction)onU16);
+   pHub->hubWrite(partial, sizeof(partial));
+   ChillHub.loop();
+   hostClockAdvance((CHILLHUB_INTERBYTE_TIMEOUT_MS - 1) * 1000UL);
+   ChillHub.loop();
+   hostClockAdvance(1000);
+   ChillHub.loop();
+   hubSend(msg, sizeof(msg));
+   ChillHub.loop();
+
+   LONGS_EQUAL(1, u16Calls);
+   LONGS_EQUAL(8, u16Value);
+   ChillHub.unsubscribe(iceMakerBucketStatusMsgType);
+}
+#endif
+
+// Frames arrive a millisecond apart and every fifth one suffers a random
+// bit flip, dropped byte, inserted byte or truncation.  Each corruption
+// should cost at most the frame it hit, not the ones after it.
+TEST(chillhubTests, framesLostPerCorruption)
+{
+   const int frames = 1000;
+   uint8_t msg[] = { 4, iceMakerOperationalStateMsgType, unsigned16DataType, 0, 0 };
+   uint8_t frame[40];
+   int corruptions = 0;
+   unsigned int lost;
+   size_t n, pos;
+   int i;
+
+   srand(7);
+   ChillHub.subscribe(iceMakerOperationalStateMsgType, (chillhubCallbackFunction)onU16);
+   for (i=0; i<frames; i++) {
+      msg[3] = i >> 8;
+      msg[4] = i;
+      n = hostEncodeFrame(msg, sizeof(msg), frame);
+      if (i % 5 == 4) {
+         pos = rand() % n;
+         switch (rand() % 4) {
+            case 0:
+               frame[pos] ^= 1 << (rand() % 8);
+               break;
+            case 1:
+               memmove(&frame[pos], &frame[pos+1], n - pos - 1);
+               n--;
+               break;
+            case 2:
+               memmove(&frame[pos+1], &frame[pos], n - pos);
+               frame[pos] = rand();
+               n++;
+               break;
+            default:
+               n = pos;
+               break;
+         }
+         corruptions++;
+      }
+      pHub->hubWrite(frame, n);
+      ChillHub.loop();
+      hostClockAdvance(1000);
+   }
+
+   lost = frames - u16Calls;
+   // a corruption can also leave the frame intact or valid
+   CHECK(lost <= (unsigned int)corruptions);
+   ChillHub.unsubscribe(iceMakerOperationalStateMsgType);
+   // a corrupted extended length leaves a long frame open, let it time out
+   hostClockAdvance(1000000);
+   ChillHub.loop();
+}
+
+TEST(chillhubTests, linkStatsCountReceivePathEvents)
+{
+   const uint8_t good[] = { 4, 0x65, unsigned16DataType, 0, 1 };
+   const uint8_t badType[] = { 4, 0x65, jsonDataType, 0, 1 };
+   const uint8_t nobody[] = { 4, 0x66, unsigned16DataType, 0, 1 };
+#if CHILLHUB_MAX_FRAME_SIZE > 255
+   const uint8_t oversize[] = { STX, 0, CHILLHUB_MAX_FRAME_SIZE >> 8, CHILLHUB_MAX_FRAME_SIZE & 0xff };
+#else
+   const uint8_t oversize[] = { STX, CHILLHUB_MAX_FRAME_SIZE };
+#endif
+   uint8_t frame[32];
+   size_t n = hostEncodeFrame(good, sizeof(good), frame);
+   chLinkStats stats;
+
+   ChillHub.addCloudListener(0x65, (chillhubCallbackFunction)onU16);
+   ChillHub.resetLinkStats();
+
+   hubSend(good, sizeof(good));
+   hubSend(badType, sizeof(badType));
+   hubSend(nobody, sizeof(nobody));
+   frame[n-1] ^= 0xa5;
+   pHub->hubWrite(frame, n);
+   pHub->hubWrite(oversize, sizeof(oversize));
+   pHub->hubWrite(frame, 4);
+   hubSend(good, sizeof(good));
+   ChillHub.loop();
+   ChillHub.getLinkStats(&stats);
+
+   LONGS_EQUAL(4, stats.framesReceived);
+   LONGS_EQUAL(1, stats.crcErrors);
+   LONGS_EQUAL(1, stats.badLengths);
+   LONGS_EQUAL(1, stats.framesAborted);
+   LONGS_EQUAL(1, stats.unknownDataTypes);
+   LONGS_EQUAL(1, stats.missingCallbacks);
+   LONGS_EQUAL(0, stats.rxOverflows);
+   LONGS_EQUAL(0, stats.framesSent);
+}
+
+TEST(chillhubTests, linkStatsReportedAsCloudResources)
+{
+   uint8_t payload[64];
+   chLinkStats stats;
+   int frames = 0;
+
+   ChillHub.resetLinkStats();
+   ChillHub.createLinkStatsResources(0xc0);
+   ChillHub.reportLinkStats(0xc0);
+   ChillHub.loop();
+   ChillHub.getLinkStats(&stats);
+
+   while (hubReceive(payload, sizeof(payload)) > 0) {
+      frames++;
+   }
+   LONGS_EQUAL(2 * CHILLHUB_LINK_STATS_RESOURCES, frames);
+   LONGS_EQUAL(frames, stats.framesSent);
+   LONGS_EQUAL(CHILLHUB_LINK_STATS_RESOURCES, stats.updatesSent);
+}
+
+// With a slow port the loop() that sends a burst of updates blocks on the
+// TX FIFO, which shows up as the longest loop time.
+static void onSlowU8(uint8_t v) { u8Value = v; hostClockAdvance(120000); }
+
+TEST(chillhubTests, linkStatsTrackLongestLoop)
+{
+   const uint8_t msg[] = { 3, 0x6e, unsigned8DataType, 1 };
+   chLinkStats stats;
+
+   ChillHub.resetLinkStats();
+   ChillHub.loop();
+   ChillHub.getLinkStats(&stats);
+   LONGS_EQUAL(0, stats.maxLoopMicros);
+
+   ChillHub.addCloudListener(0x6e, onSlowU8);
+   hubSend(msg, sizeof(msg));
+   ChillHub.loop();
+   ChillHub.getLinkStats(&stats);
+   CHECK(stats.maxLoopMicros >= 120000);
+}
+
+#if CHILLHUB_TX_RING_SIZE > 0
+
+// Queued updates go out through the TX ring as the UART drains, so loop()
+// never waits for the port.  The clock only moves when a write blocks or
+// the test advances it.
+TEST(chillhubTests, txRingKeepsLoopFromBlocking)
+{
+   uint8_t payload[32];
+   unsigned long long before;
+   unsigned long long worst = 0;
+   chLinkStats stats;
+   int frames = 0;
+   int len;
+   int i;
+
+   Serial.setBaud(115200);
+   ChillHub.resetLinkStats();
+   for (i=0; i<8; i++) {
+      ChillHub.updateCloudResourceU32(0x40 + i, 0x01020304);
+   }
+   for (i=0; i<100; i++) {
+      before = Serial.getBlockedUs();
+      ChillHub.loop();
+      if (Serial.getBlockedUs() - before > worst) {
+         worst = Serial.getBlockedUs() - before;
+      }
+      hostClockAdvance(1000);
+   }
+
+   LONGS_EQUAL(0, worst);
+   LONGS_EQUAL(0, ChillHub.getTxQueued());
+   ChillHub.getLinkStats(&stats);
+   LONGS_EQUAL(8, stats.updatesSent);
+   LONGS_EQUAL(0, stats.maxLoopMicros);
+   LONGS_EQUAL(0, stats.txWaits);
+   while ((len = hubReceive(payload, sizeof(payload))) > 0) {
+      LONGS_EQUAL(updateResourceType, payload[1]);
+      frames++;
+   }
+   LONGS_EQUAL(8, frames);
+}
+
+static void onSendBurst(uint8_t n)
+{
+   uint8_t i;
+   for (i=0; i<n; i++) {
+      ChillHub.sendU16Msg(0x61, 0x0100 + i);
+   }
+}
+
+// A callback sending more than the TX ring holds: with the drop policy the
+// frames that do not fit are dropped whole and loop() does not block, by
+// default they wait and all get through.
+TEST(chillhubTests, txRingFullPolicies)
+{
+   const uint8_t msg[] = { 3, 0x6f, unsigned8DataType, 40 };
+   uint8_t payload[16];
+   unsigned long long before;
+   chLinkStats stats;
+   int frames = 0;
+   int last = -1;
+   int len;
+
+   ChillHub.addCloudListener(0x6f, onSendBurst);
+   Serial.setBaud(115200);
+   ChillHub.setTxFullPolicy(chTxFullDrop);
+   ChillHub.resetLinkStats();
+   hubSend(msg, sizeof(msg));
+   before = Serial.getBlockedUs();
+   ChillHub.loop();
+   LONGS_EQUAL(0, Serial.getBlockedUs() - before);
+   ChillHub.flushTx();
+   ChillHub.getLinkStats(&stats);
+   CHECK(stats.txDropped > 0);
+   LONGS_EQUAL(40, stats.framesSent + stats.txDropped);
+   while ((len = hubReceive(payload, sizeof(payload))) > 0) {
+      LONGS_EQUAL(0x61, payload[1]);
+      CHECK(payload[4] > last);
+      last = payload[4];
+      frames++;
+   }
+   LONGS_EQUAL(stats.framesSent, frames);
+
+   ChillHub.setTxFullPolicy(chTxFullWait);
+   ChillHub.resetLinkStats();
+   hubSend(msg, sizeof(msg));
+   ChillHub.loop();
+   ChillHub.flushTx();
+   ChillHub.getLinkStats(&stats);
+   LONGS_EQUAL(0, stats.txDropped);
+   CHECK(stats.txWaits > 0);
+   CHECK(Serial.getBlockedUs() > before);
+   frames = 0;
+   while ((len = hubReceive(payload, sizeof(payload))) > 0) {
+      frames++;
+   }
+   LONGS_EQUAL(40, frames);
+}
+
+#if CHILLHUB_TX_CONTROL_RING_SIZE > 0
+
+// A keepalive reply queued behind a burst of user messages goes out as
+// soon as the bulk frame on the wire is finished.
+TEST(chillhubTests, controlFramesPreemptQueuedBulk)
+{
+   uint8_t payload[16];
+   chLinkStats stats;
+   int keepAliveAt = -1;
+   int frames = 0;
+   int last = -1;
+   int len;
+   int i;
+
+   Serial.setBaud(115200);
+   ChillHub.resetLinkStats();
+   for (i=0; i<16; i++) {
+      ChillHub.sendU16Msg(0x62, i);
+   }
+   CHECK(ChillHub.getTxQueued() > 0);
+   ChillHub.sendU8Msg(keepAliveType, 1);
+   ChillHub.flushTx();
+
+   ChillHub.getLinkStats(&stats);
+   LONGS_EQUAL(1, stats.txControlFrames);
+   LONGS_EQUAL(1, stats.txPreemptions);
+   while ((len = hubReceive(payload, sizeof(payload))) > 0) {
+      if (payload[1] == keepAliveType) {
+         keepAliveAt = frames;
+      } else {
+         LONGS_EQUAL(0x62, payload[1]);
+         LONGS_EQUAL(last + 1, payload[4]);
+         last = payload[4];
+      }
+      frames++;
+   }
+   LONGS_EQUAL(17, frames);
+   // only what had reached the UART FIFO, and the frame being written, is ahead
+   CHECK(keepAliveAt >= 0);
+   CHECK(keepAliveAt < 10);
+}
+
+// A port whose UART sends trickle bytes during every write, so there is
+// room again right after a write that filled it.
+class tricklePort : public Stream {
+   public:
+   HostLoopbackStream hub;
+   int room;
+   int trickle;
+
+   tricklePort(void) : room(0), trickle(0) {}
+   int available(void) { return hub.available(); }
+   int read(void) { return hub.read(); }
+   size_t write(uint8_t c) { return write(&c, 1); }
+   size_t write(const uint8_t *pBuf, size_t len) {
+      room = ((room > (int)len) ? room - (int)len : 0) + trickle;
+      return hub.write(pBuf, len);
+   }
+   int availableForWrite(void) { return room; }
+};
+
+// A control frame bigger than its ring is queued in pieces; bulk bytes must
+// not get between them even when the port has room for them.
+TEST(chillhubTests, oversizedControlFrameIsNotInterleaved)
+{
+   tricklePort port;
+   chInterface link(port);
+   uint8_t frame[256];
+   uint8_t c;
+   char name[48];
+   int frames = 0;
+   int setups = 0;
+   int i;
+
+   memset(name, 'n', sizeof(name) - 1);
+   name[sizeof(name) - 1] = 0;
+   for (i=0; i<12; i++) {
+      link.sendU16Msg(0x62, i);
+   }
+   LONGS_EQUAL(0, port.hub.hubAvailable());
+   port.trickle = 16;
+   link.setup(name, "00000000-0000-4000-8000-000000000000");
+   link.flushTx();
+
+   chFrameParser parser(frame, sizeof(frame));
+   while (port.hub.hubRead(&c, 1) == 1) {
+      uint8_t result = parser.feed(c);
+      CHECK((result == CHFRAME_NONE) || (result == CHFRAME_OK));
+      if (result == CHFRAME_OK) {
+         if (parser.payload()[1] == deviceIdMsgType) {
+            setups++;
+         }
+         frames++;
+      }
+   }
+   LONGS_EQUAL(1, setups);
+   LONGS_EQUAL(13, frames);
+}
+
+// Escaped 0xFF data bytes are not frame starts, also when a partial write
+// stopped between the ESC and the data byte: a control frame queued then
+// waits for the bulk frame to end.  Every split point of frames whose value
+// and CRC contain 0xFF and 0xFE.
+TEST(chillhubTests, controlFrameWaitsForEscapedBulkFrame)
+{
+   uint8_t frame[32];
+   uint8_t c;
+   uint16_t crc;
+   uint16_t value;
+   int escapedCrcs = 0;
+   int split;
+
+   for (value=0xfe00; value!=0; value++) {
+      const uint8_t payload[] = { 4, 0x50, unsigned16DataType,
+         (uint8_t)(value >> 8), (uint8_t)value };
+      crc = crc_finalize(crc_update(crc_init(), payload, sizeof(payload)));
+      if (((crc >> 8) < CHFRAME_ESC) && ((crc & 0xff) < CHFRAME_ESC) && (value != 0xffff)) {
+         continue;
+      }
+      escapedCrcs++;
+      for (split=1; split<16; split++) {
+         tricklePort port;
+         chInterface link(port);
+         int frames = 0;
+
+         port.room = split;
+         link.sendU16Msg(0x50, value);
+         port.room = 0;
+         link.sendU8Msg(keepAliveType, 1);
+         port.room = 1000;
+         link.loop();
+
+         chFrameParser parser(frame, sizeof(frame));
+         while (port.hub.hubRead(&c, 1) == 1) {
+            uint8_t result = parser.feed(c);
+            CHECK((result == CHFRAME_NONE) || (result == CHFRAME_OK));
+            if (result == CHFRAME_OK) {
+               if (frames == 0) {
+                  MEMCMP_EQUAL(payload, parser.payload(), sizeof(payload));
+               } else {
+                  LONGS_EQUAL(keepAliveType, parser.payload()[1]);
+               }
+               frames++;
+            }
+         }
+         LONGS_EQUAL(2, frames);
+      }
+   }
+   CHECK(escapedCrcs > 2);
+}
+
+#endif
+
+#endif
+
+#if CHILLHUB_TRACE_SIZE > 0
+
+// A message of the dump type makes the library send its trace ring, which
+// holds the receive path events oldest first.
+TEST(chillhubTests, traceDumpOnRequest)
+{
+   const uint8_t good[] = { 4, 0x65, unsigned16DataType, 0, 1 };
+   const uint8_t dump[] = { 1, 0x70 };
+   uint8_t frame[32];
+   size_t n = hostEncodeFrame(good, sizeof(good), frame);
+   uint8_t payload[128];
+   uint8_t events[CHILLHUB_TRACE_SIZE];
+   uint8_t args[CHILLHUB_TRACE_SIZE];
+   unsigned long times[CHILLHUB_TRACE_SIZE];
+   int count = 0;
+   int msgs = 0;
+   int msgCount = 0;
+   int len;
+   int i;
+
+   ChillHub.clearTrace();
+   ChillHub.setTraceDumpMsgType(0x70);
+
+   hostClockAdvance(1000);
+   hubSend(good, sizeof(good));
+   ChillHub.loop();
+   hostClockAdvance(1000);
+   frame[n-1] ^= 0xa5;
+   pHub->hubWrite(frame, n);
+   ChillHub.loop();
+   hostClockAdvance(1000);
+   hubSend(dump, sizeof(dump));
+   ChillHub.loop();
+   ChillHub.setTraceDumpMsgType(0);
+
+   while ((len = hubReceive(payload, sizeof(payload))) > 0) {
+      LONGS_EQUAL(0x70, payload[1]);
+      LONGS_EQUAL(arrayDataType, payload[2]);
+      LONGS_EQUAL(len - 5, payload[3]);
+      LONGS_EQUAL(unsigned8DataType, payload[4]);
+      LONGS_EQUAL(CHILLHUB_TRACE_VERSION, payload[5]);
+      LONGS_EQUAL(msgs, payload[6]);
+      for (i=8; i+CHILLHUB_TRACE_ENTRY_SIZE<=len; i+=CHILLHUB_TRACE_ENTRY_SIZE) {
+         times[count] = ((unsigned long)payload[i] << 24) | ((unsigned long)payload[i+1] << 16) |
+               ((unsigned long)payload[i+2] << 8) | payload[i+3];
+         events[count] = payload[i+4];
+         args[count] = payload[i+5];
+         count++;
+      }
+      msgCount = payload[7];
+      msgs++;
+   }
+   CHECK(msgs >= 2);
+   LONGS_EQUAL(msgCount, msgs);
+
+   // good frame, corrupt frame, dump request, each after a state walk
+   int received = -1, crcError = -1, request = -1;
+   for (i=0; i<count; i++) {
+      if (i > 0) CHECK(times[i] >= times[i-1]);
+      if ((events[i] == frameReceivedTraceEvent) && (args[i] == 0x65)) received = i;
+      if (events[i] == crcErrorTraceEvent) crcError = i;
+      if ((events[i] == frameReceivedTraceEvent) && (args[i] == 0x70)) request = i;
+      CHECK(events[i] != frameSentTraceEvent);
+   }
+   CHECK(received >= 0);
+   CHECK(crcError > received);
+   CHECK(request > crcError);
+   LONGS_EQUAL(1000, times[received]);
+   LONGS_EQUAL(2000, times[crcError]);
+   LONGS_EQUAL(stateTraceEvent, events[0]);
+   LONGS_EQUAL(1, args[0]);  // waiting for the length
+}
+
+#endif
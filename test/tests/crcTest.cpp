@@ -0,0 +1,107 @@
+#include "CppUTest/TestHarness.h"
+#include "CppUTestExt/MockSupport.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc.h"
+
+// Bit-at-a-time CRC-16/CCITT (poly 0x1021, init 0xffff), the reference
+// every CRC_ENGINE back-end has to match.
+static uint16_t referenceCrc(const uint8_t *data, size_t len)
+{
+   uint16_t crc = 0xffff;
+   uint8_t bit;
+
+   while (len--) {
+      crc ^= (uint16_t)(*data++) << 8;
+      for (bit=0; bit<8; bit++) {
+         if (crc & 0x8000) {
+            crc = (crc << 1) ^ 0x1021;
+         } else {
+            crc = crc << 1;
+         }
+      }
+   }
+
+   return crc;
+}
+
+static uint8_t data[300];
+
+TEST_GROUP(crcTests)
+{
+   void setup()
+   {
+      size_t i;
+
+      srand(42);
+      for (i=0; i<sizeof(data); i++) {
+         data[i] = rand() & 0xff;
+      }
+   }
+
+   void teardown()
+   {
+   }
+};
+
+TEST(crcTests, checkValue)
+{
+   const char check[] = "123456789";
+   crc_t crc = crc_init();
+
+   crc = crc_update(crc, (const unsigned char *)check, strlen(check));
+   LONGS_EQUAL(0x29b1, crc_finalize(crc));
+}
+
+TEST(crcTests, emptyUpdateLeavesCrcUnchanged)
+{
+   LONGS_EQUAL(crc_init(), crc_update(crc_init(), data, 0));
+}
+
+TEST(crcTests, matchesReferenceForEveryLength)
+{
+   size_t len;
+
+   for (len=0; len<=sizeof(data); len++) {
+      LONGS_EQUAL(referenceCrc(data, len),
+            crc_finalize(crc_update(crc_init(), data, len)));
+   }
+}
+
+TEST(crcTests, matchesReferenceForUnalignedStart)
+{
+   size_t offset;
+
+   for (offset=1; offset<8; offset++) {
+      LONGS_EQUAL(referenceCrc(&data[offset], 100),
+            crc_finalize(crc_update(crc_init(), &data[offset], 100)));
+   }
+}
+
+TEST(crcTests, byteWiseUpdatesMatchBlockUpdate)
+{
+   size_t i;
+   crc_t crc = crc_init();
+
+   for (i=0; i<sizeof(data); i++) {
+      crc = crc_update(crc, &data[i], 1);
+   }
+
+   LONGS_EQUAL(crc_finalize(crc_update(crc_init(), data, sizeof(data))),
+         crc_finalize(crc));
+}
+
+TEST(crcTests, allByteValues)
+{
+   uint8_t all[256];
+   size_t i;
+
+   for (i=0; i<sizeof(all); i++) {
+      all[i] = i;
+   }
+
+   LONGS_EQUAL(referenceCrc(all, sizeof(all)),
+         crc_finalize(crc_update(crc_init(), all, sizeof(all))));
+}
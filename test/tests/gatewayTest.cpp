@@ -0,0 +1,225 @@
+#include "CppUTest/TestHarness.h"
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "chillhub.h"
+#include "chframe.h"
+#include "chgateway.h"
+
+// Devices are simulated on the master side of ptys; the gateway opens the
+// slave side like a real serial port.
+#define SIM_DEVICES 24
+
+static int masterFds[SIM_DEVICES];
+static unsigned int handlerFrames[SIM_DEVICES];
+static uint8_t lastMsgType;
+
+static void countFrame(void *pContext, int device, const uint8_t *pPayload, uint16_t len)
+{
+   (void)pContext;
+   if ((device >= 0) && (device < SIM_DEVICES)) {
+      handlerFrames[device]++;
+   }
+   if (len > 1) {
+      lastMsgType = pPayload[1];
+   }
+}
+
+static void deviceWrite(int fd, const uint8_t *pPayload, uint16_t len)
+{
+   uint8_t frame[CHFRAME_ENCODED_SIZE(64)];
+   size_t n = chFrameEncode(pPayload, len, frame);
+   CHECK(write(fd, frame, n) == (ssize_t)n);
+}
+
+TEST_GROUP(gatewayTests)
+{
+   chGateway *pGateway;
+   int opened;
+
+   void setup()
+   {
+      pGateway = new chGateway();
+      pGateway->setFrameHandler(countFrame, NULL);
+      memset(handlerFrames, 0, sizeof(handlerFrames));
+      opened = 0;
+   }
+
+   void teardown()
+   {
+      int i;
+
+      delete pGateway;
+      for (i=0; i<opened; i++) {
+         if (masterFds[i] >= 0) {
+            close(masterFds[i]);
+         }
+      }
+   }
+
+   void openDevices(int count)
+   {
+      char name[64];
+
+      for (opened=0; opened<count; opened++) {
+         masterFds[opened] = HostFdStream::openPty(name, sizeof(name));
+         CHECK(masterFds[opened] >= 0);
+         LONGS_EQUAL(opened, pGateway->addDevice(name));
+      }
+   }
+
+   // Polls until the gateway has seen the given number of frames, or a
+   // couple of seconds have gone by.
+   int pollFor(int frames)
+   {
+      unsigned long long start = chGateway::nowUs();
+      int seen = 0;
+
+      while ((seen < frames) && (chGateway::nowUs() - start < 2000000)) {
+         seen += pGateway->poll(10);
+      }
+      return seen;
+   }
+};
+
+TEST(gatewayTests, compactUpdatesAreDecoded)
+{
+   const uint8_t msg[] = { 14, compactUpdateMsgType, arrayDataType, 3,
+      0x10, unsigned8DataType, 0xfe,
+      0x11, signed16DataType, 0xff, 0xfd,
+      0x12, unsigned32DataType, 0x01 };
+   const uint8_t good[] = { 12, compactUpdateMsgType, arrayDataType, 2,
+      0x10, unsigned8DataType, 0xfe,
+      0x11, signed16DataType, 0xff, 0xfd };
+   chResourceUpdate updates[4];
+
+   LONGS_EQUAL(2, chGateway::decodeCompactUpdates(good, sizeof(good), updates, 4));
+   LONGS_EQUAL(0x10, updates[0].resID);
+   LONGS_EQUAL(0xfe, updates[0].value);
+   LONGS_EQUAL(0x11, updates[1].resID);
+   LONGS_EQUAL(signed16DataType, updates[1].dataType);
+   LONGS_EQUAL(-3, (int32_t)updates[1].value);
+   LONGS_EQUAL(1, chGateway::decodeCompactUpdates(good, sizeof(good), updates, 1));
+
+   // the last value is cut short
+   LONGS_EQUAL(0, chGateway::decodeCompactUpdates(msg, sizeof(msg), updates, 4));
+}
+
+TEST(gatewayTests, framesFromManyDevicesAreCountedPerDevice)
+{
+   uint8_t msg[] = { 4, 0x50, unsigned16DataType, 0, 0 };
+   uint8_t frame[CHFRAME_ENCODED_SIZE(sizeof(msg))];
+   chGatewayStats stats;
+   int expected = 0;
+   int i, j;
+
+   openDevices(SIM_DEVICES);
+   for (i=0; i<SIM_DEVICES; i++) {
+      for (j=0; j<=i; j++) {
+         msg[3] = i;
+         msg[4] = j;
+         deviceWrite(masterFds[i], msg, sizeof(msg));
+         expected++;
+      }
+   }
+   // one corrupt frame from the first device
+   size_t n = chFrameEncode(msg, sizeof(msg), frame);
+   frame[n-1] ^= 0x5a;
+   CHECK(write(masterFds[0], frame, n) == (ssize_t)n);
+
+   LONGS_EQUAL(expected, pollFor(expected));
+   pGateway->poll(10);
+   for (i=0; i<SIM_DEVICES; i++) {
+      pGateway->getStats(i, &stats);
+      LONGS_EQUAL(i + 1, stats.framesIn);
+      LONGS_EQUAL(i + 1, handlerFrames[i]);
+      LONGS_EQUAL((i == 0) ? 1 : 0, stats.crcErrors);
+   }
+}
+
+// Frames queued for a device between two poll() calls go out in a single
+// write().
+TEST(gatewayTests, queuedFramesAreWrittenInOneBatch)
+{
+   const uint8_t msg[] = { 3, 0x60, unsigned8DataType, 0xff };
+   uint8_t rxBuf[66];
+   uint8_t buf[1024];
+   chGatewayStats stats;
+   int i, j;
+
+   openDevices(4);
+   for (i=0; i<4; i++) {
+      for (j=0; j<10; j++) {
+         CHECK(pGateway->send(i, msg, sizeof(msg)));
+      }
+   }
+   pGateway->poll(0);
+
+   for (i=0; i<4; i++) {
+      chFrameParser parser(rxBuf, sizeof(rxBuf));
+      int frames = 0;
+      ssize_t n = read(masterFds[i], buf, sizeof(buf));
+      for (j=0; j<n; j++) {
+         if (parser.feed(buf[j]) == CHFRAME_OK) {
+            MEMCMP_EQUAL(msg, parser.payload(), sizeof(msg));
+            frames++;
+         }
+      }
+      LONGS_EQUAL(10, frames);
+      pGateway->getStats(i, &stats);
+      LONGS_EQUAL(10, stats.framesOut);
+      LONGS_EQUAL(1, stats.writeCalls);
+      LONGS_EQUAL(n, stats.bytesOut);
+   }
+}
+
+static void announce(uint8_t dummy)
+{
+   (void)dummy;
+   ChillHub.setup("gwtest", "00000000-0000-4000-8000-000000000000");
+}
+
+// A probe is answered by the library itself running on the other end of
+// the pty, which gives the round trip time.
+TEST(gatewayTests, probeMeasuresRoundTripToLibraryDevice)
+{
+   chGatewayStats stats;
+   unsigned long long start;
+
+   openDevices(1);
+   HostFdStream stream(masterFds[0], masterFds[0]);
+   Serial.setBaud(0);
+   Serial.attach(&stream);
+   ChillHub.subscribe(deviceIdRequestType, announce);
+
+   pGateway->probe(0);
+   start = chGateway::nowUs();
+   do {
+      pGateway->poll(1);
+      ChillHub.loop();
+      pGateway->getStats(0, &stats);
+   } while ((stats.probesAnswered == 0) && (chGateway::nowUs() - start < 2000000));
+
+   ChillHub.unsubscribe(deviceIdRequestType);
+   Serial.attach(0);
+
+   LONGS_EQUAL(1, stats.probesSent);
+   LONGS_EQUAL(1, stats.probesAnswered);
+   CHECK(stats.rttMaxUs > 0);
+   CHECK(stats.rttMaxUs < 2000000);
+   LONGS_EQUAL(stats.rttSumUs, stats.rttLastUs);
+}
+
+TEST(gatewayTests, deviceThatGoesAwayIsClosed)
+{
+   openDevices(2);
+   close(masterFds[1]);
+   masterFds[1] = -1;
+
+   pGateway->poll(10);
+   CHECK(pGateway->deviceOpen(0));
+   CHECK(!pGateway->deviceOpen(1));
+   CHECK(!pGateway->send(1, (const uint8_t *)"\x01\x60", 2));
+}
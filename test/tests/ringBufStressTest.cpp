@@ -0,0 +1,119 @@
+#include "CppUTest/TestHarness.h"
+#include <stdint.h>
+
+// <thread> uses placement new, which the CppUTest leak detector's new
+// macro breaks, so pull it in with the macro out of the way.
+#ifdef new
+#undef new
+#endif
+#include <thread>
+#include "CppUTest/MemoryLeakDetectorNewMacros.h"
+
+#include "ringbuf.h"
+
+static const uint32_t stressBytes = 1000000;
+
+TEST_GROUP(ringBufStressTests)
+{
+   void setup()
+   {
+   }
+
+   void teardown()
+   {
+   }
+};
+
+// The threads yield when they cannot make progress so the test also
+// finishes quickly on a single core machine.
+
+// One thread writes a running counter while another reads it back; any
+// lost, duplicated or torn byte shows up as a sequence error.
+TEST(ringBufStressTests, singleProducerSingleConsumer)
+{
+   static FixedRingBuffer<64> rb;
+   uint32_t errors = 0;
+
+   std::thread producer([]() {
+      uint32_t sent = 0;
+      while (sent < stressBytes) {
+         if (rb.Write(sent & 0xff) == RING_BUFFER_ADD_SUCCESS) {
+            sent++;
+         } else {
+            std::this_thread::yield();
+         }
+      }
+   });
+
+   std::thread consumer([&errors]() {
+      uint32_t received = 0;
+      while (received < stressBytes) {
+         if (rb.IsEmpty() == RING_BUFFER_NOT_EMPTY) {
+            if (rb.Read() != (received & 0xff)) {
+               errors++;
+            }
+            received++;
+         } else {
+            std::this_thread::yield();
+         }
+      }
+   });
+
+   producer.join();
+   consumer.join();
+
+   LONGS_EQUAL(0, errors);
+   BYTES_EQUAL(RING_BUFFER_IS_EMPTY, rb.IsEmpty());
+}
+
+// Same again with the bulk calls and a buffer size that does not divide
+// the chunk sizes, so spans straddle the wrap point.
+TEST(ringBufStressTests, singleProducerSingleConsumerBulk)
+{
+   static FixedRingBuffer<128> rb;
+   uint32_t errors = 0;
+
+   std::thread producer([]() {
+      uint8_t chunk[37];
+      uint32_t sent = 0;
+      uint8_t i;
+      uint8_t n;
+
+      while (sent < stressBytes) {
+         for (i=0; i<sizeof(chunk); i++) {
+            chunk[i] = (sent + i) & 0xff;
+         }
+         n = (stressBytes - sent < sizeof(chunk)) ? stressBytes - sent : sizeof(chunk);
+         n = rb.WriteBulk(chunk, n);
+         if (n == 0) {
+            std::this_thread::yield();
+         }
+         sent += n;
+      }
+   });
+
+   std::thread consumer([&errors]() {
+      uint8_t chunk[23];
+      uint32_t received = 0;
+      uint8_t i;
+      uint8_t n;
+
+      while (received < stressBytes) {
+         n = rb.ReadBulk(chunk, sizeof(chunk));
+         for (i=0; i<n; i++) {
+            if (chunk[i] != ((received + i) & 0xff)) {
+               errors++;
+            }
+         }
+         if (n == 0) {
+            std::this_thread::yield();
+         }
+         received += n;
+      }
+   });
+
+   producer.join();
+   consumer.join();
+
+   LONGS_EQUAL(0, errors);
+}
@@ -258,7 +258,7 @@ TEST(ringBufTests, peekCheckWrapCase)
       retVal = rb.Write(i++);
    } while(retVal != RING_BUFFER_ADD_FAILURE);
 
-   BYTES_EQUAL(13, rb.Peek(8));
+   BYTES_EQUAL(12, rb.Peek(8));
 }
 
 
@@ -314,3 +314,197 @@ TEST(ringBufTests, bytesAvailableReturns0WhenFull)
 }
 
 
+
+TEST_GROUP(fixedRingBufTests)
+{
+   FixedRingBuffer<8> rb;
+
+   void fillBuffer(void)
+   {
+      uint8_t i;
+
+      for (i=0; i<8; i++)
+      {
+         rb.Write(i);
+      }
+   }
+
+   void setup()
+   {
+   }
+
+   void teardown()
+   {
+   }
+};
+
+TEST(fixedRingBufTests, newBufferIsEmpty)
+{
+   BYTES_EQUAL(RING_BUFFER_IS_EMPTY, rb.IsEmpty());
+   BYTES_EQUAL(RING_BUFFER_NOT_FULL, rb.IsFull());
+   BYTES_EQUAL(0, rb.BytesUsed());
+   BYTES_EQUAL(8, rb.BytesAvailable());
+}
+
+TEST(fixedRingBufTests, writeThenReadReturnsValue)
+{
+   BYTES_EQUAL(RING_BUFFER_ADD_SUCCESS, rb.Write(42));
+   BYTES_EQUAL(RING_BUFFER_NOT_EMPTY, rb.IsEmpty());
+   BYTES_EQUAL(42, rb.Read());
+   BYTES_EQUAL(RING_BUFFER_IS_EMPTY, rb.IsEmpty());
+}
+
+TEST(fixedRingBufTests, readFromEmptyBufferReturnsFF)
+{
+   BYTES_EQUAL(0xff, rb.Read());
+   BYTES_EQUAL(0, rb.BytesUsed());
+}
+
+TEST(fixedRingBufTests, writeToFullBufferFails)
+{
+   fillBuffer();
+   BYTES_EQUAL(RING_BUFFER_IS_FULL, rb.IsFull());
+   BYTES_EQUAL(0, rb.BytesAvailable());
+   BYTES_EQUAL(RING_BUFFER_ADD_FAILURE, rb.Write(42));
+   BYTES_EQUAL(0, rb.Read());
+}
+
+TEST(fixedRingBufTests, indicesWrapManyTimes)
+{
+   uint16_t i;
+
+   for (i=0; i<1000; i++) {
+      BYTES_EQUAL(RING_BUFFER_ADD_SUCCESS, rb.Write(i & 0xff));
+      BYTES_EQUAL(RING_BUFFER_ADD_SUCCESS, rb.Write((i + 1) & 0xff));
+      BYTES_EQUAL(i & 0xff, rb.Read());
+      BYTES_EQUAL((i + 1) & 0xff, rb.Read());
+   }
+   BYTES_EQUAL(RING_BUFFER_IS_EMPTY, rb.IsEmpty());
+}
+
+TEST(fixedRingBufTests, peekCheckWrapCase)
+{
+   uint8_t i;
+
+   fillBuffer();
+   for (i=0; i<5; i++) {
+      rb.Read();
+   }
+   for (i=8; i<13; i++) {
+      rb.Write(i);
+   }
+
+   for (i=0; i<8; i++) {
+      BYTES_EQUAL(i + 5, rb.Peek(i));
+   }
+   BYTES_EQUAL(0xff, rb.Peek(8));
+}
+
+TEST(fixedRingBufTests, writeBulkStopsWhenFull)
+{
+   uint8_t data[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+
+   BYTES_EQUAL(3, rb.WriteBulk(data, 3));
+   BYTES_EQUAL(5, rb.WriteBulk(&data[3], 7));
+   BYTES_EQUAL(RING_BUFFER_IS_FULL, rb.IsFull());
+   BYTES_EQUAL(0, rb.WriteBulk(data, 1));
+   BYTES_EQUAL(7, rb.Peek(7));
+}
+
+TEST(fixedRingBufTests, readBulkAcrossWrap)
+{
+   uint8_t data[8] = {10, 11, 12, 13, 14, 15, 16, 17};
+   uint8_t out[8];
+   uint8_t i;
+
+   fillBuffer();
+   BYTES_EQUAL(6, rb.ReadBulk(out, 6));
+   BYTES_EQUAL(5, out[5]);
+   BYTES_EQUAL(6, rb.WriteBulk(data, 8));
+
+   memset(out, 0, sizeof(out));
+   BYTES_EQUAL(8, rb.ReadBulk(out, sizeof(out)));
+   BYTES_EQUAL(6, out[0]);
+   BYTES_EQUAL(7, out[1]);
+   for (i=2; i<8; i++) {
+      BYTES_EQUAL(i + 8, out[i]);
+   }
+   BYTES_EQUAL(0, rb.ReadBulk(out, 1));
+}
+
+TEST(fixedRingBufTests, peekSpanOfEmptyBuffer)
+{
+   const uint8_t *first;
+   const uint8_t *second;
+   uint8_t firstLen;
+   uint8_t secondLen;
+
+   BYTES_EQUAL(0, rb.PeekSpan(&first, &firstLen, &second, &secondLen));
+   BYTES_EQUAL(0, firstLen);
+   BYTES_EQUAL(0, secondLen);
+}
+
+TEST(fixedRingBufTests, peekSpanContiguous)
+{
+   const uint8_t *first;
+   const uint8_t *second;
+   uint8_t firstLen;
+   uint8_t secondLen;
+
+   rb.Write(1);
+   rb.Write(2);
+   rb.Write(3);
+   BYTES_EQUAL(1, rb.PeekSpan(&first, &firstLen, &second, &secondLen));
+   BYTES_EQUAL(3, firstLen);
+   BYTES_EQUAL(0, secondLen);
+   BYTES_EQUAL(1, first[0]);
+   BYTES_EQUAL(3, first[2]);
+   BYTES_EQUAL(3, rb.BytesUsed());
+}
+
+TEST(fixedRingBufTests, peekSpanSplitAtWrap)
+{
+   const uint8_t *first;
+   const uint8_t *second;
+   uint8_t firstLen;
+   uint8_t secondLen;
+   uint8_t i;
+
+   fillBuffer();
+   rb.Discard(6);
+   rb.Write(8);
+   rb.Write(9);
+   rb.Write(10);
+
+   BYTES_EQUAL(2, rb.PeekSpan(&first, &firstLen, &second, &secondLen));
+   BYTES_EQUAL(2, firstLen);
+   BYTES_EQUAL(3, secondLen);
+   BYTES_EQUAL(6, first[0]);
+   BYTES_EQUAL(7, first[1]);
+   for (i=0; i<3; i++) {
+      BYTES_EQUAL(i + 8, second[i]);
+   }
+}
+
+TEST(fixedRingBufTests, discardIsBoundedByBytesUsed)
+{
+   rb.Write(1);
+   rb.Write(2);
+   BYTES_EQUAL(1, rb.Discard(1));
+   BYTES_EQUAL(2, rb.Read());
+   BYTES_EQUAL(0, rb.Discard(5));
+   BYTES_EQUAL(RING_BUFFER_IS_EMPTY, rb.IsEmpty());
+}
+
+TEST(fixedRingBufTests, largeBufferWithWideIndex)
+{
+   FixedRingBuffer<256, uint16_t> big;
+   uint16_t i;
+
+   for (i=0; i<256; i++) {
+      BYTES_EQUAL(RING_BUFFER_ADD_SUCCESS, big.Write(i & 0xff));
+   }
+   LONGS_EQUAL(256, big.BytesUsed());
+   BYTES_EQUAL(RING_BUFFER_IS_FULL, big.IsFull());
+   BYTES_EQUAL(200, big.Peek(200));
+}
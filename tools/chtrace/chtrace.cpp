@@ -0,0 +1,154 @@
+/*
+ * Decodes ChillHub trace dumps into a readable timeline.
+ *
+ * Reads a raw capture of what the device sent (e.g. the hub's side of the
+ * serial port saved to a file), picks out the frames of the trace dump
+ * message type and prints each complete dump as one event per line, with
+ * the time since the previous event.  See sendTraceDump() in chillhub.h.
+ *
+ *   chtrace -t <msgType> [capture]     reads stdin without a capture file
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chillhub.h"
+#include "chframe.h"
+
+#define MAX_ENTRIES 255
+
+static chTraceEntry entries[MAX_ENTRIES];
+static unsigned int entryCount;
+static unsigned int nextMsgIndex;
+static unsigned int dumpCount;
+
+static const char *stateName(uint8_t state) {
+   switch (state) {
+      case 0: return "WaitingForStx";
+      case 1: return "WaitingForLength";
+      case 2: return "WaitingForPacket";
+      default: return "?";
+   }
+}
+
+static void printEntry(const chTraceEntry *pEntry, unsigned long delta) {
+   printf("%10lu %+9ld  ", pEntry->time, (long)delta);
+   switch (pEntry->event) {
+      case stateTraceEvent:
+         printf("state      %s\n", stateName(pEntry->arg));
+         break;
+      case frameReceivedTraceEvent:
+         printf("received   type 0x%02x\n", pEntry->arg);
+         break;
+      case crcErrorTraceEvent:
+         printf("crc error  type 0x%02x\n", pEntry->arg);
+         break;
+      case badLengthTraceEvent:
+         printf("bad length %u\n", pEntry->arg);
+         break;
+      case frameAbortedTraceEvent:
+         printf("aborted    %s\n", pEntry->arg ? "inter-byte timeout" : "STX in frame");
+         break;
+      case rxOverflowTraceEvent:
+         printf("rx overflow\n");
+         break;
+      case frameSentTraceEvent:
+         printf("sent       type 0x%02x\n", pEntry->arg);
+         break;
+      default:
+         printf("event 0x%02x arg 0x%02x\n", pEntry->event, pEntry->arg);
+         break;
+   }
+}
+
+static void printDump(void) {
+   unsigned int i;
+
+   printf("dump %u, %u events\n", ++dumpCount, entryCount);
+   printf("%10s %9s  event\n", "micros", "delta");
+   for (i=0; i<entryCount; i++) {
+      // unsigned arithmetic copes with micros() wrapping
+      printEntry(&entries[i], i ? entries[i].time - entries[i-1].time : 0);
+   }
+   printf("\n");
+}
+
+// Collects the entries of one dump message, printing the dump once its
+// last message is in.
+static void handleDumpMessage(const uint8_t *pPayload, size_t len) {
+   size_t i;
+
+   if ((len < 5 + CHILLHUB_TRACE_HEADER_SIZE) || (pPayload[2] != arrayDataType) ||
+         (pPayload[4] != unsigned8DataType)) {
+      fprintf(stderr, "chtrace: not a trace dump message, skipped\n");
+      return;
+   }
+   if (pPayload[5] != CHILLHUB_TRACE_VERSION) {
+      fprintf(stderr, "chtrace: trace version %u not supported\n", pPayload[5]);
+      return;
+   }
+   if (pPayload[6] == 0) {
+      entryCount = 0;
+      nextMsgIndex = 0;
+   }
+   if (pPayload[6] != nextMsgIndex) {
+      fprintf(stderr, "chtrace: dump message %u missing\n", nextMsgIndex);
+      nextMsgIndex = 0xffff; // skip the rest of this dump
+      return;
+   }
+   nextMsgIndex++;
+
+   for (i=5 + CHILLHUB_TRACE_HEADER_SIZE; i+CHILLHUB_TRACE_ENTRY_SIZE<=len; i+=CHILLHUB_TRACE_ENTRY_SIZE) {
+      if (entryCount < MAX_ENTRIES) {
+         chTraceEntry *pEntry = &entries[entryCount++];
+         pEntry->time = ((unsigned long)pPayload[i] << 24) | ((unsigned long)pPayload[i+1] << 16) |
+               ((unsigned long)pPayload[i+2] << 8) | pPayload[i+3];
+         pEntry->event = pPayload[i+4];
+         pEntry->arg = pPayload[i+5];
+      }
+   }
+
+   if (nextMsgIndex == pPayload[7]) {
+      printDump();
+   }
+}
+
+static void usage(void) {
+   fprintf(stderr, "usage: chtrace -t <msgType> [capture]\n");
+   exit(2);
+}
+
+int main(int argc, char **argv) {
+   static uint8_t frameBuf[CHILLHUB_MAX_FRAME_SIZE];
+   chFrameParser parser(frameBuf, sizeof(frameBuf));
+   FILE *f = stdin;
+   long msgType = -1;
+   int c;
+   int i;
+
+   for (i=1; i<argc; i++) {
+      if ((strcmp(argv[i], "-t") == 0) && (i+1 < argc)) {
+         msgType = strtol(argv[++i], NULL, 0);
+      } else if (argv[i][0] == '-') {
+         usage();
+      } else if ((f = fopen(argv[i], "rb")) == NULL) {
+         perror(argv[i]);
+         return 1;
+      }
+   }
+   if ((msgType <= 0) || (msgType > 0xff)) {
+      usage();
+   }
+
+   while ((c = fgetc(f)) != EOF) {
+      if ((parser.feed(c) == CHFRAME_OK) && (parser.length() >= 2) &&
+            (parser.payload()[1] == msgType)) {
+         handleDumpMessage(parser.payload(), parser.length());
+      }
+   }
+   if (dumpCount == 0) {
+      fprintf(stderr, "chtrace: no complete trace dump found\n");
+      return 1;
+   }
+   return 0;
+}
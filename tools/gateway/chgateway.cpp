@@ -0,0 +1,389 @@
+#include "chgateway.h"
+#include "chillhub.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bytes taken from a device per read() call.
+#define READ_CHUNK 4096
+
+struct chGateway::deviceState {
+  int fd;
+  char name[64];
+  uint8_t rxBuf[CHGATEWAY_MAX_PAYLOAD + 2];
+  chFrameParser parser;
+  uint8_t txBuf[CHGATEWAY_TX_BUF_SIZE];
+  size_t txLen;
+  uint8_t txWatched;            // waiting for EPOLLOUT
+  unsigned long long probeTime; // when the pending probe went out, 0 if none
+  chGatewayStats stats;
+
+  deviceState(void) : parser(rxBuf, sizeof(rxBuf)) {
+    fd = -1;
+    name[0] = 0;
+    txLen = 0;
+    txWatched = 0;
+    probeTime = 0;
+    memset(&stats, 0, sizeof(stats));
+  }
+};
+
+chGateway::chGateway(void) {
+  devices = 0;
+  handler = NULL;
+  pContext = NULL;
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+chGateway::~chGateway(void) {
+  int i;
+
+  for (i=0; i<devices; i++) {
+    closeDevice(i);
+    delete pDevices[i];
+  }
+  if (epollFd >= 0) {
+    close(epollFd);
+  }
+}
+
+unsigned long long chGateway::nowUs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static speed_t baudToSpeed(unsigned long baud) {
+  switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+    default: return B115200;
+  }
+}
+
+int chGateway::addDevice(const char *path, unsigned long baud) {
+  struct termios tio;
+  int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  int device;
+
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  if (isatty(fd)) {
+    if (tcgetattr(fd, &tio) < 0) {
+      perror(path);
+      close(fd);
+      return -1;
+    }
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, baudToSpeed(baud));
+    tio.c_cflag |= CLOCAL | CREAD;
+    if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+      perror(path);
+      close(fd);
+      return -1;
+    }
+  }
+
+  device = addFd(fd, path);
+  if (device < 0) {
+    close(fd);
+  }
+  return device;
+}
+
+int chGateway::addFd(int fd, const char *name) {
+  struct epoll_event ev;
+  deviceState *pDev;
+
+  if ((devices >= CHGATEWAY_MAX_DEVICES) || (epollFd < 0)) {
+    return -1;
+  }
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+    return -1;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = devices;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    return -1;
+  }
+
+  pDev = new deviceState;
+  pDev->fd = fd;
+  snprintf(pDev->name, sizeof(pDev->name), "%s", name);
+  pDevices[devices] = pDev;
+  return devices++;
+}
+
+void chGateway::removeDevice(int device) {
+  if ((device >= 0) && (device < devices)) {
+    closeDevice(device);
+  }
+}
+
+void chGateway::closeDevice(int device) {
+  deviceState *pDev = pDevices[device];
+
+  if (pDev->fd < 0) {
+    return;
+  }
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, pDev->fd, NULL);
+  close(pDev->fd);
+  pDev->fd = -1;
+  pDev->txLen = 0;
+  pDev->probeTime = 0;
+}
+
+void chGateway::setFrameHandler(chGatewayFrameHandler handler, void *pContext) {
+  this->handler = handler;
+  this->pContext = pContext;
+}
+
+uint8_t chGateway::send(int device, const uint8_t *pPayload, uint16_t len) {
+  deviceState *pDev;
+
+  if ((device < 0) || (device >= devices) || (pDevices[device]->fd < 0)) {
+    return 0;
+  }
+  pDev = pDevices[device];
+  if (pDev->txLen + CHFRAME_ENCODED_SIZE(len) > sizeof(pDev->txBuf)) {
+    pDev->stats.txDropped++;
+    return 0;
+  }
+  pDev->txLen += chFrameEncode(pPayload, len, &pDev->txBuf[pDev->txLen]);
+  pDev->stats.framesOut++;
+  return 1;
+}
+
+void chGateway::probe(int device) {
+  // sent with a U8 like a keepalive, devices answer with setup()
+  static const uint8_t request[] = { 3, deviceIdRequestType, unsigned8DataType, 0 };
+
+  if (send(device, request, sizeof(request))) {
+    pDevices[device]->stats.probesSent++;
+    pDevices[device]->probeTime = nowUs();
+  }
+}
+
+void chGateway::watchOutput(int device, uint8_t enable) {
+  deviceState *pDev = pDevices[device];
+  struct epoll_event ev;
+
+  if (pDev->txWatched == enable) {
+    return;
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = enable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+  ev.data.u32 = device;
+  epoll_ctl(epollFd, EPOLL_CTL_MOD, pDev->fd, &ev);
+  pDev->txWatched = enable;
+}
+
+// Everything queued for the device goes out in one write(); what the
+// device cannot take yet waits for EPOLLOUT.
+void chGateway::flushDevice(int device) {
+  deviceState *pDev = pDevices[device];
+  ssize_t n;
+
+  if ((pDev->fd < 0) || (pDev->txLen == 0)) {
+    return;
+  }
+  n = write(pDev->fd, pDev->txBuf, pDev->txLen);
+  pDev->stats.writeCalls++;
+  if (n < 0) {
+    if ((errno != EAGAIN) && (errno != EINTR)) {
+      closeDevice(device);
+      return;
+    }
+    n = 0;
+  }
+  pDev->stats.bytesOut += n;
+  pDev->txLen -= n;
+  if (pDev->txLen > 0) {
+    memmove(pDev->txBuf, &pDev->txBuf[n], pDev->txLen);
+  }
+  watchOutput(device, pDev->txLen > 0);
+}
+
+void chGateway::readDevice(int device, int *pFrames) {
+  deviceState *pDev = pDevices[device];
+  uint8_t buf[READ_CHUNK];
+  ssize_t n;
+  ssize_t i;
+
+  for (;;) {
+    n = read(pDev->fd, buf, sizeof(buf));
+    if (n == 0) {
+      closeDevice(device);
+      return;
+    }
+    if (n < 0) {
+      // a pty slave reports EIO once the other side has gone
+      if ((errno != EAGAIN) && (errno != EINTR)) {
+        closeDevice(device);
+      }
+      return;
+    }
+    pDev->stats.bytesIn += n;
+
+    for (i=0; i<n; i++) {
+      switch (pDev->parser.feed(buf[i])) {
+        case CHFRAME_OK:
+          pDev->stats.framesIn++;
+          (*pFrames)++;
+          if (pDev->probeTime && (pDev->parser.length() > 1) &&
+              (pDev->parser.payload()[1] == deviceIdMsgType)) {
+            unsigned long long rtt = nowUs() - pDev->probeTime;
+            pDev->stats.probesAnswered++;
+            pDev->stats.rttLastUs = rtt;
+            pDev->stats.rttSumUs += rtt;
+            if (rtt > pDev->stats.rttMaxUs) {
+              pDev->stats.rttMaxUs = rtt;
+            }
+            pDev->probeTime = 0;
+          }
+          if (handler) {
+            handler(pContext, device, pDev->parser.payload(), pDev->parser.length());
+          }
+          // the handler may have removed the device
+          if (pDev->fd < 0) {
+            return;
+          }
+          break;
+        case CHFRAME_CRC_ERROR:
+          pDev->stats.crcErrors++;
+          break;
+        case CHFRAME_BAD_LENGTH:
+          pDev->stats.badLengths++;
+          break;
+        case CHFRAME_ABORTED:
+          pDev->stats.framesAborted++;
+          break;
+        default:
+          break;
+      }
+    }
+  }
+}
+
+int chGateway::poll(int timeoutMs) {
+  struct epoll_event events[CHGATEWAY_MAX_DEVICES];
+  int frames = 0;
+  int n;
+  int i;
+
+  // frames queued since the last call go out before waiting
+  for (i=0; i<devices; i++) {
+    if (!pDevices[i]->txWatched) {
+      flushDevice(i);
+    }
+  }
+
+  n = epoll_wait(epollFd, events, CHGATEWAY_MAX_DEVICES, timeoutMs);
+  if (n < 0) {
+    return (errno == EINTR) ? 0 : -1;
+  }
+  for (i=0; i<n; i++) {
+    int device = events[i].data.u32;
+    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+      readDevice(device, &frames);
+    }
+    if (events[i].events & EPOLLOUT) {
+      flushDevice(device);
+    }
+  }
+
+  // replies queued by the handler, batched per device
+  for (i=0; i<devices; i++) {
+    if (!pDevices[i]->txWatched) {
+      flushDevice(i);
+    }
+  }
+  return frames;
+}
+
+uint8_t chGateway::deviceOpen(int device) {
+  return (device >= 0) && (device < devices) && (pDevices[device]->fd >= 0);
+}
+
+const char *chGateway::deviceName(int device) {
+  return pDevices[device]->name;
+}
+
+void chGateway::getStats(int device, chGatewayStats *pStats) {
+  *pStats = pDevices[device]->stats;
+}
+
+// Bytes the value of a compact update entry takes, 0 for types it cannot
+// carry.
+static uint8_t compactValueSize(uint8_t type) {
+  switch(type) {
+    case unsigned8DataType:
+    case signed8DataType:
+    case booleanDataType:
+      return 1;
+    case unsigned16DataType:
+    case signed16DataType:
+      return 2;
+    case unsigned32DataType:
+    case signed32DataType:
+      return 4;
+    default:
+      return 0;
+  }
+}
+
+uint8_t chGateway::decodeCompactUpdates(const uint8_t *pPayload, uint16_t len, chResourceUpdate *pOut, uint8_t maxOut) {
+  uint16_t index;
+  uint8_t count;
+  uint8_t decoded = 0;
+  uint8_t valSize;
+  uint8_t i;
+
+  if ((len < 4) || (pPayload[1] != compactUpdateMsgType) || (pPayload[2] != arrayDataType)) {
+    return 0;
+  }
+  count = pPayload[3];
+  index = 4;
+
+  while ((decoded < count) && (decoded < maxOut)) {
+    if ((uint16_t)(index + 2) > len) {
+      return 0;
+    }
+    pOut->resID = pPayload[index++];
+    pOut->dataType = pPayload[index++];
+    valSize = compactValueSize(pOut->dataType);
+    if ((valSize == 0) || ((uint16_t)(index + valSize) > len)) {
+      return 0;
+    }
+    pOut->value = 0;
+    for (i=0; i<valSize; i++) {
+      pOut->value = (pOut->value << 8) | pPayload[index++];
+    }
+    // sign extend so the bit pattern matches the 32 bit value
+    if ((pOut->dataType == signed8DataType) && (pOut->value & 0x80)) {
+      pOut->value |= 0xFFFFFF00UL;
+    } else if ((pOut->dataType == signed16DataType) && (pOut->value & 0x8000)) {
+      pOut->value |= 0xFFFF0000UL;
+    }
+    pOut++;
+    decoded++;
+  }
+
+  return decoded;
+}
@@ -0,0 +1,96 @@
+/*
+ * Hub side gateway for many ChillHub peripherals.
+ *
+ * One epoll loop serves every device: reads are non-blocking and parsed
+ * with chFrameParser, frames to send are encoded into a per-device buffer
+ * and written out with one write() per device and loop iteration.  Each
+ * device keeps counters, and probe() measures the round trip of a device
+ * id request.  Linux only.
+ */
+#ifndef CHGATEWAY_H
+#define CHGATEWAY_H
+
+#include <stdint.h>
+#include "chframe.h"
+#include "chillhub.h"
+
+// Devices one gateway can serve.  Each takes a file descriptor while open.
+#ifndef CHGATEWAY_MAX_DEVICES
+  #define CHGATEWAY_MAX_DEVICES 1024
+#endif
+
+// Largest payload accepted from a device.
+#ifndef CHGATEWAY_MAX_PAYLOAD
+  #define CHGATEWAY_MAX_PAYLOAD 1024
+#endif
+
+// Encoded bytes that can wait to be written to one device.
+#ifndef CHGATEWAY_TX_BUF_SIZE
+  #define CHGATEWAY_TX_BUF_SIZE 8192
+#endif
+
+struct chGatewayStats {
+  unsigned long framesIn;
+  unsigned long framesOut;
+  unsigned long long bytesIn;
+  unsigned long long bytesOut;
+  unsigned long crcErrors;
+  unsigned long badLengths;
+  unsigned long framesAborted;
+  unsigned long txDropped;     // frames send() had no room for
+  unsigned long writeCalls;
+  unsigned long probesSent;
+  unsigned long probesAnswered;
+  unsigned long long rttSumUs; // of the answered probes
+  unsigned long long rttMaxUs;
+  unsigned long long rttLastUs;
+};
+
+// Called for every good frame with the payload as sent by the device,
+// starting with its length byte.
+typedef void (*chGatewayFrameHandler)(void *pContext, int device, const uint8_t *pPayload, uint16_t len);
+
+class chGateway {
+  public:
+    chGateway(void);
+    ~chGateway(void);
+    // Opens a tty (or pty slave) and puts it in raw mode at the given baud
+    // rate.  Returns the device number, or -1.
+    int addDevice(const char *path, unsigned long baud = 115200);
+    // Takes over an open descriptor, which is made non-blocking.
+    int addFd(int fd, const char *name);
+    // Closes the device; its number is not reused.
+    void removeDevice(int device);
+    void setFrameHandler(chGatewayFrameHandler handler, void *pContext);
+    // Queues a frame for the device, written out by the next poll().
+    // Returns 0 if the device's transmit buffer is full.
+    uint8_t send(int device, const uint8_t *pPayload, uint16_t len);
+    // Sends a device id request and times the device's announcement.
+    void probe(int device);
+    // Waits up to timeoutMs for input, handles it and flushes queued
+    // frames.  Returns the number of frames received, or -1 on error.
+    int poll(int timeoutMs);
+    int deviceCount(void) { return devices; }
+    uint8_t deviceOpen(int device);
+    const char *deviceName(int device);
+    void getStats(int device, chGatewayStats *pStats);
+    static unsigned long long nowUs(void);
+    // Decodes a device's compact update message (the payload as passed to
+    // the frame handler) into at most maxOut updates.  Returns the number
+    // decoded, 0 if the message is malformed.
+    static uint8_t decodeCompactUpdates(const uint8_t *pPayload, uint16_t len, chResourceUpdate *pOut, uint8_t maxOut);
+
+  private:
+    struct deviceState;
+    deviceState *pDevices[CHGATEWAY_MAX_DEVICES];
+    int devices;
+    int epollFd;
+    chGatewayFrameHandler handler;
+    void *pContext;
+    void readDevice(int device, int *pFrames);
+    void flushDevice(int device);
+    void closeDevice(int device);
+    void watchOutput(int device, uint8_t enable);
+};
+
+#endif
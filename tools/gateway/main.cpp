@@ -0,0 +1,130 @@
+/*
+ * chgateway: serves ChillHub peripherals on any number of serial ports
+ * from one event loop and reports what each of them is doing.
+ *
+ *   chgateway [-b baud] [-p probeMs] [-r reportMs] [-v] device...
+ *
+ * Every reportMs it prints one line per device with the frame and byte
+ * rates since the last report, the error counters and the round trip time
+ * of the device id probes sent every probeMs.  -v prints every frame, and
+ * the values in compact updates.
+ */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chgateway.h"
+
+static volatile sig_atomic_t stopping;
+static uint8_t verbose;
+
+static void onSignal(int sig) {
+  (void)sig;
+  stopping = 1;
+}
+
+static void onFrame(void *pContext, int device, const uint8_t *pPayload, uint16_t len) {
+  chGateway *pGateway = (chGateway *)pContext;
+  chResourceUpdate updates[64];
+  uint8_t count;
+  uint16_t i;
+
+  if (!verbose) {
+    return;
+  }
+  printf("%s:", pGateway->deviceName(device));
+  for (i=0; i<len; i++) {
+    printf(" %02x", pPayload[i]);
+  }
+  printf("\n");
+
+  count = chGateway::decodeCompactUpdates(pPayload, len, updates, sizeof(updates)/sizeof(updates[0]));
+  for (i=0; i<count; i++) {
+    printf("%s:   resource %02x = %ld\n", pGateway->deviceName(device), updates[i].resID,
+        ((updates[i].dataType == signed8DataType) || (updates[i].dataType == signed16DataType) ||
+         (updates[i].dataType == signed32DataType)) ? (long)(int32_t)updates[i].value : (long)updates[i].value);
+  }
+}
+
+static void report(chGateway *pGateway, chGatewayStats *pLast, double seconds) {
+  chGatewayStats stats;
+  int i;
+
+  printf("%-24s %9s %9s %11s %6s %6s %6s %9s %9s\n", "device", "rx fr/s", "tx fr/s",
+      "rx B/s", "crc", "len", "abort", "rtt ms", "max ms");
+  for (i=0; i<pGateway->deviceCount(); i++) {
+    pGateway->getStats(i, &stats);
+    printf("%-24s %9.1f %9.1f %11.0f %6lu %6lu %6lu ", pGateway->deviceName(i),
+        (stats.framesIn - pLast[i].framesIn) / seconds,
+        (stats.framesOut - pLast[i].framesOut) / seconds,
+        (stats.bytesIn - pLast[i].bytesIn) / seconds,
+        stats.crcErrors, stats.badLengths, stats.framesAborted);
+    if (stats.probesAnswered) {
+      printf("%9.2f %9.2f", stats.rttSumUs / 1000.0 / stats.probesAnswered, stats.rttMaxUs / 1000.0);
+    } else {
+      printf("%9s %9s", "-", "-");
+    }
+    printf("%s\n", pGateway->deviceOpen(i) ? "" : "  closed");
+    pLast[i] = stats;
+  }
+  fflush(stdout);
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: chgateway [-b baud] [-p probeMs] [-r reportMs] [-v] device...\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  static chGatewayStats last[CHGATEWAY_MAX_DEVICES];
+  chGateway gateway;
+  unsigned long baud = 115200;
+  unsigned long probeMs = 1000;
+  unsigned long reportMs = 5000;
+  unsigned long long lastProbe, lastReport, now;
+  int i;
+
+  for (i=1; i<argc; i++) {
+    if ((strcmp(argv[i], "-b") == 0) && (i+1 < argc)) {
+      baud = strtoul(argv[++i], NULL, 0);
+    } else if ((strcmp(argv[i], "-p") == 0) && (i+1 < argc)) {
+      probeMs = strtoul(argv[++i], NULL, 0);
+    } else if ((strcmp(argv[i], "-r") == 0) && (i+1 < argc)) {
+      reportMs = strtoul(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-v") == 0) {
+      verbose = 1;
+    } else if (argv[i][0] == '-') {
+      usage();
+    } else if (gateway.addDevice(argv[i], baud) < 0) {
+      return 1;
+    }
+  }
+  if ((gateway.deviceCount() == 0) || (reportMs == 0)) {
+    usage();
+  }
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  gateway.setFrameHandler(onFrame, &gateway);
+
+  lastProbe = lastReport = chGateway::nowUs();
+  while (!stopping) {
+    if (gateway.poll(10) < 0) {
+      perror("epoll_wait");
+      return 1;
+    }
+    now = chGateway::nowUs();
+    if (probeMs && (now - lastProbe >= probeMs * 1000ULL)) {
+      for (i=0; i<gateway.deviceCount(); i++) {
+        gateway.probe(i);
+      }
+      lastProbe = now;
+    }
+    if (now - lastReport >= reportMs * 1000ULL) {
+      report(&gateway, last, (now - lastReport) / 1e6);
+      lastReport = now;
+    }
+  }
+  return 0;
+}
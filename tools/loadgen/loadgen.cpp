@@ -0,0 +1,542 @@
+/*
+ * chloadgen: simulates many ChillHub devices to load a hub.
+ *
+ * Every simulated device is the library itself, announcing itself with
+ * setup(), creating cloud resources and then sending a configurable mix
+ * of messages at a fixed rate through the library's own encoders.  The
+ * devices sit on in-process socket pairs served by chGateway on a second
+ * thread (the default), or on ptys for an external hub (-p).
+ *
+ *   chloadgen [-n devices] [-r msgs/s per device] [-t seconds]
+ *             [-m mix] [-i reportMs] [-s seed] [-p [-w waitSeconds]]
+ *
+ * The mix is a list of kind:weight pairs, e.g. u16:4,batch:1; kinds are
+ * u16, u32, i16, i32 (cloud resource updates), batch (four updates through
+ * the batch calls; the hub does not negotiate batched updates, so these go
+ * out as four update messages), u8msg, u16msg (user messages) and setup (a
+ * new announcement).
+ *
+ * A JSON object per report interval and one for the whole run give the
+ * rate achieved, the messages dropped because a device's output backed
+ * up and those skipped because the generator itself could not keep up
+ * ("behind") and the device ID requests the devices answered; with the
+ * in-process hub, which probes every device once per report interval,
+ * also the frames the hub received, its CRC and framing errors and the
+ * frames lost on the way.
+ *
+ * Each device is its own chInterface on its own port and runs its loop()
+ * on every pass, so it reads what the hub sends and answers device ID
+ * requests with a new announcement.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "chillhub.h"
+#include "chgateway.h"
+
+#ifndef LOADGEN_REV
+  #define LOADGEN_REV "unknown"
+#endif
+
+// Output a device may have waiting before its messages are dropped.
+#define SIM_PENDING_SIZE 16384
+#define SIM_BACKLOG_LIMIT (SIM_PENDING_SIZE - 1024)
+
+#define FIRST_RES_ID 0x50
+#define USER_MSG_TYPE 0x60
+
+enum {
+  kindU16,
+  kindU32,
+  kindI16,
+  kindI32,
+  kindBatch,
+  kindU8Msg,
+  kindU16Msg,
+  kindSetup,
+  kindCount
+};
+static const char * const kindNames[kindCount] = {
+  "u16", "u32", "i16", "i32", "batch", "u8msg", "u16msg", "setup"
+};
+
+// The device end of a link.  Writes never block: what the descriptor does
+// not take is kept and written on the next call, as a UART driver with a
+// large buffer would.
+class simStream : public HostStream {
+  public:
+    int fd;
+    uint8_t pending[SIM_PENDING_SIZE];
+    size_t pendingLen;
+    uint8_t in[256];
+    size_t inHead;
+    size_t inLen;
+    unsigned long long bytesOut;
+    unsigned long long bytesIn;
+
+    simStream(int fd) {
+      this->fd = fd;
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      pendingLen = 0;
+      inHead = 0;
+      inLen = 0;
+      bytesOut = 0;
+      bytesIn = 0;
+    }
+
+    int available(void) {
+      ssize_t n;
+
+      if (inHead == inLen) {
+        inHead = 0;
+        inLen = 0;
+        n = ::read(fd, in, sizeof(in));
+        if (n > 0) {
+          inLen = n;
+          bytesIn += n;
+        }
+      }
+      return inLen - inHead;
+    }
+
+    int read(void) {
+      if (available() == 0) {
+        return -1;
+      }
+      return in[inHead++];
+    }
+
+    size_t write(const uint8_t *pBuf, size_t len) {
+      size_t room;
+      ssize_t n;
+
+      flush();
+      if (pendingLen == 0) {
+        n = ::write(fd, pBuf, len);
+        if (n > 0) {
+          bytesOut += n;
+          pBuf += n;
+          len -= n;
+        }
+      }
+      room = sizeof(pending) - pendingLen;
+      if (len > room) {
+        len = room; // only reachable if the backlog limit is ignored
+      }
+      memcpy(&pending[pendingLen], pBuf, len);
+      pendingLen += len;
+      return len;
+    }
+
+    void flush(void) {
+      ssize_t n;
+
+      if (pendingLen == 0) {
+        return;
+      }
+      n = ::write(fd, pending, pendingLen);
+      if (n > 0) {
+        bytesOut += n;
+        pendingLen -= n;
+        memmove(pending, &pending[n], pendingLen);
+      }
+    }
+};
+
+struct simDevice {
+  simStream *pStream;
+  HostSerial port;
+  chInterface *pLink;
+  int hubFd;              // the other end, for the in-process hub
+  char name[32];
+  char uuid[40];
+  unsigned long long nextSend;
+  unsigned long msgs;
+  unsigned long drops;
+  unsigned long behind;   // not sent because the generator fell behind
+  unsigned long idRequests;
+};
+
+struct totals {
+  unsigned long msgs;
+  unsigned long drops;
+  unsigned long behind;
+  unsigned long idRequests;
+  unsigned long framesSent;
+  unsigned long long bytesOut;
+  unsigned long long bytesIn;
+  unsigned long hubFrames;
+  unsigned long hubCrcErrors;
+  unsigned long hubFramingErrors;
+};
+
+static simDevice *devices;
+static int deviceCount = 16;
+static unsigned int mixWeights[kindCount] = { 4, 2, 1, 1, 1, 1, 0, 0 };
+static unsigned int mixTotal;
+
+static chGateway *pHub;
+static pthread_mutex_t hubLock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int hubStopping;
+
+static void *hubThread(void *pArg) {
+  (void)pArg;
+  while (!hubStopping) {
+    pthread_mutex_lock(&hubLock);
+    pHub->poll(0);
+    pthread_mutex_unlock(&hubLock);
+    usleep(500);
+  }
+  return NULL;
+}
+
+static uint8_t parseMix(const char *pSpec) {
+  char buf[256];
+  char *pItem;
+  char *pSave;
+  unsigned int k;
+
+  snprintf(buf, sizeof(buf), "%s", pSpec);
+  memset(mixWeights, 0, sizeof(mixWeights));
+  for (pItem = strtok_r(buf, ",", &pSave); pItem; pItem = strtok_r(NULL, ",", &pSave)) {
+    char *pColon = strchr(pItem, ':');
+    if (pColon) {
+      *pColon = 0;
+    }
+    for (k=0; k<kindCount; k++) {
+      if (strcmp(pItem, kindNames[k]) == 0) {
+        break;
+      }
+    }
+    if (k == kindCount) {
+      fprintf(stderr, "chloadgen: unknown message kind %s\n", pItem);
+      return 0;
+    }
+    mixWeights[k] = pColon ? strtoul(pColon + 1, NULL, 0) : 1;
+  }
+  return 1;
+}
+
+static void sendMessage(simDevice *pDev) {
+  chInterface &link = *pDev->pLink;
+  unsigned int pick = rand() % mixTotal;
+  uint16_t v = rand();
+  unsigned int k;
+  uint8_t i;
+
+  for (k=0; pick >= mixWeights[k]; k++) {
+    pick -= mixWeights[k];
+  }
+  switch (k) {
+    case kindU16: link.updateCloudResourceU16(FIRST_RES_ID, v); break;
+    case kindU32: link.updateCloudResourceU32(FIRST_RES_ID + 1, ((uint32_t)v << 16) | v); break;
+    case kindI16: link.updateCloudResourceI16(FIRST_RES_ID + 2, (int16_t)v); break;
+    case kindI32: link.updateCloudResourceI32(FIRST_RES_ID + 3, -(int32_t)v); break;
+    case kindBatch:
+      link.beginCloudUpdate();
+      for (i=0; i<4; i++) {
+        link.addCloudUpdateU16(FIRST_RES_ID + 4 + i, v + i);
+      }
+      link.commitCloudUpdate();
+      break;
+    case kindU8Msg: link.sendU8Msg(USER_MSG_TYPE, v & 0xff); break;
+    case kindU16Msg: link.sendU16Msg(USER_MSG_TYPE + 1, v); break;
+    default: link.setup(pDev->name, pDev->uuid); break;
+  }
+  pDev->msgs++;
+}
+
+// The hub asks who is there; the device it asked answers with setup().
+static void onIdRequest(uint8_t unused) {
+  chInterface *pLink = chInterface::dispatching();
+  int i;
+
+  (void)unused;
+  for (i=0; i<deviceCount; i++) {
+    if (devices[i].pLink == pLink) {
+      devices[i].idRequests++;
+      pLink->setup(devices[i].name, devices[i].uuid);
+      return;
+    }
+  }
+}
+
+static void announce(simDevice *pDev) {
+  chInterface &link = *pDev->pLink;
+  uint8_t i;
+
+  link.setup(pDev->name, pDev->uuid);
+  link.subscribe(deviceIdRequestType, onIdRequest);
+  link.createCloudResourceU16("u16", FIRST_RES_ID, 0, 0);
+  link.createCloudResourceU32("u32", FIRST_RES_ID + 1, 0, 0);
+  link.createCloudResourceI16("i16", FIRST_RES_ID + 2, 0, 0);
+  link.createCloudResourceI32("i32", FIRST_RES_ID + 3, 0, 0);
+  for (i=0; i<4; i++) {
+    char name[8];
+    snprintf(name, sizeof(name), "batch%u", i);
+    link.createCloudResourceU16(name, FIRST_RES_ID + 4 + i, 0, 0);
+  }
+  link.loop();
+}
+
+static void collect(totals *pTotals) {
+  chLinkStats link;
+  chGatewayStats hub;
+  int i;
+
+  memset(pTotals, 0, sizeof(*pTotals));
+  for (i=0; i<deviceCount; i++) {
+    devices[i].pLink->getLinkStats(&link);
+    pTotals->framesSent += link.framesSent;
+    pTotals->msgs += devices[i].msgs;
+    pTotals->drops += devices[i].drops;
+    pTotals->behind += devices[i].behind;
+    pTotals->idRequests += devices[i].idRequests;
+    pTotals->bytesOut += devices[i].pStream->bytesOut;
+    pTotals->bytesIn += devices[i].pStream->bytesIn;
+  }
+  if (pHub) {
+    pthread_mutex_lock(&hubLock);
+    for (i=0; i<pHub->deviceCount(); i++) {
+      pHub->getStats(i, &hub);
+      pTotals->hubFrames += hub.framesIn;
+      pTotals->hubCrcErrors += hub.crcErrors;
+      pTotals->hubFramingErrors += hub.badLengths + hub.framesAborted;
+    }
+    pthread_mutex_unlock(&hubLock);
+  }
+}
+
+static void report(uint8_t final, const totals *pNow, const totals *pThen, double seconds, unsigned long rate) {
+  printf("{\"bench\":\"loadgen\",\"rev\":\"%s\",\"report\":\"%s\",\"devices\":%d,"
+      "\"rate\":%lu,\"seconds\":%.2f,\"msgs_per_s\":%.1f,\"frames_per_s\":%.1f,"
+      "\"bytes_per_s\":%.0f,\"drops\":%lu,\"behind\":%lu,\"id_requests\":%lu",
+      LOADGEN_REV, final ? "total" : "interval", deviceCount, rate, seconds,
+      (pNow->msgs - pThen->msgs) / seconds,
+      (pNow->framesSent - pThen->framesSent) / seconds,
+      (pNow->bytesOut - pThen->bytesOut) / seconds,
+      pNow->drops - pThen->drops, pNow->behind - pThen->behind,
+      pNow->idRequests - pThen->idRequests);
+  if (pHub) {
+    printf(",\"hub_frames_per_s\":%.1f,\"crc_errors\":%lu,\"framing_errors\":%lu",
+        (pNow->hubFrames - pThen->hubFrames) / seconds,
+        pNow->hubCrcErrors - pThen->hubCrcErrors,
+        pNow->hubFramingErrors - pThen->hubFramingErrors);
+    if (final) {
+      // frames still in flight at an interval report would count as lost
+      printf(",\"lost\":%ld", (long)(pNow->framesSent - pThen->framesSent) -
+          (long)(pNow->hubFrames - pThen->hubFrames));
+    }
+  }
+  printf("}\n");
+  fflush(stdout);
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: chloadgen [-n devices] [-r msgs/s] [-t seconds] [-m mix] "
+      "[-i reportMs] [-s seed] [-p [-w waitSeconds]]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  unsigned long rate = 10;
+  unsigned long seconds = 10;
+  unsigned long reportMs = 1000;
+  unsigned long waitSeconds = 3;
+  unsigned int seed = 1;
+  uint8_t usePty = 0;
+  unsigned long long start, now, lastReport, interval;
+  totals first, last, current;
+  pthread_t hub;
+  struct rlimit files;
+  int i;
+  unsigned int k;
+
+  for (i=1; i<argc; i++) {
+    if ((strcmp(argv[i], "-n") == 0) && (i+1 < argc)) {
+      deviceCount = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "-r") == 0) && (i+1 < argc)) {
+      rate = strtoul(argv[++i], NULL, 0);
+    } else if ((strcmp(argv[i], "-t") == 0) && (i+1 < argc)) {
+      seconds = strtoul(argv[++i], NULL, 0);
+    } else if ((strcmp(argv[i], "-m") == 0) && (i+1 < argc)) {
+      if (!parseMix(argv[++i])) {
+        return 2;
+      }
+    } else if ((strcmp(argv[i], "-i") == 0) && (i+1 < argc)) {
+      reportMs = strtoul(argv[++i], NULL, 0);
+    } else if ((strcmp(argv[i], "-s") == 0) && (i+1 < argc)) {
+      seed = strtoul(argv[++i], NULL, 0);
+    } else if ((strcmp(argv[i], "-w") == 0) && (i+1 < argc)) {
+      waitSeconds = strtoul(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-p") == 0) {
+      usePty = 1;
+    } else {
+      usage();
+    }
+  }
+  mixTotal = 0;
+  for (k=0; k<kindCount; k++) {
+    mixTotal += mixWeights[k];
+  }
+  if ((deviceCount < 1) || (rate == 0) || (mixTotal == 0)) {
+    usage();
+  }
+  if (!usePty && (deviceCount > CHGATEWAY_MAX_DEVICES)) {
+    fprintf(stderr, "chloadgen: the built-in hub serves at most %d devices, use -p for more\n",
+        CHGATEWAY_MAX_DEVICES);
+    return 2;
+  }
+  srand(seed);
+
+  // every device takes one descriptor, two with the built-in hub
+  if (getrlimit(RLIMIT_NOFILE, &files) == 0) {
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+  }
+  devices = new simDevice[deviceCount];
+
+  if (!usePty) {
+    pHub = new chGateway();
+  }
+  for (i=0; i<deviceCount; i++) {
+    simDevice *pDev = &devices[i];
+    int fds[2];
+
+    if (usePty) {
+      char slave[64];
+      fds[0] = HostFdStream::openPty(slave, sizeof(slave));
+      if (fds[0] < 0) {
+        perror("openpty");
+        return 1;
+      }
+      fprintf(stderr, "%s\n", slave);
+    } else {
+      if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+        perror("socketpair");
+        return 1;
+      }
+      pDev->hubFd = fds[1];
+      if (pHub->addFd(fds[1], "sim") < 0) {
+        perror("addFd");
+        return 1;
+      }
+    }
+    pDev->pStream = new simStream(fds[0]);
+    pDev->port.attach(pDev->pStream);
+    pDev->pLink = new chInterface(pDev->port);
+    snprintf(pDev->name, sizeof(pDev->name), "loadgen%d", i);
+    snprintf(pDev->uuid, sizeof(pDev->uuid), "00000000-0000-4000-8000-%012x", i);
+  }
+  if (usePty) {
+    // give the hub time to open the ports before anything is sent
+    fprintf(stderr, "starting in %lu s\n", waitSeconds);
+    sleep(waitSeconds);
+  } else {
+    pthread_create(&hub, NULL, hubThread, NULL);
+  }
+
+  hostClockUseRealTime(1);
+  for (i=0; i<deviceCount; i++) {
+    announce(&devices[i]);
+  }
+  if (pHub) {
+    // the announcements are not part of the measurement
+    for (k=0; k<100; k++) {
+      collect(&first);
+      if (first.hubFrames >= first.framesSent) {
+        break;
+      }
+      usleep(10000);
+    }
+  }
+
+  interval = 1000000ULL / rate;
+  start = lastReport = chGateway::nowUs();
+  for (i=0; i<deviceCount; i++) {
+    // spread the devices over the first interval
+    devices[i].nextSend = start + interval * i / deviceCount;
+  }
+  collect(&first);
+  last = first;
+
+  do {
+    uint8_t busy = 0;
+
+    now = chGateway::nowUs();
+    for (i=0; i<deviceCount; i++) {
+      simDevice *pDev = &devices[i];
+
+      pDev->pStream->flush();
+      pDev->pLink->loop();
+      if (pDev->nextSend > now) {
+        continue;
+      }
+      busy = 1;
+      if (pDev->pStream->pendingLen > SIM_BACKLOG_LIMIT) {
+        pDev->drops++;
+      } else {
+        sendMessage(pDev);
+        pDev->pLink->loop();
+      }
+      pDev->nextSend += interval;
+      if (pDev->nextSend + 1000000ULL < now) {
+        // more than a second behind, the generator cannot keep up
+        pDev->behind += (now - pDev->nextSend) / interval;
+        pDev->nextSend = now;
+      }
+    }
+
+    if (reportMs && (now - lastReport >= reportMs * 1000ULL)) {
+      if (pHub) {
+        pthread_mutex_lock(&hubLock);
+        for (i=0; i<deviceCount; i++) {
+          pHub->probe(i);
+        }
+        pthread_mutex_unlock(&hubLock);
+      }
+      collect(&current);
+      report(0, &current, &last, (now - lastReport) / 1e6, rate);
+      last = current;
+      lastReport = now;
+    }
+    if (!busy) {
+      usleep(100);
+    }
+  } while (now - start < seconds * 1000000ULL);
+
+  // let the backlog and the hub drain before the final count
+  for (k=0; k<200; k++) {
+    uint8_t pending = 0;
+    for (i=0; i<deviceCount; i++) {
+      devices[i].pStream->flush();
+      pending |= devices[i].pStream->pendingLen > 0;
+    }
+    if (!pending) {
+      break;
+    }
+    usleep(5000);
+  }
+  if (pHub) {
+    unsigned long hubFrames;
+    do {
+      hubFrames = current.hubFrames;
+      usleep(50000);
+      collect(&current);
+    } while (current.hubFrames != hubFrames);
+    hubStopping = 1;
+    pthread_join(hub, NULL);
+  }
+
+  collect(&current);
+  report(1, &current, &first, (now - start) / 1e6, rate);
+  return 0;
+}